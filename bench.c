@@ -0,0 +1,601 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+/*
+Benchmark driver: runs a fixed set of workloads against a scratch image
+and prints one line per measurement,
+
+	result bench=<workload> image=<label> size=<bytes per op> ops=<n> seconds=... \
+		mb_per_s=... ops_per_s=... p50_us=... p90_us=... p99_us=... max_us=... \
+		reads_per_op=... writes_per_op=...
+
+Every run uses the same sizes, counts and random seeds, so two builds can
+be compared line by line.  Lines not starting with "result" are the
+summaries cache_close and disk_close print when an image is closed.
+*/
+
+#define BENCH_DATA_BLOCKS   4096	// image the read, write and churn workloads run on
+#define BENCH_FILE_BYTES    (4*1024*1024)	// file the read and write workloads use; fits the pointer format too
+#define BENCH_RANDOM_OPS    256
+#define BENCH_CHURN_FILES   512
+#define BENCH_CHURN_BYTES   8192
+#define BENCH_BATCH_SIZE    64
+#define BENCH_MOUNT_REPEATS 20
+#define BENCH_CRASH_REPEATS 5	// unclean mounts: each needs a fresh process to leave the image dirty
+#define BENCH_AGED_BLOCKS   16384
+#define BENCH_AGED_FILES    256
+#define BENCH_DEFRAG_BUDGET 64
+#define BENCH_FULL_BLOCKS   1024	// image the full-disk workload fills
+#define BENCH_PARALLEL_BYTES (1024*1024)	// file each reader thread has to itself
+#define BENCH_PARALLEL_SIZE 1024	// within one block, so every read goes through cache_read
+#define BENCH_PARALLEL_OPS  1024	// per thread
+
+static const int io_sizes[] = { 4096, 65536, 1048576 };
+static const char *stock_images[] = { "images/image.5", "images/image.20", "images/image.200" };
+static const int synthetic_blocks[] = { 16384, 65536 };
+static const int parallel_threads[] = { 1, 2, 4, 8 };
+
+static const int versions[] = { FS_VERSION_POINTERS, FS_VERSION_EXTENTS };
+static const char *version_names[] = { "pointers", "extents" };
+
+// one workload being measured: per-op latencies and the block I/O charged to it so far
+struct bench_run {
+	const char *bench;
+	const char *image;
+	int size;
+	int nops;
+	int maxops;
+	double *latency;
+	double start;
+	long long bytes;
+	int reads;
+	int writes;
+	int base_reads;		// disk counters when the I/O above was last brought up to date
+	int base_writes;
+};
+
+// one thread of the parallel read workload, timing its reads into its own slice of the run's latencies
+struct bench_reader {
+	int inumber;
+	unsigned seed;
+	double *latency;
+	int nops;
+	pthread_t thread;
+};
+
+static char scratch_path[1024];
+static int diskflags = 0;
+static __thread unsigned random_state;	// per thread, so the parallel readers each have their own sequence
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void fail( const char *what )
+{
+	printf("ERROR: %s failed!\n",what);
+	exit(1);
+}
+
+// xorshift, reseeded per workload so every run sees the same offsets
+static unsigned next_random()
+{
+	random_state ^= random_state<<13;
+	random_state ^= random_state>>17;
+	random_state ^= random_state<<5;
+	return random_state;
+}
+
+static void open_image( int nblocks )
+{
+	if(!disk_init_flags(scratch_path,nblocks,diskflags)) {
+		printf("couldn't initialize %s: %s\n",scratch_path,strerror(errno));
+		exit(1);
+	}
+	if(!cache_init((diskflags&DISK_FLAG_MMAP) ? 0 : CACHE_DEFAULT_NFRAMES)) fail("cache_init");
+}
+
+static void close_image()
+{
+	fs_unmount();
+	cache_close();
+	disk_close();
+}
+
+static void format_image( int nblocks, int version )
+{
+	unlink(scratch_path);
+	open_image(nblocks);
+	if(!fs_format_version(version)) fail("fs_format");
+	if(!fs_mount()) fail("fs_mount");
+}
+
+static void run_begin( struct bench_run *r, const char *bench, const char *image, int size, int maxops )
+{
+	r->bench = bench;
+	r->image = image;
+	r->size = size;
+	r->nops = 0;
+	r->maxops = maxops;
+	r->latency = malloc(maxops*sizeof(double));
+	if(!r->latency) fail("malloc");
+	r->bytes = 0;
+	r->reads = r->writes = 0;
+	random_state = 2463534242u;
+	disk_counts(&r->base_reads,&r->base_writes);
+	r->start = now();
+}
+
+// charge the blocks moved since the last call; needed before disk_close, which ends the counters
+static void run_count_io( struct bench_run *r )
+{
+	int reads, writes;
+	disk_counts(&reads,&writes);
+	r->reads += reads-r->base_reads;
+	r->writes += writes-r->base_writes;
+	r->base_reads = reads;
+	r->base_writes = writes;
+}
+
+// record one operation that began at t0 and moved bytes
+static void run_op( struct bench_run *r, double t0, int bytes )
+{
+	if(r->nops<r->maxops) r->latency[r->nops++] = now()-t0;
+	r->bytes += bytes;
+}
+
+static int compare_doubles( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x<y ? -1 : x>y;
+}
+
+static double percentile( const struct bench_run *r, int p )
+{
+	if(r->nops==0) return 0;
+	return r->latency[(r->nops-1)*p/100]*1e6;
+}
+
+// fs_sync first, so write-back traffic is charged to the workload that caused it
+static void run_end( struct bench_run *r )
+{
+	fs_sync();
+	double seconds = now()-r->start;
+	run_count_io(r);
+
+	qsort(r->latency,r->nops,sizeof(double),compare_doubles);
+	int ops = r->nops ? r->nops : 1;
+
+	printf("result bench=%s image=%s size=%d ops=%d seconds=%.6f mb_per_s=%.2f ops_per_s=%.1f",
+		r->bench,r->image,r->size,r->nops,seconds,
+		seconds>0 ? r->bytes/seconds/(1024*1024) : 0,
+		seconds>0 ? r->nops/seconds : 0);
+	printf(" p50_us=%.1f p90_us=%.1f p99_us=%.1f max_us=%.1f",
+		percentile(r,50),percentile(r,90),percentile(r,99),percentile(r,100));
+	printf(" reads_per_op=%.2f writes_per_op=%.2f\n",
+		(double)r->reads/ops,(double)r->writes/ops);
+	fflush(stdout);
+
+	free(r->latency);
+}
+
+static void bench_read_write( int version, char *buffer )
+{
+	struct bench_run r;
+	const char *label = version_names[version];
+	double t;
+
+	format_image(BENCH_DATA_BLOCKS,version);
+
+	for(int s=0;s<(int)(sizeof(io_sizes)/sizeof(io_sizes[0]));s++) {
+		int size = io_sizes[s];
+		int slots = BENCH_FILE_BYTES/size;
+		int inumber = fs_create();
+		if(inumber<=0) fail("fs_create");
+
+		run_begin(&r,"seq_write",label,size,slots);
+		for(int i=0;i<slots;i++) {
+			t = now();
+			if(fs_write(inumber,buffer,size,i*size)!=size) fail("fs_write");
+			run_op(&r,t,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,"seq_read",label,size,slots);
+		for(int i=0;i<slots;i++) {
+			t = now();
+			if(fs_read(inumber,buffer,size,i*size)!=size) fail("fs_read");
+			run_op(&r,t,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,"rand_read",label,size,BENCH_RANDOM_OPS);
+		for(int i=0;i<BENCH_RANDOM_OPS;i++) {
+			int offset = (int)(next_random()%slots)*size;
+			t = now();
+			if(fs_read(inumber,buffer,size,offset)!=size) fail("fs_read");
+			run_op(&r,t,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,"rand_write",label,size,BENCH_RANDOM_OPS);
+		for(int i=0;i<BENCH_RANDOM_OPS;i++) {
+			int offset = (int)(next_random()%slots)*size;
+			t = now();
+			if(fs_write(inumber,buffer,size,offset)!=size) fail("fs_write");
+			run_op(&r,t,size);
+		}
+		run_end(&r);
+
+		if(!fs_delete(inumber)) fail("fs_delete");
+	}
+
+	close_image();
+}
+
+static void bench_churn( int version, char *buffer )
+{
+	struct bench_run r;
+	const char *label = version_names[version];
+	int inumbers[BENCH_CHURN_FILES];
+	double t;
+
+	format_image(BENCH_DATA_BLOCKS,version);
+
+	// one file at a time, immediate and then deferred deletes; the second round reuses the freed inodes
+	for(int deferred=0;deferred<2;deferred++) {
+		run_begin(&r,deferred ? "churn_recreate" : "churn_create",label,BENCH_CHURN_BYTES,BENCH_CHURN_FILES);
+		for(int i=0;i<BENCH_CHURN_FILES;i++) {
+			t = now();
+			inumbers[i] = fs_create();
+			if(inumbers[i]<=0) fail("fs_create");
+			if(fs_write(inumbers[i],buffer,BENCH_CHURN_BYTES,0)!=BENCH_CHURN_BYTES) fail("fs_write");
+			run_op(&r,t,BENCH_CHURN_BYTES);
+		}
+		run_end(&r);
+
+		fs_set_deferred_delete(deferred);
+		run_begin(&r,deferred ? "churn_delete_deferred" : "churn_delete",label,0,BENCH_CHURN_FILES);
+		for(int i=0;i<BENCH_CHURN_FILES;i++) {
+			t = now();
+			if(!fs_delete(inumbers[i])) fail("fs_delete");
+			run_op(&r,t,0);
+		}
+		run_end(&r);
+
+		if(deferred) {
+			run_begin(&r,"reclaim",label,0,1);
+			t = now();
+			if(fs_reclaim(0)<0) fail("fs_reclaim");
+			run_op(&r,t,0);
+			run_end(&r);
+			fs_set_deferred_delete(0);
+		}
+	}
+
+	// the batch calls, BENCH_BATCH_SIZE inodes per op
+	run_begin(&r,"batch_create",label,BENCH_BATCH_SIZE,BENCH_CHURN_FILES/BENCH_BATCH_SIZE);
+	for(int i=0;i<BENCH_CHURN_FILES;i+=BENCH_BATCH_SIZE) {
+		t = now();
+		if(fs_create_batch(BENCH_BATCH_SIZE,inumbers+i)!=BENCH_BATCH_SIZE) fail("fs_create_batch");
+		run_op(&r,t,0);
+	}
+	run_end(&r);
+
+	run_begin(&r,"batch_delete",label,BENCH_BATCH_SIZE,BENCH_CHURN_FILES/BENCH_BATCH_SIZE);
+	for(int i=0;i<BENCH_CHURN_FILES;i+=BENCH_BATCH_SIZE) {
+		t = now();
+		if(fs_delete_batch(inumbers+i,BENCH_BATCH_SIZE)!=BENCH_BATCH_SIZE) fail("fs_delete_batch");
+		run_op(&r,t,0);
+	}
+	run_end(&r);
+
+	close_image();
+}
+
+/*
+Fill a small image with 64 KB writes until one comes up short, then make
+sure a write past the end of another file, which finds no space at all,
+fails without growing that file over the hole it would have left.
+*/
+static void bench_full_disk( int version, char *buffer )
+{
+	struct bench_run r;
+	const char *label = version_names[version];
+	int size = io_sizes[1];
+	double t;
+
+	format_image(BENCH_FULL_BLOCKS,version);
+	int small = fs_create();
+	if(small<=0) fail("fs_create");
+	if(fs_write(small,buffer,BENCH_CHURN_BYTES,0)!=BENCH_CHURN_BYTES) fail("fs_write");
+
+	int inumber = fs_create();
+	if(inumber<=0) fail("fs_create");
+	run_begin(&r,"fill",label,size,BENCH_FULL_BLOCKS*DISK_BLOCK_SIZE/size+1);
+	for(int offset=0;;offset+=size) {
+		t = now();
+		int n = fs_write(inumber,buffer,size,offset);
+		if(n<0) fail("fs_write");
+		run_op(&r,t,n);
+		if(n<size) break;
+	}
+	run_end(&r);
+
+	if(fs_write(small,buffer,size,BENCH_CHURN_BYTES+size)!=0) fail("fs_write on a full disk");
+	if(fs_getsize(small)!=BENCH_CHURN_BYTES) fail("keeping the size over a failed fs_write");
+
+	close_image();
+}
+
+static void copy_image( const char *source )
+{
+	char buffer[DISK_BLOCK_SIZE];
+	FILE *in = fopen(source,"r");
+	if(!in) {
+		printf("couldn't open %s: %s\n",source,strerror(errno));
+		exit(1);
+	}
+	FILE *out = fopen(scratch_path,"w");
+	if(!out) {
+		printf("couldn't open %s: %s\n",scratch_path,strerror(errno));
+		exit(1);
+	}
+
+	size_t n;
+	while((n=fread(buffer,1,sizeof(buffer),in))>0) fwrite(buffer,1,n,out);
+
+	fclose(in);
+	fclose(out);
+}
+
+// only fs_mount is timed, but the I/O per op includes the bitmaps each fs_unmount stores
+static void bench_mounts( const char *bench, const char *label, int nblocks, int repeats )
+{
+	struct bench_run r;
+	double t;
+
+	open_image(nblocks);
+	run_begin(&r,bench,label,0,repeats);
+	for(int i=0;i<repeats;i++) {
+		t = now();
+		if(!fs_mount()) fail("fs_mount");
+		run_op(&r,t,0);
+		if(!fs_unmount()) fail("fs_unmount");
+	}
+	run_end(&r);
+	close_image();
+}
+
+// mount in a child that exits without unmounting, so the image is left marked not clean
+static void leave_unclean( int nblocks )
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid<0) fail("fork");
+	if(pid==0) {
+		open_image(nblocks);
+		if(!fs_mount()) _exit(1);
+		_exit(0);
+	}
+
+	int status;
+	if(waitpid(pid,&status,0)<0 || !WIFEXITED(status) || WEXITSTATUS(status)) fail("unclean mount");
+}
+
+static void bench_mount_images( char *buffer )
+{
+	char label[64];
+	struct bench_run r;
+	double t;
+
+	for(int i=0;i<(int)(sizeof(stock_images)/sizeof(stock_images[0]));i++) {
+		FILE *f = fopen(stock_images[i],"r");
+		if(!f) {
+			printf("couldn't open %s: %s\n",stock_images[i],strerror(errno));
+			exit(1);
+		}
+		fseek(f,0,SEEK_END);
+		int nblocks = ftell(f)/DISK_BLOCK_SIZE;
+		fclose(f);
+
+		copy_image(stock_images[i]);
+		bench_mounts("mount",strrchr(stock_images[i],'/')+1,nblocks,BENCH_MOUNT_REPEATS);
+	}
+
+	// synthetic images, a quarter full of 16 KB files
+	for(int i=0;i<(int)(sizeof(synthetic_blocks)/sizeof(synthetic_blocks[0]));i++) {
+		int nblocks = synthetic_blocks[i];
+		int nfiles = nblocks/16;
+		snprintf(label,sizeof(label),"synthetic.%d",nblocks);
+
+		format_image(nblocks,FS_VERSION_EXTENTS);
+		run_begin(&r,"populate",label,4*DISK_BLOCK_SIZE,nfiles);
+		for(int j=0;j<nfiles;j++) {
+			t = now();
+			int inumber = fs_create();
+			if(inumber<=0) fail("fs_create");
+			if(fs_write(inumber,buffer,4*DISK_BLOCK_SIZE,0)!=4*DISK_BLOCK_SIZE) fail("fs_write");
+			run_op(&r,t,4*DISK_BLOCK_SIZE);
+		}
+		run_end(&r);
+		close_image();
+
+		bench_mounts("mount",label,nblocks,BENCH_MOUNT_REPEATS);
+
+		run_begin(&r,"mount_unclean",label,0,BENCH_CRASH_REPEATS);
+		for(int j=0;j<BENCH_CRASH_REPEATS;j++) {
+			leave_unclean(nblocks);
+			open_image(nblocks);
+			disk_counts(&r.base_reads,&r.base_writes);
+			t = now();
+			if(!fs_mount()) fail("fs_mount");
+			run_op(&r,t,0);
+			run_count_io(&r);
+			close_image();
+		}
+		run_end(&r);
+	}
+}
+
+/*
+Age an image the way a busy directory does: files grow a block at a time
+in round robin, so their blocks interleave, then every third one is
+deleted and the survivors grow into the holes that leaves.
+*/
+static void age_image( int version, char *buffer, int *inumbers )
+{
+	format_image(BENCH_AGED_BLOCKS,version);
+	for(int i=0;i<BENCH_AGED_FILES;i++) {
+		inumbers[i] = fs_create();
+		if(inumbers[i]<=0) fail("fs_create");
+	}
+	for(int round=0;round<24;round++) {
+		if(round==16) {
+			for(int i=0;i<BENCH_AGED_FILES;i+=3) fs_delete(inumbers[i]);
+		}
+		for(int i=0;i<BENCH_AGED_FILES;i++) {
+			if(round>=16 && i%3==0) continue;
+			if(fs_write(inumbers[i],buffer,DISK_BLOCK_SIZE,round*DISK_BLOCK_SIZE)!=DISK_BLOCK_SIZE) fail("fs_write");
+		}
+	}
+	fs_sync();
+}
+
+static void bench_defrag( int version, char *buffer )
+{
+	struct bench_run r;
+	const char *label = version_names[version];
+	int inumbers[BENCH_AGED_FILES];
+	int moved;
+	double t;
+
+	age_image(version,buffer,inumbers);
+	run_begin(&r,"defrag",label,0,1);
+	t = now();
+	moved = fs_defrag();
+	if(moved<0) fail("fs_defrag");
+	run_op(&r,t,moved*DISK_BLOCK_SIZE);
+	run_end(&r);
+	close_image();
+
+	// the same aging, defragmented in small steps; bytes count the blocks each step moved
+	age_image(version,buffer,inumbers);
+	run_begin(&r,"defrag_step",label,BENCH_DEFRAG_BUDGET,BENCH_AGED_BLOCKS);
+	do {
+		t = now();
+		moved = fs_defrag_step(BENCH_DEFRAG_BUDGET);
+		if(moved<0) fail("fs_defrag_step");
+		run_op(&r,t,moved*DISK_BLOCK_SIZE);
+	} while(moved>0 && r.nops<r.maxops);
+	run_end(&r);
+	close_image();
+}
+
+static void *parallel_reader( void *arg )
+{
+	struct bench_reader *reader = arg;
+	char data[BENCH_PARALLEL_SIZE];
+
+	random_state = reader->seed;
+	for(int i=0;i<BENCH_PARALLEL_OPS;i++) {
+		int offset = (int)(next_random()%(BENCH_PARALLEL_BYTES/BENCH_PARALLEL_SIZE))*BENCH_PARALLEL_SIZE;
+		double t = now();
+		if(fs_read(reader->inumber,data,BENCH_PARALLEL_SIZE,offset)!=BENCH_PARALLEL_SIZE) break;
+		reader->latency[reader->nops++] = now()-t;
+	}
+	return 0;
+}
+
+/*
+Random reads from several threads at once, each in its own file, so the
+files together are far bigger than the cache and nearly every read is a
+miss.  mb_per_s is the total over all threads, and should grow with their
+number as long as misses wait for the disk without holding the cache.
+*/
+static void bench_parallel_read( int version, char *buffer )
+{
+	int maxthreads = parallel_threads[sizeof(parallel_threads)/sizeof(parallel_threads[0])-1];
+	struct bench_reader readers[maxthreads];
+	struct bench_run r;
+	char name[64];
+
+	format_image(BENCH_DATA_BLOCKS,version);
+	for(int i=0;i<maxthreads;i++) {
+		readers[i].inumber = fs_create();
+		if(readers[i].inumber<=0) fail("fs_create");
+		for(int offset=0;offset<BENCH_PARALLEL_BYTES;offset+=io_sizes[2]) {
+			if(fs_write(readers[i].inumber,buffer,io_sizes[2],offset)!=io_sizes[2]) fail("fs_write");
+		}
+	}
+	fs_sync();
+
+	for(int n=0;n<(int)(sizeof(parallel_threads)/sizeof(parallel_threads[0]));n++) {
+		int nthreads = parallel_threads[n];
+		snprintf(name,sizeof(name),"parallel_read_%d",nthreads);
+		run_begin(&r,name,version_names[version],BENCH_PARALLEL_SIZE,nthreads*BENCH_PARALLEL_OPS);
+		for(int i=0;i<nthreads;i++) {
+			readers[i].seed = random_state+i;
+			readers[i].latency = r.latency+i*BENCH_PARALLEL_OPS;
+			readers[i].nops = 0;
+			if(pthread_create(&readers[i].thread,0,parallel_reader,&readers[i])) fail("pthread_create");
+		}
+
+		// the latencies are gathered at the front of the run's array for run_end to sort
+		for(int i=0;i<nthreads;i++) {
+			pthread_join(readers[i].thread,0);
+			if(readers[i].nops<BENCH_PARALLEL_OPS) fail("fs_read");
+			memmove(r.latency+r.nops,readers[i].latency,readers[i].nops*sizeof(double));
+			r.nops += readers[i].nops;
+			r.bytes += (long long)readers[i].nops*BENCH_PARALLEL_SIZE;
+		}
+		run_end(&r);
+	}
+	close_image();
+}
+
+int main( int argc, char *argv[] )
+{
+	int usage = 0;
+	for(int i=2;i<argc;i++) {
+		if(!strcmp(argv[i],"mmap")) diskflags |= DISK_FLAG_MMAP;
+		else if(!strcmp(argv[i],"checksum")) diskflags |= DISK_FLAG_CHECKSUMS;
+		else usage = 1;
+	}
+	if(usage) {
+		printf("use: %s [scratchdir] [mmap] [checksum]\n",argv[0]);
+		return 1;
+	}
+	snprintf(scratch_path,sizeof(scratch_path),"%s/bench.img",argc>=2 ? argv[1] : ".");
+
+	char *buffer = malloc(io_sizes[sizeof(io_sizes)/sizeof(io_sizes[0])-1]);
+	if(!buffer) fail("malloc");
+	for(int i=0;i<io_sizes[sizeof(io_sizes)/sizeof(io_sizes[0])-1];i++) buffer[i] = 'a'+i%26;
+
+	for(int v=0;v<(int)(sizeof(versions)/sizeof(versions[0]));v++) {
+		bench_read_write(versions[v],buffer);
+		bench_churn(versions[v],buffer);
+		bench_full_disk(versions[v],buffer);
+		bench_defrag(versions[v],buffer);
+		bench_parallel_read(versions[v],buffer);
+	}
+	bench_mount_images(buffer);
+
+	unlink(scratch_path);
+	free(buffer);
+	return 0;
+}
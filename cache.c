@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "stats.h"
+
+/*
+Write-back cache of DISK_BLOCK_SIZE frames sitting between fs.c and disk.c.
+Frames are found through a chained hash on the block number and replaced
+with the CLOCK algorithm; dirty frames only reach the disk when evicted or
+when cache_flush() is called.  With zero frames every call goes straight
+through to disk.c.  Frames are filled asynchronously, by cache_prefetch()
+and by the misses of cache_read() and cache_peek() alike; such a frame
+carries the id of its read, and lookup() waits for it before the frame is
+used.
+
+Every call is safe from several threads at once: one mutex covers the
+frames and their hash, and range requests are waited for by the thread
+that submitted them.  The mutex is dropped while a frame's read is waited
+for, so one thread's miss does not stall the others' hits and misses.
+Frames a cache_peek() view points into are pinned until cache_unpeek(), so
+another thread cannot recycle them meanwhile; a frame being waited for is
+pinned the same way.
+*/
+
+struct cache_frame {
+	int blocknum;
+	int next;		// next frame in the same hash chain, -1 ends the chain
+	bool valid;
+	bool dirty;
+	bool referenced;
+	int pending;	// aio id of a read still filling the frame, -1 when none
+	int pins;		// cache_peek() views still outstanding; a pinned frame is never replaced
+};
+
+static struct cache_frame *frames;
+static char *frame_data;
+static int *buckets;
+static int nframes=0;
+static int nbuckets=0;
+static int clock_hand=0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nhits=0;
+static int nmisses=0;
+static int nevictions=0;
+static int nwritebacks=0;
+static int nprefetches=0;
+
+#define CACHE_MAX_INFLIGHT 64	// range requests cache_wait() tracks before it waits for them early
+
+// per thread, so cache_wait() only waits for the caller's own requests
+static __thread int inflight[CACHE_MAX_INFLIGHT];	// ids of range requests submitted since the last cache_wait()
+static __thread int ninflight=0;
+
+static __thread char scratch[DISK_BLOCK_SIZE] __attribute__((aligned(64)));	// cache_peek's buffer when there are no frames and no mapping
+
+int cache_init( int n )
+{
+	if(n<0) return 0;
+
+	nframes = n;
+	clock_hand = 0;
+	nhits = nmisses = nevictions = nwritebacks = nprefetches = 0;
+	ninflight = 0;
+	if(nframes==0) return 1;
+
+	nbuckets = 1;
+	while(nbuckets<2*nframes) nbuckets *= 2;
+
+	frames = calloc(nframes,sizeof(*frames));
+	frame_data = malloc((size_t)nframes*DISK_BLOCK_SIZE);
+	buckets = malloc(nbuckets*sizeof(*buckets));
+	if(!frames || !frame_data || !buckets) {
+		printf("ERROR: couldn't allocate block cache!\n");
+		abort();
+	}
+
+	for(int i=0;i<nbuckets;i++) buckets[i] = -1;
+
+	return 1;
+}
+
+static char *frame_block( int f )
+{
+	return frame_data + (size_t)f*DISK_BLOCK_SIZE;
+}
+
+static int hash( int blocknum )
+{
+	return (int)(((unsigned)blocknum * 2654435761u) & (nbuckets-1));
+}
+
+// wait out a read still filling frame f, with cache_lock dropped meanwhile; the pin keeps f bound to its block
+static void settle( int f )
+{
+	while(frames[f].pending>=0) {
+		int id = frames[f].pending;
+		frames[f].pins++;
+		pthread_mutex_unlock(&cache_lock);
+		disk_aio_wait(id);
+		pthread_mutex_lock(&cache_lock);
+		frames[f].pins--;
+		if(frames[f].pending==id) frames[f].pending = -1;
+	}
+}
+
+// start filling a frame just claimed for a miss; lookup() or settle() waits for it
+static void fill( int f )
+{
+	frames[f].pending = disk_submit_read(frames[f].blocknum,1,frame_block(f));
+}
+
+static int lookup( int blocknum )
+{
+	if(nframes==0) return -1;
+	for(int f=buckets[hash(blocknum)]; f>=0; f=frames[f].next) {
+		if(frames[f].blocknum==blocknum) {
+			settle(f);
+			return f;
+		}
+	}
+	return -1;
+}
+
+static void unlink_frame( int f )
+{
+	int *link = &buckets[hash(frames[f].blocknum)];
+	while(*link!=f) link = &frames[*link].next;
+	*link = frames[f].next;
+}
+
+static void writeback( int f )
+{
+	if(frames[f].dirty) {
+		disk_write(frames[f].blocknum,frame_block(f));
+		frames[f].dirty = false;
+		nwritebacks++;
+	}
+}
+
+/*
+Pick a victim with CLOCK, write it back if needed and rebind it to blocknum.
+Frames still being read are passed over while there is anything else to
+take; only when there is not is a prefetch waited out, and then with
+cache_lock held, since the caller counts on the hash not changing between
+its failed lookup() and this.
+*/
+static int replace( int blocknum )
+{
+	int f;
+	for(int sweep=0; ; sweep++) {
+		if(sweep>4*nframes) {
+			printf("ERROR: every cache frame is pinned!\n");
+			abort();
+		}
+		f = clock_hand;
+		clock_hand = (clock_hand+1)%nframes;
+		if(!frames[f].valid) break;
+		if(frames[f].pins) continue;
+		if(frames[f].pending>=0 && sweep<=2*nframes) continue;
+		if(!frames[f].referenced) break;
+		frames[f].referenced = false;
+	}
+
+	if(frames[f].valid) {
+		if(frames[f].pending>=0) disk_aio_wait(frames[f].pending);
+		writeback(f);
+		unlink_frame(f);
+		nevictions++;
+	}
+
+	int h = hash(blocknum);
+	frames[f].blocknum = blocknum;
+	frames[f].valid = true;
+	frames[f].dirty = false;
+	frames[f].referenced = true;
+	frames[f].pending = -1;
+	frames[f].pins = 0;
+	frames[f].next = buckets[h];
+	buckets[h] = f;
+
+	return f;
+}
+
+void cache_read( int blocknum, char *data )
+{
+	if(nframes==0) {
+		disk_read(blocknum,data);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	int f = lookup(blocknum);
+	if(f>=0) {
+		nhits++;
+		STATS_CACHE(1,1);
+	} else {
+		nmisses++;
+		STATS_CACHE(0,1);
+		f = replace(blocknum);
+		fill(f);
+		settle(f);
+	}
+	frames[f].referenced = true;
+	memcpy(data,frame_block(f),DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+A read-only view of a block's current contents, without copying it out:
+the frame holding it, or the mapped block itself when the disk is mapped.
+The view must be handed back with cache_unpeek(); until then the frame
+under it stays put, whatever other threads do to the cache.
+*/
+const char *cache_peek( int blocknum )
+{
+	pthread_mutex_lock(&cache_lock);
+	int f = lookup(blocknum);
+	if(f>=0) {
+		nhits++;
+		STATS_CACHE(1,1);
+		frames[f].referenced = true;
+		frames[f].pins++;
+		pthread_mutex_unlock(&cache_lock);
+		return frame_block(f);
+	}
+
+	const char *mapped = disk_block_ptr(blocknum);
+	if(mapped || nframes==0) {
+		pthread_mutex_unlock(&cache_lock);
+		if(mapped) return mapped;
+		disk_read(blocknum,scratch);
+		return scratch;
+	}
+
+	nmisses++;
+	STATS_CACHE(0,1);
+	f = replace(blocknum);
+	fill(f);
+	settle(f);
+	frames[f].pins++;
+	pthread_mutex_unlock(&cache_lock);
+	return frame_block(f);
+}
+
+void cache_unpeek( const char *data )
+{
+	if(nframes==0 || data<frame_data || data>=frame_data+(size_t)nframes*DISK_BLOCK_SIZE) return;
+	pthread_mutex_lock(&cache_lock);
+	frames[(data-frame_data)/DISK_BLOCK_SIZE].pins--;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	if(nframes==0) {
+		disk_write(blocknum,data);
+		return;
+	}
+
+	// whole-block writes never need the old contents, so a miss just claims a frame
+	pthread_mutex_lock(&cache_lock);
+	int f = lookup(blocknum);
+	if(f>=0) {
+		nhits++;
+		STATS_CACHE(1,1);
+	} else {
+		nmisses++;
+		STATS_CACHE(0,1);
+		f = replace(blocknum);
+	}
+	frames[f].referenced = true;
+	frames[f].dirty = true;
+	memcpy(frame_block(f),data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+// remember a submitted range request for cache_wait()
+static void track( int id )
+{
+	if(ninflight==CACHE_MAX_INFLIGHT) cache_wait();
+	inflight[ninflight++] = id;
+}
+
+/*
+Ranges are for bulk data: hits are served from (or refreshed in) their
+frames, but missing blocks move straight between the disk and the caller's
+buffer without being pulled into the cache.
+*/
+static void read_range( int blocknum, int count, char *data, bool async )
+{
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<count;) {
+		int f = lookup(blocknum+i);
+		if(f>=0) {
+			nhits++;
+			STATS_CACHE(1,1);
+			frames[f].referenced = true;
+			memcpy(data+(size_t)i*DISK_BLOCK_SIZE,frame_block(f),DISK_BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		// gather the run of consecutive misses and read it in one go
+		int start = i;
+		do {
+			if(nframes) {
+				nmisses++;
+				STATS_CACHE(0,1);
+			}
+			i++;
+		} while(i<count && lookup(blocknum+i)<0);
+		if(async) track(disk_submit_read(blocknum+start,i-start,data+(size_t)start*DISK_BLOCK_SIZE));
+		else disk_read_range(blocknum+start,i-start,data+(size_t)start*DISK_BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_read_range( int blocknum, int count, char *data )
+{
+	read_range(blocknum,count,data,false);
+}
+
+// the same, but misses are only submitted: the data is there once cache_wait() returns
+void cache_read_range_async( int blocknum, int count, char *data )
+{
+	read_range(blocknum,count,data,true);
+}
+
+static void write_range( int blocknum, int count, const char *data, bool async )
+{
+	// the whole run is written through, so any cached copy becomes clean
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<count;i++) {
+		int f = lookup(blocknum+i);
+		if(f<0) continue;
+		nhits++;
+		STATS_CACHE(1,1);
+		memcpy(frame_block(f),data+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		frames[f].dirty = false;
+	}
+
+	if(async) track(disk_submit_write(blocknum,count,data));
+	else disk_write_range(blocknum,count,data);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_write_range( int blocknum, int count, const char *data )
+{
+	write_range(blocknum,count,data,false);
+}
+
+// the caller's buffer must stay untouched until cache_wait()
+void cache_write_range_async( int blocknum, int count, const char *data )
+{
+	write_range(blocknum,count,data,true);
+}
+
+// wait for the range requests only: prefetches keep going in the background
+void cache_wait()
+{
+	for(int i=0;i<ninflight;i++) disk_aio_wait(inflight[i]);
+	ninflight = 0;
+}
+
+/*
+Start reading blocks into frames without waiting for them.  Blocks already
+cached are just marked referenced, which keeps a hot block such as an
+indirect pointer block from being evicted.  At most half the frames are
+handed out per call, so read-ahead cannot flush the whole cache.
+*/
+void cache_prefetch( const int *blocknums, int count )
+{
+	if(nframes==0) return;
+	if(count>nframes/2) count = nframes/2;
+
+	pthread_mutex_lock(&cache_lock);
+	for(int i=0;i<count;i++) {
+		int f = lookup(blocknums[i]);
+		if(f>=0) {
+			frames[f].referenced = true;
+			continue;
+		}
+		f = replace(blocknums[i]);
+		frames[f].pending = disk_submit_read(blocknums[i],1,frame_block(f));
+		nprefetches++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_flush()
+{
+	struct disk_iovec *reqs = malloc((nframes ? nframes : 1)*sizeof(*reqs));
+	if(!reqs) {
+		printf("ERROR: couldn't allocate block cache!\n");
+		abort();
+	}
+
+	// hand every dirty frame to disk_writev so adjacent blocks go out as one run
+	pthread_mutex_lock(&cache_lock);
+	int n = 0;
+	for(int f=0;f<nframes;f++) {
+		if(!frames[f].valid || !frames[f].dirty) continue;
+		reqs[n].blocknum = frames[f].blocknum;
+		reqs[n].data = frame_block(f);
+		frames[f].dirty = false;
+		n++;
+	}
+	if(n>0) disk_writev(reqs,n);
+	nwritebacks += n;
+	pthread_mutex_unlock(&cache_lock);
+
+	free(reqs);
+}
+
+void cache_close()
+{
+	if(!frames) return;
+
+	disk_aio_wait_all();
+	cache_flush();
+
+	printf("%d cache hits\n",nhits);
+	printf("%d cache misses\n",nmisses);
+	printf("%d cache evictions\n",nevictions);
+	printf("%d cache writebacks\n",nwritebacks);
+	if(nprefetches) printf("%d cache prefetches\n",nprefetches);
+
+	free(frames);
+	free(frame_data);
+	free(buckets);
+	frames = 0;
+	frame_data = 0;
+	buckets = 0;
+	nframes = 0;
+}
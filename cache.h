@@ -0,0 +1,20 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_DEFAULT_NFRAMES 64
+
+int  cache_init( int nframes );
+void cache_read( int blocknum, char *data );
+const char *cache_peek( int blocknum );
+void cache_unpeek( const char *data );
+void cache_write( int blocknum, const char *data );
+void cache_read_range( int blocknum, int count, char *data );
+void cache_write_range( int blocknum, int count, const char *data );
+void cache_read_range_async( int blocknum, int count, char *data );
+void cache_write_range_async( int blocknum, int count, const char *data );
+void cache_wait();
+void cache_prefetch( const int *blocknums, int count );
+void cache_flush();
+void cache_close();
+
+#endif
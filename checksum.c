@@ -0,0 +1,139 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "checksum.h"
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1<<7)
+#endif
+#endif
+
+/*
+The CRC instructions take eight bytes a cycle but only give their result
+three cycles later, so a long buffer is run as three lanes of LANE bytes at
+once, each a CRC of its own, and the three are joined after: carrying a CRC
+on past LANE more bytes gives the CRC of those bytes alone plus a change to
+the CRC carried that is the same whatever the bytes are, and is linear in
+it, so shift() can look it up a byte at a time.  A 4 KB block is three lanes
+and 16 bytes.  The table engine does eight bytes a step, slicing by 8.
+*/
+
+#define POLY 0x82f63b78	// reflected
+#define LANE 1360	// a multiple of 8
+
+static uint32_t byte_table[8][256];	// [k][b]: CRC of byte b followed by k zero bytes
+static uint32_t shift_table[4][256];	// [k][b]: b<<8k carried past LANE zero bytes
+static uint32_t (*engine)( uint32_t crc, const unsigned char *p, size_t n );
+static const char *engine_name;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint64_t load64( const unsigned char *p )
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static uint32_t shift( uint32_t crc )
+{
+	return shift_table[0][crc&0xff] ^ shift_table[1][(crc>>8)&0xff] ^ shift_table[2][(crc>>16)&0xff] ^ shift_table[3][crc>>24];
+}
+
+// the engines work on the CRC as it stands, without the inversions crc32c adds at either end
+static uint32_t table_update( uint32_t crc, const unsigned char *p, size_t n )
+{
+	for(;n>=8;n-=8,p+=8) {
+		uint64_t v = load64(p)^crc;
+		crc = byte_table[7][v&0xff] ^ byte_table[6][(v>>8)&0xff] ^ byte_table[5][(v>>16)&0xff] ^ byte_table[4][(v>>24)&0xff]
+			^ byte_table[3][(v>>32)&0xff] ^ byte_table[2][(v>>40)&0xff] ^ byte_table[1][(v>>48)&0xff] ^ byte_table[0][v>>56];
+	}
+	for(;n>0;n--,p++) crc = byte_table[0][(crc^*p)&0xff] ^ (crc>>8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t sse42_update( uint32_t crc, const unsigned char *p, size_t n )
+{
+	for(;n>=3*LANE;n-=3*LANE,p+=3*LANE) {
+		uint64_t a = crc, b = 0, c = 0;
+		for(int i=0;i<LANE;i+=8) {
+			a = __builtin_ia32_crc32di(a,load64(p+i));
+			b = __builtin_ia32_crc32di(b,load64(p+LANE+i));
+			c = __builtin_ia32_crc32di(c,load64(p+2*LANE+i));
+		}
+		crc = shift(shift((uint32_t)a)^(uint32_t)b)^(uint32_t)c;
+	}
+	uint64_t x = crc;
+	for(;n>=8;n-=8,p+=8) x = __builtin_ia32_crc32di(x,load64(p));
+	crc = (uint32_t)x;
+	for(;n>0;n--,p++) crc = __builtin_ia32_crc32qi(crc,*p);
+	return crc;
+}
+
+#elif defined(__aarch64__)
+
+__attribute__((target("+crc")))
+static uint32_t armv8_update( uint32_t crc, const unsigned char *p, size_t n )
+{
+	for(;n>=3*LANE;n-=3*LANE,p+=3*LANE) {
+		uint32_t a = crc, b = 0, c = 0;
+		for(int i=0;i<LANE;i+=8) {
+			a = __builtin_aarch64_crc32cx(a,load64(p+i));
+			b = __builtin_aarch64_crc32cx(b,load64(p+LANE+i));
+			c = __builtin_aarch64_crc32cx(c,load64(p+2*LANE+i));
+		}
+		crc = shift(shift(a)^b)^c;
+	}
+	for(;n>=8;n-=8,p+=8) crc = __builtin_aarch64_crc32cx(crc,load64(p));
+	for(;n>0;n--,p++) crc = __builtin_aarch64_crc32cb(crc,*p);
+	return crc;
+}
+
+#endif
+
+static void setup()
+{
+	for(int b=0;b<256;b++) {
+		uint32_t c = b;
+		for(int k=0;k<8;k++) c = c&1 ? (c>>1)^POLY : c>>1;
+		byte_table[0][b] = c;
+	}
+	for(int k=1;k<8;k++) {
+		for(int b=0;b<256;b++) byte_table[k][b] = (byte_table[k-1][b]>>8) ^ byte_table[0][byte_table[k-1][b]&0xff];
+	}
+
+	static const unsigned char zeros[LANE];
+	for(int k=0;k<4;k++) {
+		for(int b=0;b<256;b++) shift_table[k][b] = table_update((uint32_t)b<<(8*k),zeros,LANE);
+	}
+
+	engine = table_update;
+	engine_name = "table";
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")) {
+		engine = sse42_update;
+		engine_name = "sse4.2";
+	}
+#elif defined(__aarch64__)
+	if(getauxval(AT_HWCAP)&HWCAP_CRC32) {
+		engine = armv8_update;
+		engine_name = "armv8";
+	}
+#endif
+}
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length )
+{
+	pthread_once(&once,setup);
+	return ~engine(~crc,data,length);
+}
+
+const char *crc32c_engine()
+{
+	pthread_once(&once,setup);
+	return engine_name;
+}
@@ -0,0 +1,12 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), with the CPU's CRC instructions where it has them (SSE4.2, ARMv8) and tables otherwise
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length );	// crc extended over data; start from 0
+const char *crc32c_engine();	// "sse4.2", "armv8" or "table"
+
+#endif
@@ -0,0 +1,142 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "compress.h"
+
+/*
+The format is LZ4's block format but for its rules about how a block
+ends: a sequence of tokens, each a byte whose high nibble counts literals
+and whose low nibble is a match length less MIN_MATCH, 15 in either
+meaning more length follows in bytes that add 255 each until one that is
+less.  The literals come next and then, unless the input ends there, the
+match: a two-byte little-endian offset back into the output, then its
+further length bytes.  A match may overlap what it copies, which is how a
+run of one byte comes out.
+
+The encoder finds matches with a table of where each 4-byte sequence was
+last seen, and steps faster over input that keeps missing, so finding out
+that data does not compress costs little.
+*/
+
+#define MIN_MATCH   4
+#define HASH_BITS   12
+#define MAX_OFFSET  65535
+#define SKIP_SHIFT  5	// every 32 misses in a row widen the step by a byte
+
+static uint32_t read32( const char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+static int hash( uint32_t v )
+{
+	return (int)((v*2654435761u) >> (32-HASH_BITS));
+}
+
+// a length past what its nibble holds, as bytes of 255 and a remainder; 0 if they do not fit
+static int put_length( char *dst, int *out, int capacity, int length )
+{
+	for(;length>=255;length-=255) {
+		if(*out>=capacity) return 0;
+		dst[(*out)++] = (char)255;
+	}
+	if(*out>=capacity) return 0;
+	dst[(*out)++] = (char)length;
+	return 1;
+}
+
+// one sequence: nliterals literals, then unless match is 0 a match of that length from offset back
+static int put_sequence( char *dst, int *out, int capacity, const char *literals, int nliterals, int offset, int match )
+{
+	if(*out>=capacity) return 0;
+	int token = (*out)++;
+	int high = nliterals<15 ? nliterals : 15, low = 0;
+
+	if(nliterals>=15 && !put_length(dst,out,capacity,nliterals-15)) return 0;
+	if(nliterals>capacity-*out) return 0;
+	memcpy(dst+*out,literals,nliterals);
+	*out += nliterals;
+
+	if(match) {
+		int extra = match-MIN_MATCH;
+		low = extra<15 ? extra : 15;
+		if(capacity-*out<2) return 0;
+		dst[(*out)++] = (char)(offset&0xff);
+		dst[(*out)++] = (char)(offset>>8);
+		if(extra>=15 && !put_length(dst,out,capacity,extra-15)) return 0;
+	}
+	dst[token] = (char)(high<<4 | low);
+	return 1;
+}
+
+int compress_block( const char *src, int length, char *dst, int capacity )
+{
+	int table[1<<HASH_BITS];
+	for(int h=0;h<(1<<HASH_BITS);h++) table[h] = -1;
+
+	int out = 0, anchor = 0, misses = 0;
+	for(int i=0;i+MIN_MATCH<=length;) {
+		uint32_t sequence = read32(src+i);
+		int h = hash(sequence);
+		int candidate = table[h];
+		table[h] = i;
+		if(candidate<0 || i-candidate>MAX_OFFSET || read32(src+candidate)!=sequence) {
+			i += 1+(misses++>>SKIP_SHIFT);
+			continue;
+		}
+
+		int match = MIN_MATCH;
+		while(i+match<length && src[candidate+match]==src[i+match]) match++;
+		if(!put_sequence(dst,&out,capacity,src+anchor,i-anchor,i-candidate,match)) return 0;
+		i += match;
+		anchor = i;
+		misses = 0;
+	}
+	if(anchor<length && !put_sequence(dst,&out,capacity,src+anchor,length-anchor,0,0)) return 0;
+	return out;
+}
+
+// a length continued past its nibble; -1 if the input ends first
+static int get_length( const unsigned char *src, int length, int *in, int nibble )
+{
+	int total = nibble;
+	if(nibble<15) return total;
+	for(;;) {
+		if(*in>=length) return -1;
+		int b = src[(*in)++];
+		total += b;
+		if(b<255) return total;
+	}
+}
+
+int decompress_block( const char *src, int length, char *dst, int capacity )
+{
+	const unsigned char *bytes = (const unsigned char *)src;
+	int in = 0, out = 0;
+	while(in<length) {
+		int token = bytes[in++];
+		int nliterals = get_length(bytes,length,&in,token>>4);
+		if(nliterals<0 || nliterals>length-in || nliterals>capacity-out) return -1;
+		memcpy(dst+out,src+in,nliterals);
+		in += nliterals;
+		out += nliterals;
+		if(in==length) break;
+
+		if(length-in<2) return -1;
+		int offset = bytes[in] | bytes[in+1]<<8;
+		in += 2;
+		int match = get_length(bytes,length,&in,token&15);
+		if(match<0) return -1;
+		match += MIN_MATCH;
+		if(offset==0 || offset>out || match>capacity-out) return -1;
+		if(offset>=match) {
+			memcpy(dst+out,dst+out-offset,match);
+			out += match;
+		} else {
+			for(int k=0;k<match;k++,out++) dst[out] = dst[out-offset];
+		}
+	}
+	return out;
+}
@@ -0,0 +1,9 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// a byte-oriented LZ77 codec in the LZ4 mould, for fs.c's compressed chunks: fast both ways, no entropy coding
+
+int compress_block( const char *src, int length, char *dst, int capacity );	// bytes written to dst, 0 if they would not fit in capacity
+int decompress_block( const char *src, int length, char *dst, int capacity );	// bytes written to dst, -1 if src is damaged or would not fit
+
+#endif
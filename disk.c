@@ -3,27 +3,206 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
+#include "checksum.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
+typedef char block_size_is_supported[DISK_BLOCK_SIZE>=4096 && DISK_BLOCK_SIZE<=65536 && (DISK_BLOCK_SIZE&(DISK_BLOCK_SIZE-1))==0 ? 1 : -1];
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+/*
+Striping.  The disk may be several images, its members, and its blocks go
+to them a stripe unit at a time in turn, so a member holds every
+nmembers'th unit and any range of the disk is one contiguous range on each
+member it touches.  A transfer is split into one piece per member (split),
+and when there are several the asynchronous engine runs them at once, so a
+long read or write moves at the speed of all the members together.  A
+single image is the plain case: its one piece is the whole transfer, and
+it is laid out block for block as before.
+*/
+
+static int nmembers=0;
+static int memberfd[DISK_MAX_MEMBERS];
+static char *membermap[DISK_MAX_MEMBERS];	// each member whole, when opened with DISK_FLAG_MMAP
+static size_t mapsize[DISK_MAX_MEMBERS];	// member 0's includes its checksum area
+static int mapped=0;
+static int stripe=1;		// blocks per stripe unit
+static int memberblocks=0;	// blocks each member holds, checksum area aside
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
+static int nreadcalls=0;
+static int nwritecalls=0;
+static int nmapped=0;
+static int naiorequests=0;
+static int diskflags=0;
+
+// a transfer's share on one member: blocks from start there, through the iovecs
+struct piece {
+	int member;
+	int start;
+	int iovcnt;
+	struct iovec *iov;
+	int state;	// an aio_state, for an asynchronous request's piece
+};
+
+/*
+Checksums.  With DISK_FLAG_CHECKSUMS the image is followed by a checksum
+area (the first image, when there are several): a header block, then the
+CRC32C of every block of the disk in turn.  sums holds the same in memory.
+A write updates a block's sum and then writes it to the area, so the two
+can only disagree on disk if the block's own write tore or never finished;
+a read checks each block against its sum and reports one that fails,
+handing it back as it was read.  A crash between the two leaves the block
+failing until it is written again, which is what a torn write looks like
+too.  An image opened without the flag loses its area, so its sums are
+never stale: if the header does not match when the flag is next given, the
+area is made afresh from the blocks as they are.
+*/
+
+#define VERIFY_BLOCKS 256	// blocks disk_verify reads at a time
+
+struct sum_header {
+	uint32_t magic;
+	int nblocks;
+};
+
+static uint32_t *sums=0;
+static int nbadsums=0;
+
+static int sums_open();
+static int queue( int blocknum, int count, const struct iovec *iov, int iovcnt, int writing, char *check );
+
+// the counters are bumped from any thread, the aio workers included
+static void tally( int *counter, int n )
+{
+	__atomic_add_fetch(counter,n,__ATOMIC_RELAXED);
+}
+
+static void tally_blocks( int writing, int n )
+{
+	tally(writing ? &nwrites : &nreads,n);
+	STATS_DISK(writing,n);
+}
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_flags(filename,n,0);
+}
+
+int disk_init_flags( const char *filename, int n, int flags )
+{
+	return disk_init_striped(filename,n,DISK_STRIPE_DEFAULT_BLOCKS,flags);
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+// the header block and the sums
+static int checksum_area_blocks( int n )
+{
+	return 1+(int)(((size_t)n*sizeof(uint32_t)+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE);
+}
+
+static void close_members()
+{
+	for(int m=0;m<nmembers;m++) {
+		if(membermap[m]) munmap(membermap[m],mapsize[m]);
+		membermap[m] = 0;
+		if(memberfd[m]>=0) close(memberfd[m]);
+		memberfd[m] = -1;
+	}
+	nmembers = 0;
+	mapped = 0;
+}
 
+static int open_member( int m, const char *filename, int nsumblocks, int flags )
+{
+	memberfd[m] = open(filename,O_RDWR|O_CREAT,0666);
+	membermap[m] = 0;
+	if(memberfd[m]<0) return 0;
+
+	mapsize[m] = (size_t)(memberblocks+(m==0 ? nsumblocks : 0))*DISK_BLOCK_SIZE;
+	if(ftruncate(memberfd[m],(off_t)mapsize[m])<0) return 0;
+
+	if((flags&DISK_FLAG_MMAP) && memberblocks>0) {
+		void *map = mmap(0,mapsize[m],PROT_READ|PROT_WRITE,MAP_SHARED,memberfd[m],0);
+		if(map==MAP_FAILED) return 0;
+		membermap[m] = map;
+	}
+	return 1;
+}
+
+int disk_init_striped( const char *filenames, int n, int stripe_blocks, int flags )
+{
+	int members = 1;
+	for(const char *p=filenames;*p;p++) members += *p==',';
+	if(members>DISK_MAX_MEMBERS || stripe_blocks<1) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	// every member holds the same whole number of stripe units, but a single image is exactly the disk
+	stripe = stripe_blocks;
+	memberblocks = members==1 ? n : ((n+stripe-1)/stripe+members-1)/members*stripe;
+	int nsumblocks = (flags&DISK_FLAG_CHECKSUMS) ? checksum_area_blocks(n) : 0;
+
+	nmembers = 0;
+	for(const char *name=filenames;nmembers<members;nmembers++) {
+		const char *end = strchr(name,',');
+		size_t length = end ? (size_t)(end-name) : strlen(name);
+		char filename[PATH_MAX];
+		int ok = length>0 && length<sizeof(filename);
+		if(ok) {
+			memcpy(filename,name,length);
+			filename[length] = 0;
+			ok = open_member(nmembers,filename,nsumblocks,flags);
+		} else {
+			errno = length ? ENAMETOOLONG : EINVAL;
+			memberfd[nmembers] = -1;
+			membermap[nmembers] = 0;
+		}
+		if(!ok) {
+			int error = errno;
+			nmembers++;	// so that close_members takes this one too
+			close_members();
+			errno = error;
+			return 0;
+		}
+		name = end ? end+1 : name+length;
+	}
+
+	diskflags = flags;
+	mapped = membermap[0]!=0;
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	nreadcalls = 0;
+	nwritecalls = 0;
+	nmapped = 0;
+	naiorequests = 0;
+	nbadsums = 0;
+
+	if(nsumblocks && !sums_open()) {
+		free(sums);
+		sums = 0;
+		close_members();
+		return 0;
+	}
 
 	return 1;
 }
@@ -33,6 +212,18 @@ int disk_size()
 	return nblocks;
 }
 
+void disk_counts( int *reads, int *writes )
+{
+	*reads = __atomic_load_n(&nreads,__ATOMIC_RELAXED);
+	*writes = __atomic_load_n(&nwrites,__ATOMIC_RELAXED);
+}
+
+/*
+The bounds checks on every request.  cache.c and fs.c only ask for blocks
+that are there, so a release build, without -DFS_CHECKS, leaves them out.
+*/
+#ifdef FS_CHECKS
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
@@ -51,41 +242,827 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static void range_check( int blocknum, int count, const void *data )
 {
 	sanity_check(blocknum,data);
+	if(count<1) {
+		printf("ERROR: block count (%d) is not positive!\n",count);
+		abort();
+	}
+	sanity_check(blocknum+count-1,data);
+}
+
+#else
+
+#define sanity_check(blocknum,data) ((void)0)
+#define range_check(blocknum,count,data) ((void)0)
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+#endif
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+static void io_failure()
+{
+	printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+	abort();
+}
+
+// the member holding blocknum, and where it is there
+static int member_of( int blocknum, int *start )
+{
+	int unit = blocknum/stripe;
+	*start = unit/nmembers*stripe+blocknum%stripe;
+	return unit%nmembers;
+}
+
+// a block in place, on a mapped disk
+static char *block_addr( int blocknum )
+{
+	int start, m = member_of(blocknum,&start);
+	return membermap[m]+(size_t)start*DISK_BLOCK_SIZE;
+}
+
+// the iovecs split may need, for count blocks held in iovcnt of them: each stretch ends at an iovec's end or a unit's
+static int split_bound( int count, int iovcnt )
+{
+	return nmembers==1 ? iovcnt : iovcnt+count/stripe+1;
+}
+
+/*
+Split count blocks from blocknum, held in iov, into a piece per member they
+touch: pieces[] gets them in the order they are first touched, and out[],
+with room for split_bound iovecs, their iovecs, each piece's together.  The
+first pass counts each member's stretches to place them.  Returns the
+number of pieces.
+*/
+static int split( int blocknum, int count, const struct iovec *iov, int iovcnt, struct piece *pieces, struct iovec *out )
+{
+	if(nmembers==1) {
+		memcpy(out,iov,iovcnt*sizeof(*iov));
+		pieces[0] = (struct piece){ 0, blocknum, iovcnt, out, 0 };
+		return 1;
+	}
+
+	int npieces = 0, index[DISK_MAX_MEMBERS], stretches[DISK_MAX_MEMBERS];
+	for(int m=0;m<nmembers;m++) index[m] = -1;
+	for(int pass=0;pass<2;pass++) {
+		for(int k=0,next=0;pass && k<npieces;k++) {
+			pieces[k].iov = out+next;
+			next += stretches[pieces[k].member];
+		}
+		int b = blocknum;
+		for(int i=0;i<iovcnt;i++) {
+			char *base = iov[i].iov_base;
+			for(int left=iov[i].iov_len/DISK_BLOCK_SIZE;left>0;) {
+				int start, m = member_of(b,&start);
+				int n = stripe-b%stripe<left ? stripe-b%stripe : left;
+				size_t length = (size_t)n*DISK_BLOCK_SIZE;
+				if(!pass) {
+					if(index[m]<0) {
+						index[m] = npieces;
+						stretches[m] = 0;
+						pieces[npieces++] = (struct piece){ m, start, 0, 0, 0 };
+					}
+					stretches[m]++;
+				} else {
+					struct piece *p = &pieces[index[m]];
+					struct iovec *last = p->iovcnt ? &p->iov[p->iovcnt-1] : 0;
+					if(last && (char*)last->iov_base+last->iov_len==base) last->iov_len += length;
+					else p->iov[p->iovcnt++] = (struct iovec){ base, length };
+				}
+				base += length;
+				left -= n;
+				b += n;
+			}
+		}
+	}
+	return npieces;
+}
+
+/*
+Move a run of contiguous blocks of a member through the iovecs, retrying
+until the kernel has taken all of it: preadv/pwritev may legally stop
+short, and take at most IOV_MAX iovecs at a time.
+*/
+static void transfer_at( int fd, off_t offset, struct iovec *iov, int iovcnt, int writing )
+{
+	while(iovcnt>0) {
+		int n = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t done = writing ? pwritev(fd,iov,n,offset) : preadv(fd,iov,n,offset);
+		if(done<=0) {
+			if(done<0 && errno==EINTR) continue;
+			if(done==0) errno = EIO;
+			io_failure();
+		}
+		// asynchronous requests run this from worker threads
+		if(writing) __atomic_add_fetch(&nwritecalls,1,__ATOMIC_RELAXED);
+		else __atomic_add_fetch(&nreadcalls,1,__ATOMIC_RELAXED);
+
+		offset += done;
+		while(iovcnt>0 && (size_t)done>=iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt>0) {
+			iov->iov_base = (char*)iov->iov_base+done;
+			iov->iov_len -= done;
+		}
+	}
+}
+
+// a piece, synchronously; its iovecs are used up
+static void run_piece( struct piece *p, int writing )
+{
+	if(mapped) {
+		char *at = membermap[p->member]+(size_t)p->start*DISK_BLOCK_SIZE;
+		for(int i=0;i<p->iovcnt;i++) {
+			if(writing) memcpy(at,p->iov[i].iov_base,p->iov[i].iov_len);
+			else memcpy(p->iov[i].iov_base,at,p->iov[i].iov_len);
+			at += p->iov[i].iov_len;
+		}
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
+		transfer_at(memberfd[p->member],(off_t)p->start*DISK_BLOCK_SIZE,p->iov,p->iovcnt,writing);
 	}
 }
 
-void disk_write( int blocknum, const char *data )
+/*
+Move count blocks from blocknum through the iovecs, which are used up.
+When they span several members, the pieces go to the asynchronous engine
+together and this waits for them all.
+*/
+static void transfer( int blocknum, int count, struct iovec *iov, int iovcnt, int writing )
 {
-	sanity_check(blocknum,data);
+	if(nmembers==1 || blocknum/stripe==(blocknum+count-1)/stripe) {
+		int start, m = member_of(blocknum,&start);
+		transfer_at(memberfd[m],(off_t)start*DISK_BLOCK_SIZE,iov,iovcnt,writing);
+	} else {
+		disk_aio_wait(queue(blocknum,count,iov,iovcnt,writing,0));
+	}
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+// count blocks from blocknum, whichever way the disk is opened, with no counting or checking
+static void move_blocks( int blocknum, int count, char *data, int writing )
+{
+	if(mapped) {
+		// a stripe unit at a time, each contiguous in its member
+		for(int b=blocknum;b<blocknum+count;) {
+			int n = nmembers==1 ? count : stripe-b%stripe;
+			if(n>blocknum+count-b) n = blocknum+count-b;
+			char *at = data+(size_t)(b-blocknum)*DISK_BLOCK_SIZE;
+			if(writing) memcpy(block_addr(b),at,(size_t)n*DISK_BLOCK_SIZE);
+			else memcpy(at,block_addr(b),(size_t)n*DISK_BLOCK_SIZE);
+			b += n;
+		}
+	} else {
+		struct iovec iov = { data, (size_t)count*DISK_BLOCK_SIZE };
+		transfer(blocknum,count,&iov,1,writing);
+	}
+}
+
+static off_t sums_offset( int blocknum )
+{
+	return (off_t)(memberblocks+1)*DISK_BLOCK_SIZE+(off_t)blocknum*sizeof(uint32_t);
+}
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+// raw access to the checksum area, on the first member, which the block counts leave out
+static void area_transfer( off_t offset, void *data, size_t length, int writing )
+{
+	if(mapped) {
+		if(writing) memcpy(membermap[0]+offset,data,length);
+		else memcpy(data,membermap[0]+offset,length);
 	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+		struct iovec iov = { data, length };
+		transfer_at(memberfd[0],offset,&iov,1,writing);
+	}
+}
+
+/*
+Load the sums, or make them from the blocks if the area is not theirs.  The
+header goes last, once the sums are down, so an area cut short is made
+again the next time too.
+*/
+static int sums_open()
+{
+	sums = malloc((size_t)(nblocks>0 ? nblocks : 1)*sizeof(uint32_t));
+	if(!sums) return 0;
+
+	struct sum_header header;
+	off_t header_offset = (off_t)memberblocks*DISK_BLOCK_SIZE;
+	area_transfer(header_offset,&header,sizeof(header),0);
+	area_transfer(sums_offset(0),sums,(size_t)nblocks*sizeof(uint32_t),0);
+	if(header.magic==DISK_MAGIC && header.nblocks==nblocks) return 1;
+
+	char *buffer = malloc((size_t)VERIFY_BLOCKS*DISK_BLOCK_SIZE);
+	if(!buffer) return 0;
+	for(int b=0;b<nblocks;b+=VERIFY_BLOCKS) {
+		int count = nblocks-b<VERIFY_BLOCKS ? nblocks-b : VERIFY_BLOCKS;
+		move_blocks(b,count,buffer,0);
+		for(int i=0;i<count;i++) sums[b+i] = crc32c(0,buffer+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+	}
+	free(buffer);
+	area_transfer(sums_offset(0),sums,(size_t)nblocks*sizeof(uint32_t),1);
+	header = (struct sum_header){ DISK_MAGIC, nblocks };
+	area_transfer(header_offset,&header,sizeof(header),1);
+	return 1;
+}
+
+// count blocks are about to be written from data: record their sums, in memory and in the area
+static void sums_update( int blocknum, int count, const char *data )
+{
+	if(!sums) return;
+	for(int i=0;i<count;i++) {
+		__atomic_store_n(&sums[blocknum+i],crc32c(0,data+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE),__ATOMIC_RELAXED);
+	}
+	area_transfer(sums_offset(blocknum),&sums[blocknum],(size_t)count*sizeof(uint32_t),1);
+}
+
+// count blocks just read into data: report each that fails its sum; returns how many did
+static int sums_check( int blocknum, int count, const char *data )
+{
+	if(!sums) return 0;
+	int bad = 0;
+	for(int i=0;i<count;i++) {
+		if(crc32c(0,data+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE)!=__atomic_load_n(&sums[blocknum+i],__ATOMIC_RELAXED)) {
+			printf("ERROR: block %d fails its checksum!\n",blocknum+i);
+			bad++;
+		}
+	}
+	if(bad) tally(&nbadsums,bad);
+	return bad;
+}
+
+void disk_read( int blocknum, char *data )
+{
+	disk_read_range(blocknum,1,data);
+}
+
+void disk_write( int blocknum, const char *data )
+{
+	disk_write_range(blocknum,1,data);
+}
+
+void disk_read_range( int blocknum, int count, char *data )
+{
+	range_check(blocknum,count,data);
+	move_blocks(blocknum,count,data,0);
+	tally_blocks(0,count);
+	sums_check(blocknum,count,data);
+}
+
+void disk_write_range( int blocknum, int count, const char *data )
+{
+	range_check(blocknum,count,data);
+	sums_update(blocknum,count,data);
+	move_blocks(blocknum,count,(char*)data,1);
+	tally_blocks(1,count);
+}
+
+const char *disk_block_ptr( int blocknum )
+{
+	if(!mapped) return 0;
+	sanity_check(blocknum,membermap[0]);
+	tally(&nmapped,1);
+	sums_check(blocknum,1,block_addr(blocknum));
+	return block_addr(blocknum);
+}
+
+int disk_verify( int blocknum, int count )
+{
+	if(!sums) return -1;
+	range_check(blocknum,count,sums);
+
+	int bad = 0;
+	if(mapped) {
+		for(int b=blocknum;b<blocknum+count;b++) bad += sums_check(b,1,block_addr(b));
+		tally_blocks(0,count);
+		return bad;
+	}
+
+	char *buffer = malloc((size_t)VERIFY_BLOCKS*DISK_BLOCK_SIZE);
+	if(!buffer) {
+		printf("ERROR: out of memory!\n");
+		abort();
+	}
+	for(int b=blocknum;b<blocknum+count;b+=VERIFY_BLOCKS) {
+		int n = blocknum+count-b<VERIFY_BLOCKS ? blocknum+count-b : VERIFY_BLOCKS;
+		move_blocks(b,n,buffer,0);
+		tally_blocks(0,n);
+		bad += sums_check(b,n,buffer);
+	}
+	free(buffer);
+	return bad;
+}
+
+int disk_checksum_failures()
+{
+	return __atomic_load_n(&nbadsums,__ATOMIC_RELAXED);
+}
+
+void disk_sync()
+{
+	for(int m=0;m<nmembers;m++) {
+		int result = mapped ? msync(membermap[m],mapsize[m],MS_SYNC) : fsync(memberfd[m]);
+		if(result<0) io_failure();
+	}
+}
+
+static int compare_blocknum( const void *a, const void *b )
+{
+	const struct disk_iovec *x = a;
+	const struct disk_iovec *y = b;
+	return (x->blocknum>y->blocknum) - (x->blocknum<y->blocknum);
+}
+
+/*
+Sort the request list by block number, then issue each run of
+consecutive block numbers as a single vectored call.
+*/
+static void vectored( struct disk_iovec *reqs, int count, int writing )
+{
+	struct iovec iov[IOV_MAX];
+
+	for(int i=0;i<count;i++) sanity_check(reqs[i].blocknum,reqs[i].data);
+	for(int i=0;writing && i<count;i++) sums_update(reqs[i].blocknum,1,reqs[i].data);
+
+	if(mapped) {
+		for(int i=0;i<count;i++) {
+			char *block = block_addr(reqs[i].blocknum);
+			if(writing) memcpy(block,reqs[i].data,DISK_BLOCK_SIZE);
+			else memcpy(reqs[i].data,block,DISK_BLOCK_SIZE);
+		}
+		tally_blocks(writing,count);
+		for(int i=0;!writing && i<count;i++) sums_check(reqs[i].blocknum,1,reqs[i].data);
+		return;
+	}
+
+	qsort(reqs,count,sizeof(*reqs),compare_blocknum);
+
+	for(int i=0;i<count;) {
+		int start = reqs[i].blocknum;
+		int n = 0;
+		while(i<count && n<IOV_MAX && reqs[i].blocknum==start+n) {
+			iov[n].iov_base = reqs[i].data;
+			iov[n].iov_len = DISK_BLOCK_SIZE;
+			n++;
+			i++;
+		}
+		// a duplicate block number closes the run; the later entry starts the next one
+		transfer(start,n,iov,n,writing);
+	}
+
+	tally_blocks(writing,count);
+	for(int i=0;!writing && i<count;i++) sums_check(reqs[i].blocknum,1,reqs[i].data);
+}
+
+void disk_readv( struct disk_iovec *reqs, int count )
+{
+	vectored(reqs,count,0);
+}
+
+void disk_writev( struct disk_iovec *reqs, int count )
+{
+	vectored(reqs,count,1);
+}
+
+/*
+Asynchronous block I/O.  Requests live in a fixed table of aio_depth slots;
+a request id is its slot plus a generation count, so waiting on a request
+that has long since finished (and whose slot was reused) just returns.
+Generations wrap before slot plus generation times aio_depth could pass
+INT_MAX, so ids stay non-negative however many requests a run makes.
+The engine is io_uring when the kernel lets us set up a ring, and a pool
+of worker threads running the ordinary positional calls otherwise.  Each
+piece of a request goes to the engine on its own, and the request is done
+once all of them are.  Slot state is only touched with aio_lock held.
+*/
+
+#define AIO_INLINE_IOVECS (2*DISK_MAX_MEMBERS+2)	// a request's iovecs past this many are allocated
+
+enum aio_state { AIO_FREE, AIO_QUEUED, AIO_RUNNING, AIO_DONE };
+
+struct aio_request {
+	enum aio_state state;
+	unsigned generation;
+	int blocknum;
+	int count;
+	int writing;
+	char *check;		// a submitted read's buffer, whose sums are checked when it is retired
+	int npieces;
+	int pending;		// pieces not done yet
+	struct piece pieces[DISK_MAX_MEMBERS];
+	struct iovec *iovs;	// the pieces' iovecs, inline_iovs unless there are too many
+	struct iovec inline_iovs[AIO_INLINE_IOVECS];
+	int error;
+};
+
+static struct aio_request *aio_slots=0;
+static int aio_depth=0;
+static int aio_inflight=0;
+
+// io_uring engine
+static int ring_fd=-1;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size, sqes_size;
+
+// thread pool engine
+static pthread_t *aio_workers=0;
+static int aio_nworkers=0;
+static int aio_stopping=0;
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t aio_init_lock = PTHREAD_MUTEX_INITIALIZER;	// the first submits may race to start the engine
+static int aio_ready=0;		// set, with release order, once the engine is fully set up
+static pthread_cond_t aio_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_finished = PTHREAD_COND_INITIALIZER;
+
+static int ring_setup( int depth )
+{
+	struct io_uring_params p;
+	memset(&p,0,sizeof(p));
+
+	ring_fd = syscall(__NR_io_uring_setup,depth,&p);
+	if(ring_fd<0) return 0;
+
+	sq_ring_size = p.sq_off.array+p.sq_entries*sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+	sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(0,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQ_RING);
+	cq_ring = mmap(0,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_CQ_RING);
+	sqes = mmap(0,sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring_fd,IORING_OFF_SQES);
+	if(sq_ring==MAP_FAILED || cq_ring==MAP_FAILED || sqes==MAP_FAILED) {
+		if(sq_ring!=MAP_FAILED) munmap(sq_ring,sq_ring_size);
+		if(cq_ring!=MAP_FAILED) munmap(cq_ring,cq_ring_size);
+		if(sqes!=MAP_FAILED) munmap(sqes,sqes_size);
+		close(ring_fd);
+		ring_fd = -1;
+		return 0;
+	}
+
+	sq_head = (unsigned*)((char*)sq_ring+p.sq_off.head);
+	sq_tail = (unsigned*)((char*)sq_ring+p.sq_off.tail);
+	sq_mask = (unsigned*)((char*)sq_ring+p.sq_off.ring_mask);
+	sq_array = (unsigned*)((char*)sq_ring+p.sq_off.array);
+	cq_head = (unsigned*)((char*)cq_ring+p.cq_off.head);
+	cq_tail = (unsigned*)((char*)cq_ring+p.cq_off.tail);
+	cq_mask = (unsigned*)((char*)cq_ring+p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)((char*)cq_ring+p.cq_off.cqes);
+
+	return 1;
+}
+
+// one piece of a slot's request; its completion carries both, and a short one is finished synchronously
+static void ring_submit( int slot, int k )
+{
+	struct aio_request *r = &aio_slots[slot];
+	struct piece *piece = &r->pieces[k];
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = r->writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = memberfd[piece->member];
+	sqe->addr = (unsigned long)piece->iov;
+	sqe->len = piece->iovcnt<IOV_MAX ? piece->iovcnt : IOV_MAX;
+	sqe->off = (off_t)piece->start*DISK_BLOCK_SIZE;
+	sqe->user_data = (unsigned long)slot*DISK_MAX_MEMBERS+k;
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail,tail+1,__ATOMIC_RELEASE);
+
+	while(syscall(__NR_io_uring_enter,ring_fd,1,0,0,0,0)<0) {
+		if(errno!=EINTR) io_failure();
+	}
+}
+
+// the kernel moved done bytes of a piece: move the rest synchronously
+static void finish_piece( struct piece *piece, size_t done, int writing )
+{
+	off_t offset = (off_t)piece->start*DISK_BLOCK_SIZE+done;
+	struct iovec *iov = piece->iov;
+	int iovcnt = piece->iovcnt;
+	while(iovcnt>0 && done>=iov->iov_len) {
+		done -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	if(iovcnt==0) return;
+	iov->iov_base = (char*)iov->iov_base+done;
+	iov->iov_len -= done;
+	transfer_at(memberfd[piece->member],offset,iov,iovcnt,writing);
+}
+
+// reap every completion the kernel has posted; with wait, block until there is at least one
+static void ring_reap( int wait )
+{
+	if(wait && __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)==*cq_head) {
+		while(syscall(__NR_io_uring_enter,ring_fd,0,1,IORING_ENTER_GETEVENTS,0,0)<0) {
+			if(errno!=EINTR) io_failure();
+		}
+	}
+
+	unsigned head = *cq_head;
+	while(head!=__atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+		struct aio_request *r = &aio_slots[cqe->user_data/DISK_MAX_MEMBERS];
+		if(cqe->res<0) r->error = -cqe->res;
+		else finish_piece(&r->pieces[cqe->user_data%DISK_MAX_MEMBERS],cqe->res,r->writing);
+		if(--r->pending==0) r->state = AIO_DONE;
+		head++;
+		__atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+	}
+}
+
+static void *aio_worker( void *arg )
+{
+	pthread_mutex_lock(&aio_lock);
+	while(1) {
+		struct aio_request *r = 0;
+		struct piece *piece = 0;
+		for(int i=0;i<aio_depth && !piece;i++) {
+			if(aio_slots[i].state!=AIO_QUEUED) continue;
+			for(int k=0;k<aio_slots[i].npieces && !piece;k++) {
+				if(aio_slots[i].pieces[k].state==AIO_QUEUED) piece = &aio_slots[i].pieces[k];
+			}
+			r = &aio_slots[i];
+		}
+		if(!piece) {
+			if(aio_stopping) break;
+			pthread_cond_wait(&aio_queued,&aio_lock);
+			continue;
+		}
+
+		piece->state = AIO_RUNNING;
+		pthread_mutex_unlock(&aio_lock);
+
+		transfer_at(memberfd[piece->member],(off_t)piece->start*DISK_BLOCK_SIZE,piece->iov,piece->iovcnt,r->writing);
+
+		pthread_mutex_lock(&aio_lock);
+		piece->state = AIO_DONE;
+		if(--r->pending==0) {
+			r->state = AIO_DONE;
+			pthread_cond_broadcast(&aio_finished);
+		}
+	}
+	pthread_mutex_unlock(&aio_lock);
+	return 0;
+}
+
+static int aio_setup( int depth )
+{
+	if(aio_slots) return 1;
+	if(depth<1) depth = DISK_AIO_DEFAULT_DEPTH;
+
+	aio_slots = calloc(depth,sizeof(*aio_slots));
+	if(!aio_slots) return 0;
+	aio_depth = depth;
+	aio_inflight = 0;
+
+	if(mapped) return 1;	// mapped requests complete as they are submitted
+	if(!(diskflags&DISK_FLAG_AIO_THREADS) && ring_setup(depth*nmembers)) return 1;
+
+	// enough threads to keep every member busy, up to the cap
+	int want = depth*nmembers;
+	aio_stopping = 0;
+	aio_nworkers = want<DISK_AIO_MAX_WORKERS*nmembers ? want : DISK_AIO_MAX_WORKERS*nmembers;
+	aio_workers = malloc(aio_nworkers*sizeof(*aio_workers));
+	if(!aio_workers) return 0;
+	for(int i=0;i<aio_nworkers;i++) {
+		if(pthread_create(&aio_workers[i],0,aio_worker,0)!=0) {
+			aio_nworkers = i;
+			break;
+		}
+	}
+	// with no thread at all, requests are simply run at submit time
+	return 1;
+}
+
+int disk_aio_init( int depth )
+{
+	pthread_mutex_lock(&aio_init_lock);
+	int ok = aio_setup(depth);
+	if(ok) __atomic_store_n(&aio_ready,1,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&aio_init_lock);
+	return ok;
+}
+
+// the slot's request has finished: check for errors and, for a submitted read, the sums, then hand the slot back
+static void retire( struct aio_request *r )
+{
+	if(r->error) {
+		errno = r->error;
+		io_failure();
+	}
+	if(r->check) sums_check(r->blocknum,r->count,r->check);
+	if(r->iovs!=r->inline_iovs) free(r->iovs);
+	r->iovs = 0;
+	r->state = AIO_FREE;
+	r->generation = (r->generation+1)%(unsigned)(INT_MAX/aio_depth);
+	aio_inflight--;
+}
+
+static int first_done()
+{
+	for(int i=0;i<aio_depth;i++) {
+		if(aio_slots[i].state==AIO_DONE) return i;
+	}
+	return -1;
+}
+
+/*
+Block until slot's request of this generation is done (or, with slot < 0,
+until any request is); aio_lock is held.  Waiting gives up the lock, and
+another thread's poll may retire the request meanwhile, which ends the
+wait too: its slot may then stay free for good.
+*/
+static void wait_slot( int slot, unsigned generation )
+{
+	while(slot>=0 ? aio_slots[slot].generation==generation && aio_slots[slot].state!=AIO_DONE : first_done()<0) {
+		if(ring_fd>=0) ring_reap(1);
+		else pthread_cond_wait(&aio_finished,&aio_lock);
+	}
+}
+
+static void poll_locked()
+{
+	if(ring_fd>=0) ring_reap(0);
+	for(int i=0;i<aio_depth;i++) {
+		if(aio_slots[i].state==AIO_DONE) retire(&aio_slots[i]);
+	}
+}
+
+/*
+Queue count blocks from blocknum, held in iov, as a request of their own
+pieces, and return its id.  The iovecs are copied, but the buffers they
+point at must stay put until the request is done.  A read whose sums are to
+be checked when it is retired passes its buffer as check.
+*/
+static int queue( int blocknum, int count, const struct iovec *iov, int iovcnt, int writing, char *check )
+{
+	if(!__atomic_load_n(&aio_ready,__ATOMIC_ACQUIRE) && !disk_aio_init(DISK_AIO_DEFAULT_DEPTH)) {
+		printf("ERROR: couldn't start asynchronous I/O!\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&aio_lock);
+
+	// queue full: make room by retiring a finished request
+	if(aio_inflight==aio_depth) {
+		poll_locked();
+		if(aio_inflight==aio_depth) {
+			wait_slot(-1,0);
+			retire(&aio_slots[first_done()]);
+		}
+	}
+
+	int slot = 0;
+	while(aio_slots[slot].state!=AIO_FREE) slot++;
+	struct aio_request *r = &aio_slots[slot];
+	r->blocknum = blocknum;
+	r->count = count;
+	r->writing = writing;
+	r->check = check;
+	r->error = 0;
+	int bound = split_bound(count,iovcnt);
+	r->iovs = bound<=AIO_INLINE_IOVECS ? r->inline_iovs : malloc(bound*sizeof(*r->iovs));
+	if(!r->iovs) {
+		printf("ERROR: out of memory!\n");
 		abort();
 	}
+	r->npieces = r->pending = split(blocknum,count,iov,iovcnt,r->pieces,r->iovs);
+	aio_inflight++;
+
+	if(mapped || (ring_fd<0 && aio_nworkers==0)) {
+		// nothing to overlap with: do it now
+		for(int k=0;k<r->npieces;k++) run_piece(&r->pieces[k],writing);
+		r->pending = 0;
+		r->state = AIO_DONE;
+	} else if(ring_fd>=0) {
+		r->state = AIO_RUNNING;
+		for(int k=0;k<r->npieces;k++) {
+			ring_submit(slot,k);
+			if(writing) __atomic_add_fetch(&nwritecalls,1,__ATOMIC_RELAXED);
+			else __atomic_add_fetch(&nreadcalls,1,__ATOMIC_RELAXED);
+		}
+	} else {
+		r->state = AIO_QUEUED;
+		for(int k=0;k<r->npieces;k++) r->pieces[k].state = AIO_QUEUED;
+		if(r->npieces>1) pthread_cond_broadcast(&aio_queued);
+		else pthread_cond_signal(&aio_queued);
+	}
+
+	int id = (int)(r->generation*aio_depth+slot);
+	pthread_mutex_unlock(&aio_lock);
+	return id;
+}
+
+static int submit( int blocknum, int count, char *data, int writing )
+{
+	range_check(blocknum,count,data);
+	if(writing) sums_update(blocknum,count,data);
+	struct iovec iov = { data, (size_t)count*DISK_BLOCK_SIZE };
+	tally(&naiorequests,1);
+	tally_blocks(writing,count);
+	return queue(blocknum,count,&iov,1,writing,writing ? 0 : data);
+}
+
+int disk_submit_read( int blocknum, int count, char *data )
+{
+	return submit(blocknum,count,data,0);
+}
+
+int disk_submit_write( int blocknum, int count, const char *data )
+{
+	return submit(blocknum,count,(char*)data,1);
+}
+
+int disk_aio_poll()
+{
+	if(!aio_slots) return 0;
+	pthread_mutex_lock(&aio_lock);
+	poll_locked();
+	int inflight = aio_inflight;
+	pthread_mutex_unlock(&aio_lock);
+	return inflight;
+}
+
+void disk_aio_wait( int id )
+{
+	if(!aio_slots || id<0) return;
+	pthread_mutex_lock(&aio_lock);
+	int slot = id%aio_depth;
+	struct aio_request *r = &aio_slots[slot];
+	// a different generation or a free slot means it was retired already
+	unsigned generation = id/aio_depth;
+	if(r->generation==generation && r->state!=AIO_FREE) {
+		wait_slot(slot,generation);
+		if(r->generation==generation) retire(r);
+	}
+	pthread_mutex_unlock(&aio_lock);
+}
+
+void disk_aio_wait_all()
+{
+	if(!aio_slots) return;
+	pthread_mutex_lock(&aio_lock);
+	for(int i=0;i<aio_depth;i++) {
+		unsigned generation = aio_slots[i].generation;
+		if(aio_slots[i].state!=AIO_FREE) {
+			wait_slot(i,generation);
+			if(aio_slots[i].generation==generation) retire(&aio_slots[i]);
+		}
+	}
+	pthread_mutex_unlock(&aio_lock);
+}
+
+static void aio_shutdown()
+{
+	if(!aio_slots) return;
+	disk_aio_wait_all();
+
+	if(ring_fd>=0) {
+		munmap(sqes,sqes_size);
+		munmap(cq_ring,cq_ring_size);
+		munmap(sq_ring,sq_ring_size);
+		close(ring_fd);
+		ring_fd = -1;
+	}
+
+	if(aio_workers) {
+		pthread_mutex_lock(&aio_lock);
+		aio_stopping = 1;
+		pthread_cond_broadcast(&aio_queued);
+		pthread_mutex_unlock(&aio_lock);
+		for(int i=0;i<aio_nworkers;i++) pthread_join(aio_workers[i],0);
+		free(aio_workers);
+		aio_workers = 0;
+		aio_nworkers = 0;
+	}
+
+	free(aio_slots);
+	aio_slots = 0;
+	aio_depth = 0;
+	aio_ready = 0;
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	aio_shutdown();
+	if(nmembers>0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		printf("%d disk read calls\n",nreadcalls);
+		printf("%d disk write calls\n",nwritecalls);
+		if(naiorequests) printf("%d asynchronous requests\n",naiorequests);
+		if(nbadsums) printf("%d checksum failures\n",nbadsums);
+		if(mapped) {
+			printf("%d mapped block accesses\n",nmapped);
+			disk_sync();
+		}
+		close_members();
 	}
+	free(sums);
+	sums = 0;
 }
-
@@ -1,12 +1,64 @@
 #ifndef DISK_H
 #define DISK_H
 
-#define DISK_BLOCK_SIZE 4096
+#ifndef DISK_BLOCK_SIZE
+#define DISK_BLOCK_SIZE 4096	// a power of two from 4096 to 65536, chosen at build time (see the Makefile)
+#endif
+
+// one entry of a scatter/gather request: a block and the buffer it moves through
+struct disk_iovec {
+	int blocknum;
+	char *data;
+};
+
+// disk_init_flags options
+#define DISK_FLAG_MMAP 0x1	// map the whole image instead of using positional reads and writes
+#define DISK_FLAG_AIO_THREADS 0x2	// run asynchronous requests on worker threads even if io_uring is available
+#define DISK_FLAG_CHECKSUMS 0x4	// keep a CRC32C of every block past the end of the image, checked on every read
+
+#define DISK_AIO_DEFAULT_DEPTH 32	// requests in flight at once unless disk_aio_init says otherwise
+#define DISK_AIO_MAX_WORKERS 8	// threads in the fallback pool, per member
+
+#define DISK_MAX_MEMBERS 16	// images one disk may be striped across
+#define DISK_STRIPE_DEFAULT_BLOCKS 16	// blocks per stripe unit unless disk_init_striped says otherwise
 
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_flags( const char *filename, int nblocks, int flags );
+// filenames is a comma-separated list of images the blocks are striped across, stripe_blocks at a time;
+// disk_init_flags takes such a list too, with the default stripe unit, and a single image is laid out as ever
+int  disk_init_striped( const char *filenames, int nblocks, int stripe_blocks, int flags );
 int  disk_size();
+void disk_counts( int *reads, int *writes );	// blocks read and written so far, for measuring I/O per operation
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+
+// count contiguous blocks starting at blocknum, in one call
+void disk_read_range( int blocknum, int count, char *data );
+void disk_write_range( int blocknum, int count, const char *data );
+
+// arbitrary block lists: sorted in place and merged into contiguous runs
+void disk_readv( struct disk_iovec *reqs, int count );
+void disk_writev( struct disk_iovec *reqs, int count );
+
+// the block itself, to be read in place: only with DISK_FLAG_MMAP, else null
+const char *disk_block_ptr( int blocknum );
+
+// with DISK_FLAG_CHECKSUMS: read count blocks from blocknum and check them all, returning how many fail (-1
+// without checksums); and how many have failed so far, here or on any other read, each reported as it fails
+int  disk_verify( int blocknum, int count );
+int  disk_checksum_failures();
+
+// asynchronous I/O: submit returns an id to wait on; the buffer must stay put until then
+// disk_aio_init is optional (it only sets the queue depth) and must come before the first submit
+int  disk_aio_init( int depth );
+int  disk_submit_read( int blocknum, int count, char *data );
+int  disk_submit_write( int blocknum, int count, const char *data );
+int  disk_aio_poll();		// retire whatever has finished; returns how many are still in flight
+void disk_aio_wait( int id );
+void disk_aio_wait_all();
+
+// force everything written so far onto the backing files
+void disk_sync();
 void disk_close();
 
 
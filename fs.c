@@ -1,5 +1,9 @@
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "journal.h"
+#include "compress.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -7,98 +11,580 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
 /* macros */
-// unfortunately, must define macros to use in struct definitions whose values are really arbitrary
-// can represent them as expressions of other macros, but then have to compute the value on every use
+// the geometry, DISK_BLOCK_SIZE and DATA_POINTERS_PER_INODE, may be chosen at build time (see the Makefile);
+// what follows from it is written out as constant expressions, so costs nothing at run time, and is checked
+// with static assertions once the types are defined
 #define FS_MAGIC          0xf0f03410
-#define DATA_POINTERS_PER_INODE    5  // truly arbitrary
+#ifndef DATA_POINTERS_PER_INODE
+#define DATA_POINTERS_PER_INODE    5  // 5, 13, 29 or 61, so that an inode is a power of two bytes
+#endif
 #define DATA_POINTER_SIZE          4  // just an int
-#define INODE_SIZE                32  // = 4 + DATA_POINTERS_PER_INODE * DATA_POINTER_SIZE + 4 + 4;
-#define INODES_PER_BLOCK         128  // = DISK_BLOCK_SIZE / INODE_SIZE
-#define DATA_POINTERS_PER_BLOCK 1024  // = DISK_BLOCK_SIZE / DATA_POINTER_SIZE
+#define DEFAULT_BLOCK_SIZE      4096  // the geometry of every image from before it could be chosen
+#define DEFAULT_DATA_POINTERS      5
+#define INODE_SIZE               (4 + DATA_POINTERS_PER_INODE * DATA_POINTER_SIZE + 4 + 4)  // 32 by default
+#define INODES_PER_BLOCK         (DISK_BLOCK_SIZE / INODE_SIZE)
+#define DATA_POINTERS_PER_BLOCK  (DISK_BLOCK_SIZE / DATA_POINTER_SIZE)
 #define INODE_TABLE_START_BLOCK    1  // inode table start immediately after superblock
+#define BITMAP_WORD_BITS          64  // bits per bitmap word
+#define BITS_PER_BLOCK           (DISK_BLOCK_SIZE * 8)  // bitmap bits stored per on-disk block
+#define MAX_FILE_BLOCKS          (DATA_POINTERS_PER_INODE + DATA_POINTERS_PER_BLOCK)  // 1029 by default
+#define EXTENTS_PER_INODE        ((INODE_SIZE - 16) / 8)  // extents kept in the inode itself, 2 by default
+#define EXTENTS_PER_BLOCK        ((DISK_BLOCK_SIZE - 8) / 8)  // leaving room for the count and the chain link
+#define MAX_EXTENT_FILE_BLOCKS   (INT_MAX / DISK_BLOCK_SIZE + 1)  // with extents only the int size limits a file
+#define RESERVATION_SLOTS         16  // growing files that may hold preallocated blocks at once
+#define RESERVATION_MIN_BLOCKS    16  // a growing file reserves at least this many blocks ahead
+#define READAHEAD_STREAMS          8  // files whose sequential reads are tracked at once
+#define READAHEAD_MIN_BLOCKS       4  // prefetch window once a stream is detected
+#define READAHEAD_MAX_BLOCKS      32  // the window doubles per sequential read up to this
+#define DEFRAG_STAGING_BLOCKS     16  // blocks fs_defrag moves per batch, and the size of its staging area
+#define DEFRAG_SKIP_WORDS         16  // words of free inode slots fs_defrag_step passes over for one unit of budget
+#define INODE_CACHE_SLOTS         64  // inodes kept in memory at once
+#define INODE_CACHE_BUCKETS      128  // hash chains, a power of two
+#define INODE_LOCK_STRIPES        64  // reader/writer locks shared out among inodes by number
+#define MOUNT_SCAN_THREADS         8  // workers fs_mount splits an inode table scan between
+#define MOUNT_SCAN_MIN_BLOCKS      8  // inode table blocks each of them gets at least
+#define MOUNT_SCAN_CHUNK          16  // inode table blocks a worker reads per request
+#define JOURNAL_MIN_BLOCKS         4  // a disk whose journal would be smaller gets none
+#define JOURNAL_MAX_BLOCKS      1024  // the journal is a sixteenth of the disk, up to this
+#define INODE_INIT_CHUNK          64  // inode table blocks zeroed at a time, by fs_format and then as inodes run out
+#define COMPRESS_CHUNK_BLOCKS      8  // logical blocks of a compressed file compressed together, each chunk decoding on its own
+#define CHUNK_CACHE_SLOTS         16  // decoded chunks kept in memory at once
+#define INODE_COMPRESSED         0x2  // in isvalid: the file is written in compressed chunks
 
 
 /* types */
-typedef unsigned char* bitmap_t;
+// words are only changed with atomic read-modify-writes, so threads can allocate without a lock;
+// cursor and lowest are hints another thread may move at any time
+struct bitmap {
+    uint64_t *words;
+    int n_bits;
+    int n_set;   // population count, kept up to date by bitmap_set so "none left" is O(1)
+    int cursor;  // next-fit search resumes here
+    int lowest;  // first-fit searches start here; no bit below it is set unless a race left it stale
+};
+typedef struct bitmap* bitmap_t;
 
 struct fs_superblock {
     int magic;
     int nblocks;
     int ninodeblocks;
     int ninodes;
+    int bitmapstart;     // first block of the on-disk bitmaps, right after the inode table; 0 on images without them
+    int nbitmapblocks;   // inode bitmap blocks followed by block bitmap blocks
+    int clean;           // set by fs_unmount once the on-disk bitmaps are current, cleared again by fs_mount
+    int defragcursor;    // inode fs_defrag_step resumes at; 0 starts a new pass
+    int version;         // inode format, FS_VERSION_POINTERS on every image from before extents
+    int journalstart;    // first block of the metadata journal, right after the bitmaps; 0 on images without one
+    int njournalblocks;
+    int journaled;       // cleared while metadata is written in place unlogged, when a crash means a rescan
+    int inodeinit;       // inode table blocks zeroed so far, the rest being free whatever they hold; 0 if all are
+    int compress;        // new files are written in compressed chunks; extent file systems only
+    int blocksize;       // DISK_BLOCK_SIZE of the build that formatted it, 0 on images from before it could change
+    int ndirect;         // DATA_POINTERS_PER_INODE likewise; only a build of the same geometry mounts it
 };
 
 struct fs_inode {
-    int isvalid;
+    int isvalid;  // 0 for a free inode; otherwise 1, with INODE_COMPRESSED or-ed in for a compressed file
     int size;
     int direct[DATA_POINTERS_PER_INODE];
     int indirect;
 };
 
+// a run of physically consecutive blocks holding consecutive logical blocks of a file, or with a negative
+// length a compressed chunk: -(logical blocks << 8 | blocks it is stored in), see extent_blocks
+struct fs_extent {
+    int start;
+    int length;
+};
+
+// the same INODE_SIZE bytes as struct fs_inode, on FS_VERSION_EXTENTS file systems
+struct fs_extent_inode {
+    int isvalid;
+    int size;
+    struct fs_extent extents[EXTENTS_PER_INODE];  // the first extents, in file order
+    int nextents;     // extents in all, inline ones included
+    int extentblock;  // first block of the chain holding extents past the inline ones, 0 if none
+};
+
+// one link of an extent chain
+struct fs_extent_block {
+    struct fs_extent extents[EXTENTS_PER_BLOCK];
+    int count;  // extents used in this block
+    int next;   // next block of the chain, 0 at the end
+};
+
 union fs_block {
     struct fs_superblock super;
     struct fs_inode inodes[INODES_PER_BLOCK];
+    struct fs_extent_inode xinodes[INODES_PER_BLOCK];
+    struct fs_extent_block extents;
     int pointers[DATA_POINTERS_PER_BLOCK];
     char data[DISK_BLOCK_SIZE];
 };
 
+// code converting between the two inode views relies on the layouts matching
+typedef char extent_inode_matches_inode[sizeof(struct fs_extent_inode) == sizeof(struct fs_inode) ? 1 : -1];
+typedef char extent_block_fills_block[sizeof(struct fs_extent_block) == DISK_BLOCK_SIZE ? 1 : -1];
+
+// and the geometry must hang together: whole inodes to a block, a block to every view of one, at least one
+// extent in an inode, and file sizes in an int
+typedef char inode_is_inode_size[sizeof(struct fs_inode) == INODE_SIZE && sizeof(struct fs_extent_inode) == INODE_SIZE ? 1 : -1];
+typedef char inodes_fill_block[INODES_PER_BLOCK * INODE_SIZE == DISK_BLOCK_SIZE ? 1 : -1];
+typedef char block_views_fit_block[sizeof(union fs_block) == DISK_BLOCK_SIZE ? 1 : -1];
+typedef char inode_holds_extents[EXTENTS_PER_INODE >= 1 ? 1 : -1];
+typedef char pointer_file_fits_int[(long long)MAX_FILE_BLOCKS * DISK_BLOCK_SIZE <= INT_MAX ? 1 : -1];
+typedef char bitmap_block_holds_words[BITS_PER_BLOCK % BITMAP_WORD_BITS == 0 ? 1 : -1];
+
+// an inode seen either way, so the map code can switch views in place
+union fs_inode_view {
+    struct fs_inode inode;
+    struct fs_extent_inode xinode;
+};
+
+// consecutive logical blocks of a file stored consecutively on disk, as decoded into memory
+struct map_run {
+    int logical;  // first logical block
+    int start;    // the physical block holding it
+    int length;
+    int stored;   // for a compressed chunk the blocks from start holding it, which never merges with anything; else 0
+};
+
+// an inode held in memory: entry points work on it here and it reaches its table block only when written back
+struct cached_inode {
+    int inumber;      // 0 when the slot is unused
+    int next;         // next slot in the same hash chain, -1 ends it
+    int refs;         // holders between inode_get and inode_put; a held inode is never evicted
+    bool dirty;       // newer than the inode table
+    bool referenced;  // for CLOCK replacement
+    bool loading;     // claimed by an inode_get still reading it from the table; others wait on inode_loaded
+    union fs_inode_view view;
+    // the block map decoded into runs in logical order, built on first use so lookups need no map blocks
+    bool decoded;
+    int nruns;
+    int runs_capacity;
+    struct map_run *runs;
+};
+
+// where a walk over the inode table has got to
+struct inode_table_walk {
+    int inumber;  // next inode to visit
+};
+
+// where a walk over one file's data blocks has got to
+struct inode_data_walk {
+    struct fs_inode inode;  // a copy, so the walk does not care what happens to the original
+    int block;              // next logical block past the stretch being visited
+    int run;                // blocks left in the contiguous stretch the last lookup found
+    int at;                 // physical block the walk returned last
+};
+
+// fs_write's handle on a file's block map while it appends blocks to it
+struct map_append {
+    int inumber;
+    union fs_inode_view *view;    // the inode being extended, held by the caller
+    int nblocks;                  // blocks mapped so far, holes included
+    int last;                     // the last physical block allocated to the file, the goal for the next; -1 if not known
+    int meta;                     // metadata block held in buf: the indirect block, or the chain's last block; 0 if none
+    bool dirty;                   // buf must be written back by map_append_end
+    bool filled;                  // map_fill_alloc changed the inode
+    bool refill;                  // ...of an extent file, whose map map_fill_end must write out again
+    int nchain;                   // blocks in the extent chain before any fill, -1 until counted
+    int *spares;                  // chain blocks fills took ahead, so that map_fill_end has all it needs
+    int nspares;
+    union fs_block buf;
+};
+
+// free blocks claimed ahead of use by one growing file, so its next blocks land right after its last ones
+struct block_reservation {
+    int inumber;  // 0 when the slot is unused
+    int next;     // next block to hand out
+    int end;      // one past the last reserved block
+};
+
+// a file being read sequentially: each fs_read that starts where the last one ended widens the window
+struct readahead_stream {
+    int inumber;      // 0 when the slot is unused
+    int next_offset;  // where the next read must start to count as sequential
+    int window;       // blocks to keep prefetched past the reader, 0 until the stream is sequential
+    int ahead;        // prefetches have been issued for logical blocks below this
+};
+
+// which pointer names a block: fs_defrag's reverse map
+struct block_owner {
+    int inumber;  // 0 when the block is free
+    int index;    // logical block within the file, -1 for its indirect block
+};
+
+// fs_defrag's pending moves into consecutive free blocks, staged and issued together
+struct defrag_batch {
+    int target;   // where the first entry goes; the others follow it
+    int count;
+    int sources[DEFRAG_STAGING_BLOCKS];
+    struct block_owner owners[DEFRAG_STAGING_BLOCKS];
+    bool repoint;  // update each entry's pointer once it has moved; extent maps are rewritten by the caller instead
+    union fs_block staging[DEFRAG_STAGING_BLOCKS];
+};
+
+// one worker of fs_mount's table scan: marks the inodes of its table blocks in the inode bitmap directly
+// (no other worker touches those bits), and the blocks their files use in a bitmap of its own
+struct mount_scan {
+    int first;        // inode table blocks [first, last), counted from the start of the table
+    int last;
+    bitmap_t used;    // set for every data or map block found
+    pthread_t thread;
+};
+
+// one inumber of a batch call, with where it came in the caller's list
+struct batch_entry {
+    int inumber;
+    int index;
+};
+
+// a compressed chunk as it decodes, kept so that reading it again need not run the codec
+struct chunk_slot {
+    int inumber;  // 0 when the slot is unused
+    int logical;  // the chunk's first logical block
+    char data[COMPRESS_CHUNK_BLOCKS * DISK_BLOCK_SIZE];
+};
+
+// physically contiguous blocks backed by a contiguous stretch of a caller's buffer, issued as one range request
+struct block_run {
+    int start;   // first block number
+    int count;   // 0 means the run is empty
+    int offset;  // byte offset of the first block within the caller's buffer
+};
+
 
 /* helper function prototypes */
-// true bitmap: one bit per entry
-// bits 0-7 in 0, 8-15 in 1, etc - access via `bitmap[bit / 8] & (1 << bit % 8)`
+// true bitmap: one bit per entry, packed into 64-bit words
+// bits 0-63 in word 0, 64-127 in word 1, etc - access via `words[bit / 64] & (1 << bit % 64)`
 bitmap_t bitmap_create(int n_bits);
 void     bitmap_delete(bitmap_t bitmap);
 bool     bitmap_test(bitmap_t bitmap, int idx);
-void     bitmap_set(bitmap_t bitmap, int idx, bool val);
+bool     bitmap_set(bitmap_t bitmap, int idx, bool val);
+void     bitmap_set_range(bitmap_t bitmap, int from, int to, bool val);
+int      bitmap_find_set(bitmap_t bitmap, int from, int to);
+int      bitmap_find_clear(bitmap_t bitmap, int from, int to);
+int      bitmap_find_run(bitmap_t bitmap, int from, int to, int length);
+int      bitmap_next_set(bitmap_t bitmap);
+int      bitmap_first_set(bitmap_t bitmap);
+int      bitmap_count(bitmap_t bitmap);
 void     bitmap_print(bitmap_t bitmap, int n_bits);
+void     bitmap_store(bitmap_t bitmap, int start_block);
+void     bitmap_load(bitmap_t bitmap, int start_block);
+void     bitmap_or(bitmap_t into, bitmap_t from);
+void     bitmap_clear_bits(bitmap_t into, bitmap_t from);
+int      bitmap_blocks(int n_bits);
 
-int      min(int first, int second);
+void     lock_fs(bool exclusive);
+void     unlock_fs();
+void     lock_inode(int inumber, bool exclusive);
+void     unlock_inode(int inumber);
 
+int      min(int first, int second);
+int      format_disk(int version, bool compress);
+bool     geometry_matches(const struct fs_superblock *super);
+int      data_start_block();
+void     write_superblock();
+int      table_initialized();
+void     init_table_block(int table_block);
+
+bool     run_extend(struct block_run *run, int block_num, int offset);
+bool     is_zero(const char *data, int length);
+
+struct block_reservation *find_reservation(int inumber);
+void     release_reservation(struct block_reservation *res);
+void     release_file_reservation(int inumber);
+void     release_all_reservations();
+void     reserve_blocks(int inumber, int goal, int want);
+void     reserve_locked(int inumber, struct block_reservation *res, int goal, int want);
+bool     alloc_block(int inumber, int goal, int *pointer);
+bool     claim_blocks(int start, int count);
+bool     alloc_run(int goal, int count, int *start);
+
+struct readahead_stream *find_stream(int inumber);
+void     forget_stream(int inumber);
+void     forget_streams();
+void     readahead(int inumber, struct cached_inode *cached, int offset, int length);
+
+// compressed files, written a chunk at a time
+struct chunk_slot *find_chunk(int inumber, int logical);
+void     chunk_remember(int inumber, int logical, const char *plain);
+void     chunk_forget(int inumber);
+void     chunk_forget_all();
+bool     chunk_decode(const struct map_run *chunk, char *plain, char *packed);
+bool     chunk_read(int inumber, const struct map_run *chunk, int offset, int length, char *data);
+void     read_chunk(int inumber, struct cached_inode *cached, int first, int nblocks, char *plain);
+int      chunk_goal(struct cached_inode *cached, int first);
+void     release_range(struct cached_inode *cached, int first, int nblocks, const int *keep, int nkeep);
+bool     store_chunk(struct map_append *map, struct cached_inode *cached, int first, int nblocks, const char *plain, char *packed);
+int      write_chunks(struct map_append *map, struct cached_inode *cached, const char *data, int length, int offset, int old_size);
+
+enum stats_kind meta_kind(int block_num);
+const union fs_block *peek_block(int block_num);
+void     unpeek_block(const union fs_block *block);
+struct cached_inode *inode_get(int inumber);
+void     inode_put(struct cached_inode *cached, bool dirty);
+int      inode_lookup(int inumber);
+void     inode_writeback(int table_block);
+void     inode_sync();
+void     inode_cache_clear();
 void     load_inode(int inumber, struct fs_inode *inode);
-int      walk_inode_table(int from_inumber, struct fs_inode* inode);
-int      walk_inode_data(int for_inumber, struct fs_inode* for_inode, char *data);
-void     move_block(int block_num, int index, union fs_block* defrag_data);
+void     load_pointers(int indirect, int from, int count, int *pointers);
+
+// block maps, in either inode format
+int      max_file_blocks();
+int      file_blocks(const struct fs_inode *inode);
+int      extent_blocks(const struct fs_extent *extent);
+int      extent_stored(const struct fs_extent *extent);
+struct fs_extent extent_of(const struct map_run *run);
+int      map_lookup(const struct fs_inode *inode, int logical, int want, int *run, int *stored);
+int      map_first_meta(const struct fs_inode *inode);
+int      map_next_meta(const struct fs_inode *inode, int meta_block);
+void     map_append_begin(struct map_append *map, int inumber, union fs_inode_view *view);
+bool     map_indirect(struct map_append *map, int goal, bool *fresh);
+void     map_drop_indirect(struct map_append *map);
+struct fs_extent *map_last_extent(struct map_append *map);
+bool     map_continues(int last_start, int last_length, int start);
+bool     map_add_extent(struct map_append *map, int start, int length);
+bool     map_append_alloc(struct map_append *map, int *block_num);
+bool     map_append_hole(struct map_append *map, int count);
+bool     map_fill_room(struct map_append *map, int nruns);
+bool     map_fill_alloc(struct map_append *map, struct cached_inode *cached, int logical, int goal, int *block_num);
+void     map_fill_end(struct map_append *map, struct cached_inode *cached);
+void     map_append_end(struct map_append *map);
+int     *map_meta_blocks(const struct fs_inode *inode, int *count);
+int      map_chain_blocks(int nextents);
+void     map_store_extents(struct fs_extent_inode *x, const struct map_run *runs, int nruns, const int *chain);
+void     map_set_layout(int inumber, int start);
+void     map_forget(struct cached_inode *cached);
+void     map_reserve_runs(struct cached_inode *cached, int count);
+void     map_add_run(struct cached_inode *cached, int logical, int start, int length, int stored);
+int      map_run_index(const struct cached_inode *cached, int logical);
+void     map_set_range(struct cached_inode *cached, int logical, int length, int start, int stored);
+void     map_trim_runs(struct cached_inode *cached, int nblocks);
+void     map_decode(struct cached_inode *cached);
+const struct map_run *map_find_run(struct cached_inode *cached, int logical);
+int      map_lookup_cached(struct cached_inode *cached, int logical, int want, int *run, int *stored);
+int      walk_inode_table(struct inode_table_walk *walk, int from_inumber, struct fs_inode* inode);
+int      walk_inode_data(struct inode_data_walk *walk, int for_inumber, const struct fs_inode* for_inode, char *data);
+int      get_pointer(int inumber, int index);
+void     set_pointer(int inumber, int index, int block_num);
+struct block_owner *build_owners(int data_start, int *nused);
+void     defrag_flush(struct defrag_batch *batch);
+void     defrag_relocate(int from, int to, struct block_owner *owners, int data_start, union fs_block *staging);
+void     defrag_swap(int a, int b, struct block_owner *owners, int data_start, union fs_block *staging);
+void     compact_inodes();
+void     write_if_changed(int block_num, const union fs_block *block);
+int      defrag_pointer_files(struct defrag_batch *batch);
+int      defrag_extent_files(struct defrag_batch *batch);
+int      layout_pointers(int inumber, const struct fs_inode *inode, int *pointers, int *indexes);
+void     table_block_load(int table_block, union fs_block *block);
+void     table_block_store(int table_block, const union fs_block *block);
+int      compare_batch_entries(const void *a, const void *b);
+struct batch_entry *sort_batch(const int *inumbers, int count);
+void     free_inode_blocks(int inumber, const struct fs_inode *dead);
+int      free_map_blocks(const struct fs_inode *dead);
+void     release_block(int block_num);
+void     reclaim_later(const struct fs_inode *dead);
+int      reclaim_blocks(int budget);
+void    *scan_inode_blocks(void *arg);
+void     scan_inode_table();
+void     read_meta(int block_num, char *data);
+void     write_meta(int block_num, const char *data);
+char    *bitmap_image();
+void     store_bitmaps();
+void     mark_journaled(bool journaled);
+void     commit_transaction();
+void     commit_if_due();
+void     unlogged_begin();
+void     unlogged_end();
 
 
 /* globals */
 bitmap_t inode_table_bitmap;
 bitmap_t disk_block_bitmap;
 bool     is_mounted = false;
+struct block_reservation reservations[RESERVATION_SLOTS];
+int      reservation_victim = 0; // round-robin replacement when all slots are taken
+struct readahead_stream streams[READAHEAD_STREAMS];
+int      stream_victim = 0;      // round-robin replacement, as for reservations
+// in-memory copy of block 0: valid while mounted (and after fs_format), so entry points need not re-read it
+struct fs_superblock superblock;
+// the bitmap blocks as the journal last logged them, so a commit only logs those that changed; null until then
+char    *committed_bitmaps = NULL;
+// blocks kept from reuse until the change freeing them is committed (see release_block); under reclaim_lock
+int     *freed_blocks = NULL;
+int      freed_blocks_count = 0;
+int      freed_blocks_capacity = 0;
+struct cached_inode inode_cache[INODE_CACHE_SLOTS];
+int      inode_buckets[INODE_CACHE_BUCKETS];
+int      inode_clock = 0;        // CLOCK hand over inode_cache
+// decoded copies of compressed chunks, by file and first logical block: kept current as chunks are stored, a
+// file's dropped when it is deleted, and all of them when defrag renumbers inodes
+struct chunk_slot chunk_cache[CHUNK_CACHE_SLOTS];
+int      chunk_victim = 0;       // round-robin replacement, as for reservations
+/*
+Locking. Per-file entry points hold fs_lock shared and their inode's stripe of inode_locks, shared to read
+and exclusive to change the file; mount, unmount, format, sync, defrag and the diagnostics hold fs_lock
+exclusive, so they see and may change everything at once. Inside that, the mutexes below protect the shared
+tables, each held briefly; holding one, a thread only takes those listed after it. The bitmaps need none.
+*/
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];
+pthread_once_t   inode_locks_once = PTHREAD_ONCE_INIT;
+pthread_mutex_t  stream_lock = PTHREAD_MUTEX_INITIALIZER;       // streams and stream_victim
+pthread_mutex_t  inode_cache_lock = PTHREAD_MUTEX_INITIALIZER;  // the inode cache's slots and chains, and decoding maps
+pthread_cond_t   inode_loaded = PTHREAD_COND_INITIALIZER;       // a slot's loading cleared, under inode_cache_lock
+pthread_mutex_t  reservation_lock = PTHREAD_MUTEX_INITIALIZER;  // reservations and reservation_victim
+pthread_mutex_t  reclaim_lock = PTHREAD_MUTEX_INITIALIZER;      // the reclaim queue
+pthread_mutex_t  table_init_lock = PTHREAD_MUTEX_INITIALIZER;   // moving superblock.inodeinit
+pthread_mutex_t  chunk_lock = PTHREAD_MUTEX_INITIALIZER;        // chunk_cache and chunk_victim
+// what an inode table block lazy formatting has not reached yet reads as
+const union fs_block empty_block;
+// deleted inodes whose blocks are still allocated, when deletes are deferred; only in memory, since a
+// mount that rebuilds the bitmaps finds their blocks free anyway
+bool     deferred_delete = false;
+struct fs_inode *reclaim_queue = NULL;
+int      reclaim_count = 0;
+int      reclaim_capacity = 0;
 
 
 /* function definitions */
 // guidance from: https://stackoverflow.com/questions/10080832/c-i-need-some-guidance-in-how-to-create-dynamic-sized-bitmaps
 bitmap_t bitmap_create(int n_bits){
     if( n_bits < 0 ) return NULL;
-    // add 7 to round integer division up
-    bitmap_t to_return = malloc((sizeof(*to_return) * n_bits + 7) / 8);
-    if( !to_return ){
+    bitmap_t to_return = malloc(sizeof(*to_return));
+    // add BITMAP_WORD_BITS - 1 to round integer division up; calloc so every bit starts clear
+    uint64_t *words = calloc((n_bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS + 1, sizeof(*words));
+    if( !to_return || !words ){
         printf("ERROR Failed to allocate memory. Exiting...\n");
         abort();
     }
+    to_return->words = words;
+    to_return->n_bits = n_bits;
+    to_return->n_set = 0;
+    to_return->cursor = 0;
+    to_return->lowest = 0;
     return to_return;
 }
 
 void bitmap_delete(bitmap_t bitmap){
+    if( !bitmap ) return;
+    free(bitmap->words);
     free(bitmap);
 }
 
 bool bitmap_test(bitmap_t bitmap, int idx){
-    return bitmap[idx / 8] & (1 << (idx % 8));
+    return __atomic_load_n(&bitmap->words[idx / BITMAP_WORD_BITS], __ATOMIC_RELAXED) & (UINT64_C(1) << (idx % BITMAP_WORD_BITS));
+}
+
+// lower the first-fit hint to idx unless it is lower already
+static void bitmap_lower(bitmap_t bitmap, int idx){
+    int lowest = __atomic_load_n(&bitmap->lowest, __ATOMIC_RELAXED);
+    while( idx < lowest && !__atomic_compare_exchange_n(&bitmap->lowest, &lowest, idx, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) );
+}
+
+// update the words under mask, returning how many of those bits were set before
+static int bitmap_update(bitmap_t bitmap, int word, uint64_t mask, bool val){
+    uint64_t old = val ? __atomic_fetch_or(&bitmap->words[word], mask, __ATOMIC_ACQ_REL)
+                       : __atomic_fetch_and(&bitmap->words[word], ~mask, __ATOMIC_ACQ_REL);
+    return __builtin_popcountll(old & mask);
+}
+
+// true if the bit changed: clearing a set bit this way claims it, however many threads try at once
+bool bitmap_set(bitmap_t bitmap, int idx, bool val){
+    if( bitmap_test(bitmap, idx) == val ) return false;
+    bool was = bitmap_update(bitmap, idx / BITMAP_WORD_BITS, UINT64_C(1) << (idx % BITMAP_WORD_BITS), val);
+    if( was == val ) return false;
+    __atomic_add_fetch(&bitmap->n_set, val ? 1 : -1, __ATOMIC_RELAXED);
+    if( val ) bitmap_lower(bitmap, idx);
+    return true;
+}
+
+// set bits [from, to) a word at a time
+void bitmap_set_range(bitmap_t bitmap, int from, int to, bool val){
+    while( from < to ){
+        int word = from / BITMAP_WORD_BITS;
+        int bit = from % BITMAP_WORD_BITS;
+        int span = min(BITMAP_WORD_BITS - bit, to - from);
+        uint64_t mask = (span == BITMAP_WORD_BITS ? ~UINT64_C(0) : ((UINT64_C(1) << span) - 1)) << bit;
+        int before = bitmap_update(bitmap, word, mask, val);
+        __atomic_add_fetch(&bitmap->n_set, (val ? span : 0) - before, __ATOMIC_RELAXED);
+        if( val ) bitmap_lower(bitmap, from);
+        from += span;
+    }
+}
+
+// first bit equal to val in [from, to), or -1; skips uniform words whole and finds the bit with count-trailing-zeros
+static int bitmap_find(bitmap_t bitmap, int from, int to, bool val){
+    if( from >= to ) return -1;
+    uint64_t flip = val ? 0 : ~UINT64_C(0); // searching for a clear bit is searching the complement for a set one
+    int word = from / BITMAP_WORD_BITS;
+    uint64_t bits = (__atomic_load_n(&bitmap->words[word], __ATOMIC_RELAXED) ^ flip) & (~UINT64_C(0) << (from % BITMAP_WORD_BITS));
+    int last_word = (to - 1) / BITMAP_WORD_BITS;
+    while( !bits ){
+        if( ++word > last_word ) return -1;
+        bits = __atomic_load_n(&bitmap->words[word], __ATOMIC_RELAXED) ^ flip;
+    }
+    int found = word * BITMAP_WORD_BITS + __builtin_ctzll(bits);
+    return found < to ? found : -1;
+}
+
+int bitmap_find_set(bitmap_t bitmap, int from, int to){
+    if( bitmap_count(bitmap) == 0 ) return -1;
+    return bitmap_find(bitmap, from, to, 1);
+}
+
+int bitmap_find_clear(bitmap_t bitmap, int from, int to){
+    return bitmap_find(bitmap, from, to, 0);
+}
+
+// start of the first run of at least length set bits inside [from, to), or -1
+int bitmap_find_run(bitmap_t bitmap, int from, int to, int length){
+    while( bitmap_count(bitmap) >= length ){
+        int start = bitmap_find_set(bitmap, from, to);
+        if( start < 0 || start + length > to ) return -1;
+        int stop = bitmap_find_clear(bitmap, start, start + length);
+        if( stop < 0 ) return start;
+        from = stop + 1;
+    }
+    return -1;
+}
+
+// next-fit: search forward from where the last search left off, wrapping around once
+int bitmap_next_set(bitmap_t bitmap){
+    int cursor = __atomic_load_n(&bitmap->cursor, __ATOMIC_RELAXED);
+    int found = bitmap_find_set(bitmap, cursor, bitmap->n_bits);
+    if( found < 0 ) found = bitmap_find_set(bitmap, 0, cursor);
+    if( found >= 0 ) __atomic_store_n(&bitmap->cursor, found + 1 < bitmap->n_bits ? found + 1 : 0, __ATOMIC_RELAXED);
+    return found;
+}
+
+// first-fit: lowest set bit, resuming from the low-water mark rather than from 0. A bit set while the
+// search was under way can leave the mark too high, so a miss with bits still set searches again from 0
+int bitmap_first_set(bitmap_t bitmap){
+    int lowest = __atomic_load_n(&bitmap->lowest, __ATOMIC_RELAXED);
+    int found = bitmap_find_set(bitmap, lowest, bitmap->n_bits);
+    if( found < 0 && lowest > 0 ) found = bitmap_find_set(bitmap, 0, lowest);
+    __atomic_compare_exchange_n(&bitmap->lowest, &lowest, found >= 0 ? found : bitmap->n_bits, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return found;
 }
 
-void bitmap_set(bitmap_t bitmap, int idx, bool val){
-    if( bitmap_test(bitmap, idx) == val ) return;
-    bitmap[idx / 8] ^= 1 << (idx % 8);
+int bitmap_count(bitmap_t bitmap){
+    return __atomic_load_n(&bitmap->n_set, __ATOMIC_RELAXED);
 }
 
 void bitmap_print(bitmap_t bitmap, int n_bits){
     int width = 1;
     for( int place_value = 1; n_bits > 10 * place_value; width += 1, place_value *= 10 );
     printf("BITMAP START\n");
-    for( int byte = 0; byte < (n_bits + 7)/8; ++byte ){
+    for( int byte = 0; byte < (n_bits + 7)/8; ++byte ){ // still eight bits per line
         int start = byte * 8;
         printf("  %*d - %*d: ", width, start, width, start + 7);
         for( int bit = 0; bit < 8; ++bit ){
@@ -109,540 +595,3125 @@ void bitmap_print(bitmap_t bitmap, int n_bits){
     printf("BITMAP END\n");
 }
 
-int min(int first, int second) {
-    return first < second ? first : second;
+int bitmap_blocks(int n_bits){
+    return (n_bits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
 }
 
-void load_inode(int inumber, struct fs_inode *inode){
-    int inode_table_idx = inumber / INODES_PER_BLOCK;
-    int inode_block_idx = inumber % INODES_PER_BLOCK;
-
-    union fs_block buffer_block;
-    disk_read(inode_table_idx + INODE_TABLE_START_BLOCK, buffer_block.data);
-    memcpy(inode, &buffer_block.inodes[inode_block_idx], sizeof(struct fs_inode));
+// the on-disk form is just the words, zero-padded to whole blocks
+void bitmap_store(bitmap_t bitmap, int start_block){
+    int nblocks = bitmap_blocks(bitmap->n_bits);
+    if( nblocks == 0 ) return;
+    union fs_block *blocks = calloc(nblocks, sizeof(union fs_block));
+    if( !blocks ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    memcpy(blocks, bitmap->words, (bitmap->n_bits + 7) / 8);
+    STATS_BLOCKS(STATS_BITMAP, 1, nblocks);
+    cache_write_range(start_block, nblocks, blocks->data);
+    free(blocks);
 }
 
-int walk_inode_table(int from_inumber, struct fs_inode *next_inode){
-    // initial setup
-    static union fs_block buffer_block;
-    static int curr_inumber = 1;
-    static int ninodes = -1;
-
-    if( ninodes < 0 ){
-        disk_read(0, buffer_block.data);
-        ninodes = buffer_block.super.ninodes;
-        buffer_block.inodes[0].size = -1; // flag that buffer_block is invalid
+void bitmap_load(bitmap_t bitmap, int start_block){
+    int nblocks = bitmap_blocks(bitmap->n_bits);
+    if( nblocks == 0 ) return;
+    union fs_block *blocks = malloc(sizeof(union fs_block) * nblocks);
+    if( !blocks ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
     }
+    STATS_BLOCKS(STATS_BITMAP, 0, nblocks);
+    cache_read_range(start_block, nblocks, blocks->data);
+    int nwords = (bitmap->n_bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    memcpy(bitmap->words, blocks, nwords * sizeof(*bitmap->words));
+    free(blocks);
+
+    // drop anything past n_bits, then recount
+    if( bitmap->n_bits % BITMAP_WORD_BITS )
+        bitmap->words[nwords - 1] &= (UINT64_C(1) << (bitmap->n_bits % BITMAP_WORD_BITS)) - 1;
+    bitmap->n_set = 0;
+    for( int w = 0; w < nwords; w++ ) bitmap->n_set += __builtin_popcountll(bitmap->words[w]);
+    bitmap->cursor = 0;
+    bitmap->lowest = 0;
+}
 
-    // handle arg
-    if( from_inumber >= ninodes ) return -1; // -1 indicates invalid input
-    else if( from_inumber >= 1 ){
-        int curr_blk = curr_inumber / INODES_PER_BLOCK;
-        int from_blk = from_inumber / INODES_PER_BLOCK;
-        if( curr_blk != from_blk ) buffer_block.inodes[0].size = -1;
-        curr_inumber = from_inumber;
-    }
-    // check if we have finished traversal
-    if( curr_inumber >= ninodes ) return 0; // 0 indicates invalid inode
+void init_inode_locks(){
+    for( int i = 0; i < INODE_LOCK_STRIPES; i++ ) pthread_rwlock_init(&inode_locks[i], NULL);
+}
 
-    int block_of_inode_table = curr_inumber / INODES_PER_BLOCK;
-    int inode_of_block = curr_inumber % INODES_PER_BLOCK;
-    // if buffer_block is invalid or we have reached a new block, need to perform disk_read
-    bool should_load_block = buffer_block.inodes[0].size < 0 || inode_of_block == 0;
-    if( should_load_block ){
-        disk_read(block_of_inode_table + INODE_TABLE_START_BLOCK, buffer_block.data);
-    }
-    // use memcpy because we don't want to assign next_inode to a memory address on the stack
-    memcpy(next_inode, &buffer_block.inodes[inode_of_block], sizeof(struct fs_inode));
+void lock_fs(bool exclusive){
+    if( exclusive ) pthread_rwlock_wrlock(&fs_lock);
+    else            pthread_rwlock_rdlock(&fs_lock);
+}
 
-    return curr_inumber++;
+void unlock_fs(){
+    pthread_rwlock_unlock(&fs_lock);
 }
 
-int walk_inode_data(int for_inumber, struct fs_inode *for_inode, char *data){
-    // initial setup
-    static int curr_block = 0;
-    static struct fs_inode inode;
-    static union fs_block ind_ptr_blk = {.pointers[0] = -1};
+// inodes share a lock with every INODE_LOCK_STRIPES-th neighbour; an entry point only ever holds one
+void lock_inode(int inumber, bool exclusive){
+    pthread_once(&inode_locks_once, init_inode_locks);
+    if( exclusive ) pthread_rwlock_wrlock(&inode_locks[inumber % INODE_LOCK_STRIPES]);
+    else            pthread_rwlock_rdlock(&inode_locks[inumber % INODE_LOCK_STRIPES]);
+}
 
-    // initialization
-    if( for_inumber >= 1 || for_inode ){
-        curr_block = 0;
-        ind_ptr_blk.pointers[0] = -1;
-        if( for_inumber > 0 )   load_inode(for_inumber, &inode);
-        else                    inode = *for_inode; // this implicitly copies, so we don't have to worry about for_inode being modified later
-    }
-    // short-circuit if no more data
-    if( DISK_BLOCK_SIZE * curr_block >= inode.size || curr_block >= DATA_POINTERS_PER_INODE + DATA_POINTERS_PER_BLOCK ) return -1;
+void unlock_inode(int inumber){
+    pthread_rwlock_unlock(&inode_locks[inumber % INODE_LOCK_STRIPES]);
+}
 
-    int read_from;
-    // read from direct pointers
-    if( curr_block < DATA_POINTERS_PER_INODE ){
-        read_from = inode.direct[curr_block];
-    }
-    // read from indirect pointers
-    else{
-        if( ind_ptr_blk.pointers[0] < 0 ) disk_read(inode.indirect, ind_ptr_blk.data);
-        read_from = ind_ptr_blk.pointers[curr_block - DATA_POINTERS_PER_INODE];
+// word-wise OR of from into into, which must be as long
+void bitmap_or(bitmap_t into, bitmap_t from){
+    int nwords = (into->n_bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    into->n_set = 0;
+    for( int w = 0; w < nwords; w++ ){
+        into->words[w] |= from->words[w];
+        into->n_set += __builtin_popcountll(into->words[w]);
     }
-    curr_block++;
-    if( data ) disk_read(read_from, data); // allow data to be null
-    return read_from;
+    into->lowest = 0;
 }
 
-int fs_format() {
-    // don't format: already mounted
-    if (is_mounted) return 0;
-
-    union fs_block buffer_block;
+// clear in into every bit set in from, a word at a time
+void bitmap_clear_bits(bitmap_t into, bitmap_t from){
+    int nwords = (into->n_bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+    into->n_set = 0;
+    for( int w = 0; w < nwords; w++ ){
+        into->words[w] &= ~from->words[w];
+        into->n_set += __builtin_popcountll(into->words[w]);
+    }
+}
 
-    // read superblock
-    disk_read(0, buffer_block.data);
-    struct fs_superblock *superblock = &buffer_block.super;
+int min(int first, int second) {
+    return first < second ? first : second;
+}
 
-    // set superblock values
-    superblock->magic = FS_MAGIC;
-    superblock->nblocks = disk_size();
-    // compute 10% of blocks for inodes
-    int ninodeblocks_temp = superblock->nblocks / 10;
-    superblock->ninodeblocks = ninodeblocks_temp;
-    superblock->ninodes = superblock->ninodeblocks * INODES_PER_BLOCK;
+// first block after all metadata (superblock, inode table and, if present, bitmaps and journal)
+int data_start_block(){
+    if( superblock.journalstart ) return superblock.journalstart + superblock.njournalblocks;
+    if( superblock.bitmapstart ) return superblock.bitmapstart + superblock.nbitmapblocks;
+    return INODE_TABLE_START_BLOCK + superblock.ninodeblocks;
+}
 
-    // write superblock values
-    disk_write(0, buffer_block.data);
+// inode table blocks that may hold inodes; those past it read as empty_block
+int table_initialized(){
+    int mark = __atomic_load_n(&superblock.inodeinit, __ATOMIC_ACQUIRE);
+    return mark ? mark : superblock.ninodeblocks;
+}
 
-    // traverse inode table and invalidate - update with itok()?
-    for( int block = 0; block < ninodeblocks_temp; ++block ) {
-        disk_read(block + INODE_TABLE_START_BLOCK, buffer_block.data);
-        struct fs_inode *inodes = buffer_block.inodes;
-        for( int i = 0; i < INODES_PER_BLOCK; ++i ) {
-            inodes[i].isvalid = 0;
+// zero the inode table up to table_block, and a chunk past it, before an inode in it is handed out. The
+// zeros must be on disk before the superblock says so, or a crash would leave garbage counting as inodes
+void init_table_block(int table_block){
+    if( table_block < table_initialized() ) return;
+    pthread_mutex_lock(&table_init_lock);
+    int mark = table_initialized();
+    if( table_block >= mark ){
+        int end = min(superblock.ninodeblocks, table_block + 1 > mark + INODE_INIT_CHUNK ? table_block + 1 : mark + INODE_INIT_CHUNK);
+        char *zeros = calloc(end - mark, DISK_BLOCK_SIZE);
+        if( !zeros ){
+            printf("ERROR Failed to allocate memory. Exiting...\n");
+            abort();
         }
-        disk_write(block + INODE_TABLE_START_BLOCK, buffer_block.data);
+        STATS_BLOCKS(STATS_INODE_TABLE, 1, end - mark);
+        cache_write_range(INODE_TABLE_START_BLOCK + mark, end - mark, zeros);
+        free(zeros);
+        disk_sync();
+        __atomic_store_n(&superblock.inodeinit, end, __ATOMIC_RELEASE);
+        write_superblock();
     }
-
-    return 1;
+    pthread_mutex_unlock(&table_init_lock);
 }
 
-void fs_debug(){
+// superblock updates go straight to disk: the clean flag is only useful if it is on disk before anything else changes
+void write_superblock(){
     union fs_block buffer_block;
+    memset(buffer_block.data, 0, DISK_BLOCK_SIZE);
+    buffer_block.super = superblock;
+    STATS_BLOCKS(STATS_SUPERBLOCK, 1, 1);
+    cache_write_range(0, 1, buffer_block.data);
+}
 
-    // superblock
-    disk_read(0, buffer_block.data);
-    struct fs_superblock superblock = buffer_block.super;
-    printf("superblock:\n");
-    printf("    magic number %s valid\n", superblock.magic == FS_MAGIC ? "is" : "is not");
-    printf("    %d blocks total on disk\n", superblock.nblocks);
-    printf("    %d blocks dedicated to inode table on disk\n", superblock.ninodeblocks);
-    printf("    %d total spots in inode table\n", superblock.ninodes);
-
-    // walk inode table
-    struct fs_inode inode;
-    for( int inumber = walk_inode_table(1, &inode); inumber > 0; inumber = walk_inode_table(-1, &inode) ){
-        if( !inode.isvalid || inumber == 0 ) continue;
-        printf("inode %d:\n", inumber);
-        printf("    size: %d bytes\n", inode.size);
-        printf("    direct data blocks:");
-        // walk data blocks for this inode
-        for( int block_num = walk_inode_data(0, &inode, NULL), i = 0; block_num > 0; block_num = walk_inode_data(0, NULL, NULL),i++ ){
-            if( i == DATA_POINTERS_PER_INODE ){
-                printf("\n    indirect block: %d", inode.indirect);
-                printf("\n    indirect data blocks:");
-            }
-            printf(" %d", block_num);
-        }
-        printf("\n");
+// grow run by block_num if it follows on both on disk and in the buffer; otherwise the caller must issue run and restart it
+bool run_extend(struct block_run *run, int block_num, int offset){
+    if( run->count > 0 && block_num == run->start + run->count && offset == run->offset + run->count * DISK_BLOCK_SIZE ){
+        run->count++;
+        return true;
     }
+    return false;
 }
 
-int fs_mount(){
-    if( is_mounted ) return 0;
-    union fs_block buffer_block;
-    disk_read(0, buffer_block.data);
-    if( buffer_block.super.magic != FS_MAGIC ) return 0;
+// whether length bytes are all zeros: the first byte is, and every byte equals the one after it. Comparing the
+// buffer with itself one byte on lets memcmp do the work a vector register at a time, and it stops at the first difference
+bool is_zero(const char *data, int length){
+    return length <= 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
 
-    inode_table_bitmap = bitmap_create(buffer_block.super.ninodes);
-    disk_block_bitmap = bitmap_create(buffer_block.super.nblocks);
+// what a metadata block holds, going by where it sits: past the bitmaps, only a file's map is metadata
+enum stats_kind meta_kind(int block_num){
+    if( block_num == 0 ) return STATS_SUPERBLOCK;
+    if( block_num < INODE_TABLE_START_BLOCK + superblock.ninodeblocks ) return STATS_INODE_TABLE;
+    if( superblock.journalstart && block_num >= superblock.journalstart && block_num < data_start_block() ) return STATS_JOURNAL;
+    if( block_num < data_start_block() ) return STATS_BITMAP;
+    return STATS_INDIRECT;
+}
 
-    // initialize data_region_bitmap: mark superblock and inode table blocks as allocated, rest as free
-    for( int i = 0; i < buffer_block.super.nblocks; i++ )
-        bitmap_set(disk_block_bitmap, i, !(i < buffer_block.super.ninodeblocks + INODE_TABLE_START_BLOCK)); // +1 to include superblock
+// view a metadata block in place (the running transaction's copy, a cache frame or the mapped disk),
+// until it is handed back with unpeek_block
+const union fs_block *peek_block(int block_num){
+    STATS_BLOCKS(meta_kind(block_num), 0, 1);
+    if( block_num >= INODE_TABLE_START_BLOCK + table_initialized() && block_num < INODE_TABLE_START_BLOCK + superblock.ninodeblocks )
+        return &empty_block;
+    const char *logged = journal_peek(block_num);
+    if( logged ) return (const union fs_block *)logged;
+    return (const union fs_block *)cache_peek(block_num);
+}
 
-    struct fs_inode inode;
-    bitmap_set(inode_table_bitmap, 0, 0); // inode 0 is not available for use
-    for( int inumber = walk_inode_table(1, &inode); inumber > 0; inumber = walk_inode_table(-1, &inode) ){
-        bitmap_set(inode_table_bitmap, inumber, !inode.isvalid);
-        if( !inode.isvalid ) continue;
-        for( int data_block_num = walk_inode_data(0, &inode, NULL); data_block_num > 0; data_block_num = walk_inode_data(0, NULL, NULL) ){
-            if( data_block_num == DATA_POINTERS_PER_INODE ) bitmap_set(disk_block_bitmap, inode.indirect, 0);
-            bitmap_set(disk_block_bitmap, data_block_num, 0);
-        }
-    }
+void unpeek_block(const union fs_block *block){
+    cache_unpeek(block->data);
+}
 
-    is_mounted = true;
-    return 1;
+// metadata goes through the journal while it is logging, which must then also be asked first on the way back
+void read_meta(int block_num, char *data){
+    if( block_num >= INODE_TABLE_START_BLOCK + table_initialized() && block_num < INODE_TABLE_START_BLOCK + superblock.ninodeblocks )
+        memset(data, 0, DISK_BLOCK_SIZE);
+    else if( !journal_read(block_num, data) )
+        cache_read(block_num, data);
 }
 
-int fs_create(){
-    if( !is_mounted ) return 0;
-    // Use bitmap to identify a free inode in the inode table block
-    union fs_block block_buffer;
-    disk_read(0, block_buffer.data);
-    int inumber = 0;
-    for (int i = 1; i < block_buffer.super.ninodes; i++) {
-        if(bitmap_test(inode_table_bitmap, i)){
-            inumber = i;
-            break;
+void write_meta(int block_num, const char *data){
+    if( !journal_write(block_num, data) ) cache_write(block_num, data);
+}
+
+/*
+Inode cache: entry points take an inode with inode_get, work on it in place and hand it back with inode_put,
+saying whether they changed it. Changes stay in memory until inode_sync (fs_sync and fs_unmount) or until
+eviction, and either way every dirty inode of the table block concerned is written in the one block write.
+Code that rewrites inode table blocks wholesale must inode_sync and inode_cache_clear first. The slots
+and chains are under inode_cache_lock; a held inode's contents belong to whoever holds its inode lock.
+No table block is read with inode_cache_lock held, so one thread's miss does not stall the others: a miss
+claims its slot and reads the inode with the lock dropped, and anyone else after that inode waits on the slot.
+*/
+int inode_hash(int inumber){
+    return (int)(((unsigned)inumber * 2654435761u) & (INODE_CACHE_BUCKETS - 1));
+}
+
+// slot holding inumber, or -1
+int inode_lookup(int inumber){
+    for( int i = inode_buckets[inode_hash(inumber)]; i >= 0; i = inode_cache[i].next )
+        if( inode_cache[i].inumber == inumber ) return i;
+    return -1;
+}
+
+// write every dirty cached inode that lives in table_block, with one read and one write of the block.
+// Held ones may be changing under their holders, so they stay dirty for next time
+void inode_writeback(int table_block){
+    union fs_block buffer_block;
+    bool loaded = false;
+    for( int i = 0; i < INODE_CACHE_SLOTS; i++ ){
+        struct cached_inode *cached = &inode_cache[i];
+        if( !cached->inumber || !cached->dirty || cached->refs || cached->inumber / INODES_PER_BLOCK != table_block ) continue;
+        if( !loaded ){
+            STATS_BLOCKS(STATS_INODE_TABLE, 0, 1);
+            read_meta(INODE_TABLE_START_BLOCK + table_block, buffer_block.data);
         }
+        loaded = true;
+        buffer_block.inodes[cached->inumber % INODES_PER_BLOCK] = cached->view.inode;
+        cached->dirty = false;
     }
-    if (!inumber) {
-        // No free inodes; return zero
-        return 0;
+    if( loaded ){
+        STATS_BLOCKS(STATS_INODE_TABLE, 1, 1);
+        write_meta(INODE_TABLE_START_BLOCK + table_block, buffer_block.data);
     }
-    int block_num = INODE_TABLE_START_BLOCK + (inumber / INODES_PER_BLOCK);
-    int block_offset = inumber % INODES_PER_BLOCK;
-
-    // Initialize the inode struct
-    struct fs_inode new_inode;
-    new_inode.isvalid = 1;
-    new_inode.size = 0;
+}
 
-    // Read block from disk
-    disk_read(block_num, block_buffer.data);
+struct cached_inode *inode_get(int inumber){
+    pthread_mutex_lock(&inode_cache_lock);
+    int i;
+    while( (i = inode_lookup(inumber)) < 0 ){
+        // CLOCK over the inodes nobody holds; with a handful of holders at most, one is always free
+        for( int sweep = 0; ; sweep++ ){
+            if( sweep > 2 * INODE_CACHE_SLOTS ){
+                printf("[ERROR] every cached inode is in use. Exiting...\n");
+                abort();
+            }
+            i = inode_clock;
+            inode_clock = (inode_clock + 1) % INODE_CACHE_SLOTS;
+            if( !inode_cache[i].inumber ) break;
+            if( inode_cache[i].refs ) continue;
+            if( !inode_cache[i].referenced ) break;
+            inode_cache[i].referenced = false;
+        }
 
-    // Write the inode struct to free inode position
-    block_buffer.inodes[block_offset] = new_inode;
+        struct cached_inode *victim = &inode_cache[i];
+        if( victim->inumber && victim->dirty ){
+            // bring the victim's table block into the block cache with the lock dropped and the victim held, so
+            // the write back does no read of its own; then everything is looked at afresh
+            int table_block = victim->inumber / INODES_PER_BLOCK;
+            victim->refs++;
+            pthread_mutex_unlock(&inode_cache_lock);
+            cache_unpeek(cache_peek(INODE_TABLE_START_BLOCK + table_block));
+            pthread_mutex_lock(&inode_cache_lock);
+            victim->refs--;
+            inode_writeback(table_block);
+            continue;
+        }
 
-    // Write back the block
-    disk_write(block_num, block_buffer.data);
+        map_forget(victim);
+        if( victim->inumber ){
+            int *link = &inode_buckets[inode_hash(victim->inumber)];
+            while( *link != i ) link = &inode_cache[*link].next;
+            *link = victim->next;
+        }
+        victim->inumber = inumber;
+        victim->dirty = false;
+        victim->loading = true;
+        victim->refs = 1;
+        victim->referenced = true;
+        victim->next = inode_buckets[inode_hash(inumber)];
+        inode_buckets[inode_hash(inumber)] = i;
+        pthread_mutex_unlock(&inode_cache_lock);
+
+        // copy out just the inode rather than its whole block
+        const union fs_block *table = peek_block(inumber / INODES_PER_BLOCK + INODE_TABLE_START_BLOCK);
+        memcpy(&victim->view.inode, &table->inodes[inumber % INODES_PER_BLOCK], sizeof(struct fs_inode));
+        unpeek_block(table);
+
+        pthread_mutex_lock(&inode_cache_lock);
+        victim->loading = false;
+        pthread_cond_broadcast(&inode_loaded);
+        pthread_mutex_unlock(&inode_cache_lock);
+        return victim;
+    }
 
-    bitmap_set(inode_table_bitmap, inumber, 0);
-    return inumber;
+    inode_cache[i].refs++;
+    inode_cache[i].referenced = true;
+    while( inode_cache[i].loading ) pthread_cond_wait(&inode_loaded, &inode_cache_lock);
+    pthread_mutex_unlock(&inode_cache_lock);
+    return &inode_cache[i];
 }
 
-int fs_delete( int inumber ){
-    if( !is_mounted ) return 0;
-    // Validate valid inumber
-    union fs_block block_buffer;
-    disk_read(0, block_buffer.data);
-    if ((inumber < 1) || (inumber >= block_buffer.super.ninodes))
-        return 0; // Invalid inumber
-
-    // Read the inode, update the isvald bit, and write back
-    int block_num = INODE_TABLE_START_BLOCK + (inumber / INODES_PER_BLOCK);
-    int block_offset = inumber % INODES_PER_BLOCK;
+void inode_put(struct cached_inode *cached, bool dirty){
+    pthread_mutex_lock(&inode_cache_lock);
+    cached->refs--;
+    if( dirty ) cached->dirty = true;
+    pthread_mutex_unlock(&inode_cache_lock);
+}
 
+void inode_sync(){
+    pthread_mutex_lock(&inode_cache_lock);
+    for( int i = 0; i < INODE_CACHE_SLOTS; i++ )
+        if( inode_cache[i].inumber && inode_cache[i].dirty ) inode_writeback(inode_cache[i].inumber / INODES_PER_BLOCK);
+    pthread_mutex_unlock(&inode_cache_lock);
+}
 
-    disk_read(block_num, block_buffer.data);
-    if (block_buffer.inodes[block_offset].isvalid == 0) {
-        // Return 0 -- attempting to delete an inode that's not yet created
-        return 0;
-    }
-    block_buffer.inodes[block_offset].isvalid = 0;
-    disk_write(block_num, block_buffer.data);
+// forget every cached inode; dirty ones must have been synced
+void inode_cache_clear(){
+    pthread_mutex_lock(&inode_cache_lock);
+    for( int i = 0; i < INODE_CACHE_SLOTS; i++ ) map_forget(&inode_cache[i]);
+    memset(inode_cache, 0, sizeof(inode_cache));
+    for( int i = 0; i < INODE_CACHE_BUCKETS; i++ ) inode_buckets[i] = -1;
+    inode_clock = 0;
+    pthread_mutex_unlock(&inode_cache_lock);
+}
 
-    // Walk the data blocks, free them, and update the bitmap
-    for ( int i = walk_inode_data(0, &block_buffer.inodes[block_offset], NULL); i > 0; i = walk_inode_data(0, NULL, NULL) ) {
-        bitmap_set(disk_block_bitmap, i, 1);
+// a copy of an inode: the cached one if there is one, else straight from the table without caching it,
+// so walks over the whole table do not flush the working set. Callers hold fs_lock exclusive, so an inode
+// not cached cannot be brought in and changed while its table block is read with the lock dropped
+void load_inode(int inumber, struct fs_inode *inode){
+    pthread_mutex_lock(&inode_cache_lock);
+    int i = is_mounted ? inode_lookup(inumber) : -1; // the cache only exists while mounted
+    if( i >= 0 ){
+        inode_cache[i].refs++;
+        while( inode_cache[i].loading ) pthread_cond_wait(&inode_loaded, &inode_cache_lock);
+        inode_cache[i].refs--;
+        *inode = inode_cache[i].view.inode;
+        pthread_mutex_unlock(&inode_cache_lock);
+        return;
     }
+    pthread_mutex_unlock(&inode_cache_lock);
 
-    // Update the inode table bitmap
-    bitmap_set(inode_table_bitmap, inumber, 1);
+    int inode_table_idx = inumber / INODES_PER_BLOCK;
+    int inode_block_idx = inumber % INODES_PER_BLOCK;
 
-    return 1;
+    // copy out just the inode rather than its whole block
+    const union fs_block *table = peek_block(inode_table_idx + INODE_TABLE_START_BLOCK);
+    memcpy(inode, &table->inodes[inode_block_idx], sizeof(struct fs_inode));
+    unpeek_block(table);
 }
 
-int fs_getsize( int inumber ){
-    if( !is_mounted ) return -1; // Not 0, because 0 can still be a valid inode size
+// copy count pointers starting at index from out of an indirect block
+void load_pointers(int indirect, int from, int count, int *pointers){
+    if( count <= 0 ) return;
+    const union fs_block *block = peek_block(indirect);
+    memcpy(pointers, &block->pointers[from], count * sizeof(int));
+    unpeek_block(block);
+}
 
-    union fs_block buffer_block;
+int max_file_blocks(){
+    return superblock.version == FS_VERSION_EXTENTS ? MAX_EXTENT_FILE_BLOCKS : MAX_FILE_BLOCKS;
+}
 
-    // reading superblock to see if inumber is valid
-    disk_read(0, buffer_block.data);
-    if (inumber <= 0 || inumber >= buffer_block.super.ninodes) return -1;
+int file_blocks(const struct fs_inode *inode){
+    return inode->size / DISK_BLOCK_SIZE + (inode->size % DISK_BLOCK_SIZE > 0);
+}
 
-    struct fs_inode inode_to_check;
-    load_inode(inumber, &inode_to_check);
+// the logical blocks an extent covers, and the blocks a compressed chunk is stored in (0 for any other extent)
+int extent_blocks(const struct fs_extent *extent){
+    return extent->length >= 0 ? extent->length : -extent->length >> 8;
+}
 
-    // if inode is not valid, then return -1
-    if (!inode_to_check.isvalid) return -1;
+int extent_stored(const struct fs_extent *extent){
+    return extent->length >= 0 ? 0 : -extent->length & 0xff;
+}
 
-    return inode_to_check.size;
+struct fs_extent extent_of(const struct map_run *run){
+    return (struct fs_extent){ .start = run->start, .length = run->stored ? -(run->length << 8 | run->stored) : run->length };
 }
 
-int fs_read( int inumber, char *data, int length, int offset ) {
-    if( !is_mounted ) return 0;
-    union fs_block buffer_block;
-    int bytes_read = 0;
+/*
+Physical block holding a file's logical block, with *run set to how many blocks from there on (at most
+want, at least 1) are consecutive on disk too, so a caller needs one lookup per contiguous stretch rather
+than one per block. An extent map is searched from the front, reading chain blocks in place. Returns 0
+for a hole, with *run then the count of unallocated blocks from there on, and past the end of an extent
+map, which only a damaged one has. In a compressed chunk no logical block has a physical one of its own:
+the chunk's first block is returned for all of them, *run counting those left in the chunk, and *stored
+is set to the blocks it is stored in; for anything else it is 0.
+*/
+int map_lookup(const struct fs_inode *inode, int logical, int want, int *run, int *stored){
+    *run = 1;
+    *stored = 0;
+    if( superblock.version == FS_VERSION_EXTENTS ){
+        struct fs_extent_inode x;
+        memcpy(&x, inode, sizeof(x));
+        const struct fs_extent *found = NULL;
+        int base = 0, i = 0;
+        for( ; i < min(x.nextents, EXTENTS_PER_INODE) && !found; i++ ){
+            if( logical < base + extent_blocks(&x.extents[i]) ) found = &x.extents[i];
+            else base += extent_blocks(&x.extents[i]);
+        }
+        struct fs_extent in_chain;
+        for( int block_num = x.extentblock; block_num > 0 && i < x.nextents && !found; ){
+            const union fs_block *chain_block = peek_block(block_num);
+            const struct fs_extent_block *chain = &chain_block->extents;
+            for( int j = 0; j < chain->count && !found; j++, i++ ){
+                if( logical < base + extent_blocks(&chain->extents[j]) ){
+                    in_chain = chain->extents[j];
+                    found = &in_chain;
+                } else {
+                    base += extent_blocks(&chain->extents[j]);
+                }
+            }
+            block_num = chain->next;
+            unpeek_block(chain_block);
+        }
+        if( !found ) return 0;
+        *run = min(want, base + extent_blocks(found) - logical);
+        *stored = extent_stored(found);
+        return found->start && !*stored ? found->start + logical - base : found->start;
+    }
 
-    // read superblock and check validity of inumber
-    disk_read(0, buffer_block.data);
-    if ( inumber <= 0 || inumber >= buffer_block.super.ninodes ) return 0;
+    // pointers: the run is however many of the following pointers happen to be consecutive, or 0.
+    // With no indirect block, every block past the direct ones is a hole
+    const union fs_block *indirect = NULL;
+    const int *pointers = inode->direct;
+    int count = min(file_blocks(inode), DATA_POINTERS_PER_INODE);
+    if( logical >= DATA_POINTERS_PER_INODE ){
+        if( !inode->indirect ){
+            *run = min(want, file_blocks(inode) - logical);
+            return 0;
+        }
+        indirect = peek_block(inode->indirect);
+        pointers = indirect->pointers;
+        count = file_blocks(inode) - DATA_POINTERS_PER_INODE;
+        logical -= DATA_POINTERS_PER_INODE;
+    }
+    int block_num = pointers[logical];
+    int step = block_num != 0;
+    while( *run < want && logical + *run < count && pointers[logical + *run] == block_num + step * *run ) (*run)++;
+    if( indirect ) unpeek_block(indirect);
+    return block_num;
+}
 
-    // read inode's corresponding block from disk
-    int block = inumber / INODES_PER_BLOCK;
-    disk_read(block + INODE_TABLE_START_BLOCK, buffer_block.data);
+// the blocks a file's map itself occupies: its indirect block, or its chain of extent blocks. 0 ends the list
+int map_first_meta(const struct fs_inode *inode){
+    if( superblock.version == FS_VERSION_EXTENTS ){
+        struct fs_extent_inode x;
+        memcpy(&x, inode, sizeof(x));
+        return x.nextents > EXTENTS_PER_INODE ? x.extentblock : 0;
+    }
+    return file_blocks(inode) > DATA_POINTERS_PER_INODE ? inode->indirect : 0; // 0 too if past the direct blocks all are holes
+}
 
-    // choose correct inode from block and verify validity
-    struct fs_inode inode = buffer_block.inodes[inumber % INODES_PER_BLOCK];
-    if ( !inode.isvalid || offset > inode.size )   return 0;
+int map_next_meta(const struct fs_inode *inode, int meta_block){
+    if( superblock.version != FS_VERSION_EXTENTS ) return 0;
+    const union fs_block *chain_block = peek_block(meta_block);
+    int next = chain_block->extents.next;
+    unpeek_block(chain_block);
+    return next;
+}
 
-    // read data byte-by-byte from direct pointers unless and until end 
-    int distance = min(length, inode.size - offset);
-    int i = offset / DISK_BLOCK_SIZE;
-    int j = offset % DISK_BLOCK_SIZE;
-    for ( ; i < DATA_POINTERS_PER_INODE && bytes_read < distance; ++i, j=0 ) {
-        disk_read(inode.direct[i], buffer_block.data);
-        for ( ; j < DISK_BLOCK_SIZE && bytes_read < distance; ++j ) {
-            data[bytes_read++] = buffer_block.data[j];
-        }
+void map_append_begin(struct map_append *map, int inumber, union fs_inode_view *view){
+    map->inumber = inumber;
+    map->view = view;
+    map->nblocks = file_blocks(&view->inode);
+    map->last = -1;
+    map->meta = 0;
+    map->dirty = false;
+    map->filled = map->refill = false;
+    map->nchain = -1;
+    map->spares = NULL;
+    map->nspares = 0;
+    if( map->nblocks > 0 ){
+        int run, stored;
+        int block_num = map_lookup(&view->inode, map->nblocks - 1, 1, &run, &stored);
+        if( block_num ) map->last = block_num + (stored ? stored - 1 : 0);
     }
+}
 
-    // read data from indirect block (if necessary)
-    disk_read(inode.indirect, buffer_block.data);
-    int indirected_pointers[DATA_POINTERS_PER_BLOCK];
-    memcpy(indirected_pointers, buffer_block.pointers, DATA_POINTERS_PER_BLOCK);    
-    for ( i -= DATA_POINTERS_PER_INODE; i < DATA_POINTERS_PER_BLOCK && bytes_read < distance; ++i, j=0 ) {
-        disk_read(indirected_pointers[i], buffer_block.data);
-        for ( ; j < DISK_BLOCK_SIZE && bytes_read < distance; ++j ) {
-            data[bytes_read++] = buffer_block.data[j];
-        }
+// bring a pointer map's indirect block into buf, allocating an empty one first if the file has none, that is
+// if it has no blocks past the direct ones or only holes there; *fresh says which. False when there is no space
+bool map_indirect(struct map_append *map, int goal, bool *fresh){
+    struct fs_inode *inode = &map->view->inode;
+    *fresh = false;
+    if( map->meta ) return true;
+    if( map->nblocks > DATA_POINTERS_PER_INODE && inode->indirect ){
+        map->meta = inode->indirect;
+        STATS_BLOCKS(STATS_INDIRECT, 0, 1);
+        read_meta(map->meta, map->buf.data);
+        return true;
     }
-
-    return bytes_read;
+    int indirect;
+    if( !alloc_block(map->inumber, goal, &indirect) ) return false;
+    inode->indirect = map->meta = indirect;
+    memset(map->buf.data, 0, DISK_BLOCK_SIZE);
+    map->dirty = true;
+    *fresh = true;
+    return true;
 }
 
-bool alloc_block( int *pointer, int nblocks ) {
-    int k = 0;
-    for ( ; k < nblocks && !bitmap_test(disk_block_bitmap, k); ++k );
+// an indirect block with nothing in it yet must not be left allocated
+void map_drop_indirect(struct map_append *map){
+    bitmap_set(disk_block_bitmap, map->meta, 1);
+    map->view->inode.indirect = 0;
+    map->meta = 0;
+    map->dirty = false;
+}
 
-    if ( k == nblocks )     return false; // out of space cuh
+// an extent map's last extent, or null if it has none; past the inline extents the chain's last block is
+// loaded into buf for it, once
+struct fs_extent *map_last_extent(struct map_append *map){
+    struct fs_extent_inode *x = &map->view->xinode;
+    if( x->nextents > EXTENTS_PER_INODE && !map->meta ){
+        map->meta = x->extentblock;
+        STATS_BLOCKS(STATS_INDIRECT, 0, 1);
+        read_meta(map->meta, map->buf.data);
+        while( map->buf.extents.next ){
+            map->meta = map->buf.extents.next;
+            STATS_BLOCKS(STATS_INDIRECT, 0, 1);
+            read_meta(map->meta, map->buf.data);
+        }
+    }
+    if( x->nextents == 0 ) return NULL;
+    if( x->nextents <= EXTENTS_PER_INODE ) return &x->extents[x->nextents - 1];
+    return &map->buf.extents.extents[map->buf.extents.count - 1];
+}
 
-    bitmap_set(disk_block_bitmap, k, 0);
-    *pointer = k;
+// whether length blocks at start (0 for holes) carry on the run or extent last, which ends where they begin
+bool map_continues(int last_start, int last_length, int start){
+    if( last_start == 0 || start == 0 ) return last_start == start;
+    return last_start + last_length == start;
+}
 
+// add length blocks at start (0 for holes) to the end of an extent map: the last extent grows when they carry it
+// on (a compressed chunk never grows), otherwise one is added, starting a new chain block when the inode or the last chain block is full; chain
+// blocks come from wherever is free, never from the file's reservation. False when there is no space for one
+bool map_add_extent(struct map_append *map, int start, int length){
+    struct fs_extent_inode *x = &map->view->xinode;
+    struct fs_extent *last = map_last_extent(map);
+    if( last && last->length > 0 && map_continues(last->start, last->length, start) ){
+        last->length += length;
+        if( x->nextents > EXTENTS_PER_INODE ) map->dirty = true;
+        return true;
+    }
+    if( x->nextents < EXTENTS_PER_INODE ){
+        x->extents[x->nextents++] = (struct fs_extent){ .start = start, .length = length };
+        return true;
+    }
+    if( !map->meta || map->buf.extents.count == EXTENTS_PER_BLOCK ){
+        int chain_block;
+        if( !alloc_block(0, -1, &chain_block) ) return false;
+        if( map->meta ){
+            map->buf.extents.next = chain_block;
+            STATS_BLOCKS(STATS_INDIRECT, 1, 1);
+            write_meta(map->meta, map->buf.data);
+        } else {
+            x->extentblock = chain_block;
+        }
+        map->meta = chain_block;
+        memset(map->buf.data, 0, DISK_BLOCK_SIZE);
+    }
+    map->buf.extents.extents[map->buf.extents.count++] = (struct fs_extent){ .start = start, .length = length };
+    x->nextents++;
+    map->dirty = true;
     return true;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset ) { // option: make read/write one funtion
-    union fs_block buffer_block;
-    int bytes_written = 0;
-
-    // read superblock and check validity of inumber
-    disk_read(0, buffer_block.data);
-    if ( inumber <= 0 || inumber >= buffer_block.super.ninodes )    return 0;
-
-    int nblocks = buffer_block.super.nblocks; // stash nblocks to search bitmap for free blocks
-
-    // read inode's corresponding block from disk
-    union fs_block inode_block;
-    int block = inumber / INODES_PER_BLOCK;
-    disk_read(block + INODE_TABLE_START_BLOCK, inode_block.data);
-
-    // choose correct inode from block and verify validity
-    // use address so that we can update this fs_block and write it back later
-    struct fs_inode *inode = &(inode_block.inodes[inumber % INODES_PER_BLOCK]);
-    if ( !inode->isvalid || offset > inode->size ) return 0; // accept big offset?
-
-    // compute number of pointers already allocated
-    int num_pointers = ((inode->size % DISK_BLOCK_SIZE) > 0) + (inode->size / DISK_BLOCK_SIZE);
-
-    // write data byte-by-byte to direct pointers
-    int i = offset / DISK_BLOCK_SIZE;
-    int j = offset % DISK_BLOCK_SIZE;
-    for ( ; i < DATA_POINTERS_PER_INODE && bytes_written < length; ++i, j=0 ) {
-        // allocate new block
-        if ( i >= num_pointers ) {
-            if ( !alloc_block(&(inode->direct[i]), nblocks) ) {
-                // return sequence
-                inode->size = -min( -inode->size, -(offset + bytes_written) );
-                disk_write( inumber/INODES_PER_BLOCK + INODE_TABLE_START_BLOCK, inode_block.data );
-                return bytes_written;
+/*
+Allocate the file's next block, right after its last one if possible, and add it to the map. A pointer
+map takes its indirect block first, when the first block past the direct ones is added, so the data that
+follows it stays in one run. An extent map grows its last extent or adds one (see map_add_extent). False
+when there is no space left for either block.
+*/
+bool map_append_alloc(struct map_append *map, int *block_num){
+    int goal = map->last < 0 ? -1 : map->last + 1;
+
+    if( superblock.version != FS_VERSION_EXTENTS ){
+        struct fs_inode *inode = &map->view->inode;
+        if( map->nblocks < DATA_POINTERS_PER_INODE ){
+            if( !alloc_block(map->inumber, goal, block_num) ) return false;
+            inode->direct[map->nblocks] = *block_num;
+        } else {
+            bool fresh;
+            if( !map_indirect(map, goal, &fresh) ) return false;
+            if( fresh ) goal = map->meta + 1;
+            if( !alloc_block(map->inumber, goal, block_num) ){
+                if( fresh ) map_drop_indirect(map);
+                return false;
             }
+            map->buf.pointers[map->nblocks - DATA_POINTERS_PER_INODE] = *block_num;
+            map->dirty = true;
         }
+        map->last = *block_num;
+        map->nblocks++;
+        return true;
+    }
 
-        // descriptive comment here
-        disk_read(inode->direct[i], buffer_block.data);
-        for ( ; j < DISK_BLOCK_SIZE && bytes_written < length; ++j ) {
-            buffer_block.data[j] = data[bytes_written++];
-        }
-        disk_write(inode->direct[i], buffer_block.data);
+    if( !alloc_block(map->inumber, goal, block_num) ) return false;
+    if( !map_add_extent(map, *block_num, 1) ){
+        bitmap_set(disk_block_bitmap, *block_num, 1);
+        return false;
     }
+    map->last = *block_num;
+    map->nblocks++;
+    return true;
+}
 
-    // allocate new indirect block (if necessary)
-    union fs_block indirect_block;
-    int *indirected_pointers;
-    if ( inode->size < DATA_POINTERS_PER_INODE * DISK_BLOCK_SIZE && bytes_written < length ) {
-        if ( !alloc_block(&(inode->indirect), nblocks) ) {
-            // return sequence
-            inode->size = -min( -inode->size, -(offset + bytes_written) );
-            disk_write( inumber/INODES_PER_BLOCK + INODE_TABLE_START_BLOCK, inode_block.data );
-            return bytes_written;
+// add count holes to the end of the map. They take no blocks: a pointer map's entries for them are 0, past the
+// direct ones in an indirect block that need not exist yet, and an extent map covers them with extents starting
+// at 0. False when an extent map needs a new chain block and there is no space for it
+bool map_append_hole(struct map_append *map, int count){
+    if( superblock.version == FS_VERSION_EXTENTS ){
+        if( !map_add_extent(map, 0, count) ) return false;
+        map->nblocks += count;
+        return true;
+    }
+    struct fs_inode *inode = &map->view->inode;
+    for( ; count > 0; count--, map->nblocks++ ){
+        if( map->nblocks < DATA_POINTERS_PER_INODE ) inode->direct[map->nblocks] = 0;
+        else if( map->nblocks == DATA_POINTERS_PER_INODE && !map->meta ) inode->indirect = 0;
+        else if( map->meta || inode->indirect ){
+            bool fresh;
+            map_indirect(map, -1, &fresh); // the file has one, so this only loads it
+            map->buf.pointers[map->nblocks - DATA_POINTERS_PER_INODE] = 0;
+            map->dirty = true;
         }
-    } 
-    if ( bytes_written < length ) {
-        disk_read(inode->indirect, indirect_block.data);
-        indirected_pointers = indirect_block.pointers;
     }
-    bool indirect_writeback = false;
-    // write data to indirect block (if necessary)
+    return true;
+}
 
-    for ( i -= DATA_POINTERS_PER_INODE, num_pointers -= DATA_POINTERS_PER_INODE; i < DATA_POINTERS_PER_BLOCK && bytes_written < length; ++i, j=0 ) {    
-        // allocate new block
-        if ( i >= num_pointers ) {
-            if ( !alloc_block(&(indirected_pointers[i]), nblocks) ) {
-                // return sequence
-                if (indirect_writeback) {
-                    disk_write( inode->indirect, indirect_block.data );
-                }
-                inode->size = -min( -inode->size, -(offset + bytes_written) );
-                disk_write( inumber/INODES_PER_BLOCK + INODE_TABLE_START_BLOCK, inode_block.data );
-                return bytes_written;
+/*
+Allocate a block for the hole at logical, inside the file, and map it there. The decoded map, which the
+caller found the hole in, takes the change at once. A pointer map's entry is set through buf like an
+appended one; an extent map is written out again by map_fill_end, once for all of an fs_write's fills,
+which come before its appends. That must not fail, so the chain blocks it will need are taken here as the
+map grows. The block itself goes by goal alone, since the file's reservation is for its end. False when
+there is no space for the block or for the map.
+*/
+bool map_fill_alloc(struct map_append *map, struct cached_inode *cached, int logical, int goal, int *block_num){
+    if( !alloc_block(0, goal, block_num) ) return false;
+
+    if( superblock.version != FS_VERSION_EXTENTS ){
+        if( logical < DATA_POINTERS_PER_INODE ) map->view->inode.direct[logical] = *block_num;
+        else {
+            bool fresh;
+            if( !map_indirect(map, *block_num + 1, &fresh) ){
+                bitmap_set(disk_block_bitmap, *block_num, 1);
+                return false;
             }
-            indirect_writeback = true;
+            map->buf.pointers[logical - DATA_POINTERS_PER_INODE] = *block_num;
+            map->dirty = true;
         }
+        map_set_range(cached, logical, 1, *block_num, 0);
+        map->filled = true;
+        return true;
+    }
+
+    map_set_range(cached, logical, 1, *block_num, 0);
+    if( !map_fill_room(map, cached->nruns) ){
+        map_set_range(cached, logical, 1, 0, 0);
+        bitmap_set(disk_block_bitmap, *block_num, 1);
+        return false;
+    }
+    map->filled = map->refill = true;
+    return true;
+}
 
-        disk_read(indirected_pointers[i], buffer_block.data);
-        for ( ; j < DISK_BLOCK_SIZE && bytes_written < length; ++j ) {
-            buffer_block.data[j] = data[bytes_written++];
+// take spare chain blocks until map_fill_end has enough for an extent map of nruns runs; false if there is no space
+bool map_fill_room(struct map_append *map, int nruns){
+    if( map->nchain < 0 ){
+        int *chain = map_meta_blocks(&map->view->inode, &map->nchain);
+        free(chain);
+    }
+    while( map_chain_blocks(nruns) > map->nchain + map->nspares ){
+        int chain_block;
+        if( !alloc_block(0, -1, &chain_block) ) return false;
+        map->spares = realloc(map->spares, (map->nspares + 1) * sizeof(int));
+        if( !map->spares ){
+            printf("ERROR Failed to allocate memory. Exiting...\n");
+            abort();
         }
-        disk_write(indirected_pointers[i], buffer_block.data);
+        map->spares[map->nspares++] = chain_block;
     }
+    return true;
+}
 
-    // return sequence when it spills over to indirect block
-    if (indirect_writeback) {
-        disk_write( inode->indirect, indirect_block.data );
+// write an extent map the fills changed out again from the decoded runs, into its own chain and the spares
+void map_fill_end(struct map_append *map, struct cached_inode *cached){
+    if( !map->refill ) return;
+    int nchain;
+    int *chain = map_meta_blocks(&map->view->inode, &nchain);
+    chain = realloc(chain, (nchain + map->nspares + 1) * sizeof(int));
+    if( !chain ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
     }
-    // return sequence
-    inode->size = -min( -inode->size, -(offset + bytes_written) );
-    disk_write( inumber/INODES_PER_BLOCK + INODE_TABLE_START_BLOCK, inode_block.data );
-    return bytes_written;
+    memcpy(chain + nchain, map->spares, map->nspares * sizeof(int));
+    nchain += map->nspares;
+
+    map_store_extents(&map->view->xinode, cached->runs, cached->nruns, chain);
+    for( int i = map_chain_blocks(cached->nruns); i < nchain; i++ ) release_block(chain[i]);
+    free(chain);
+    free(map->spares);
+    map->spares = NULL;
+    map->nspares = 0;
+    map->refill = false;
 }
 
-// Helper function for fs_debug; Moves a data block to a temporary defragged data region
-void move_block(int block_num, int index, union fs_block* defrag_data){
-    union fs_block block_buffer;
-    disk_read(block_num, block_buffer.data);
-    memcpy(defrag_data + index, block_buffer.data, sizeof(union fs_block));
+void map_append_end(struct map_append *map){
+    free(map->spares); // only left if map_fill_end was never called, when nothing was filled either
+    if( !map->dirty ) return;
+    STATS_BLOCKS(STATS_INDIRECT, 1, 1);
+    write_meta(map->meta, map->buf.data);
 }
 
-int fs_defrag(){
+// the blocks a file's map itself occupies, in order, as a list the caller frees
+int *map_meta_blocks(const struct fs_inode *inode, int *count){
+    int capacity = 4;
+    int *blocks = malloc(capacity * sizeof(int));
+    *count = 0;
+    for( int meta_block = map_first_meta(inode); blocks && meta_block > 0; meta_block = map_next_meta(inode, meta_block) ){
+        if( *count == capacity ){
+            capacity *= 2;
+            blocks = realloc(blocks, capacity * sizeof(int));
+            if( !blocks ) break;
+        }
+        blocks[(*count)++] = meta_block;
+    }
+    if( !blocks ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    return blocks;
+}
 
-    /*  Create a temporary inode table and data region to hold defragged data */
-    union fs_block block_buffer;
-    disk_read(0, block_buffer.data);
+// chain blocks an extent map of nextents extents needs
+int map_chain_blocks(int nextents){
+    return nextents > EXTENTS_PER_INODE ? (nextents - EXTENTS_PER_INODE + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0;
+}
 
-    int defrag_inumber = 1; // Next available position in defragged inode table
-    int defrag_data_index = 0; // Next available position in defragged data region
-    int ninodeblocks = block_buffer.super.ninodeblocks;
-    int ninodes = block_buffer.super.ninodes;
-    int nblocks = block_buffer.super.nblocks;
+// write an extent map out from runs in logical order: the first in the inode, the rest packed into chain[]
+// in order, which must hold at least map_chain_blocks(nruns) blocks. Chain blocks that come out the same
+// as they were are not written again, so a change near the end of a long map costs a block or two
+void map_store_extents(struct fs_extent_inode *x, const struct map_run *runs, int nruns, const int *chain){
+    memset(x->extents, 0, sizeof(x->extents));
+    for( int i = 0; i < min(nruns, EXTENTS_PER_INODE); i++ ) x->extents[i] = extent_of(&runs[i]);
+    x->nextents = nruns;
+    x->extentblock = nruns > EXTENTS_PER_INODE ? chain[0] : 0;
+
+    union fs_block chain_block;
+    for( int c = 0, i = EXTENTS_PER_INODE; i < nruns; c++ ){
+        memset(chain_block.data, 0, DISK_BLOCK_SIZE);
+        struct fs_extent_block *extents = &chain_block.extents;
+        for( ; i < nruns && extents->count < EXTENTS_PER_BLOCK; i++ ) extents->extents[extents->count++] = extent_of(&runs[i]);
+        extents->next = i < nruns ? chain[c + 1] : 0;
+        write_if_changed(chain[c], &chain_block);
+    }
+}
 
-    union fs_block* defrag_inode_table = calloc(ninodeblocks, sizeof(union fs_block)); // overkill, but sets all inodes in new table to invalid
-    union fs_block* defrag_data = malloc(sizeof(union fs_block) * (nblocks - ninodeblocks - 1));
-    if( !(defrag_inode_table && defrag_data) ){
-        printf("[ERROR] Failed to allocate memory. Exiting...\n");
-        abort();
+/*
+Point an extent file at its allocated blocks, now placed one after another from start in logical order:
+each stretch of data moves as a whole, a compressed chunk as the blocks it is stored in, and its holes
+stay where they were. The map never needs more extents than it had, so its own chain blocks are enough:
+those it still needs are reused and the rest released.
+*/
+void map_set_layout(int inumber, int start){
+    struct cached_inode *cached = inode_get(inumber);
+    const struct fs_inode *inode = &cached->view.inode;
+    map_find_run(cached, 0);
+    int nruns = cached->nruns;
+    struct map_run *runs = cached->runs;
+    cached->runs = NULL;
+    cached->nruns = cached->runs_capacity = 0;
+    for( int i = 0; i < nruns; i++ ){
+        const struct map_run *r = &runs[i];
+        map_add_run(cached, r->logical, r->start ? start : 0, r->length, r->stored);
+        if( r->start ) start += r->stored ? r->stored : r->length;
     }
+    free(runs);
+
+    int nchain;
+    int *chain = map_meta_blocks(inode, &nchain);
+    map_store_extents(&cached->view.xinode, cached->runs, cached->nruns, chain);
+    for( int i = map_chain_blocks(cached->nruns); i < nchain; i++ ) release_block(chain[i]);
+    free(chain);
+    __atomic_store_n(&cached->decoded, true, __ATOMIC_RELEASE); // the runs are the new map
+    inode_put(cached, true);
+}
 
-    /* Iterate through inode blocks */
-    for (int i = INODE_TABLE_START_BLOCK; i < INODE_TABLE_START_BLOCK + ninodeblocks; i++) {
-        disk_read(i, block_buffer.data);
-        // Iterate through each inode in the block
-        for (int j = 0; j < INODES_PER_BLOCK; j++) {
+// drop a cached inode's decoded map, after anything but an append changed the map
+void map_forget(struct cached_inode *cached){
+    free(cached->runs);
+    cached->runs = NULL;
+    cached->nruns = cached->runs_capacity = 0;
+    cached->decoded = false;
+}
 
-            // If inode is valid and taken, add to defragged table and defrag data region
-            if ( (i == INODE_TABLE_START_BLOCK) && (j == 0 ) ) continue;
+// make room in the decoded map for at least count runs
+void map_reserve_runs(struct cached_inode *cached, int count){
+    if( count <= cached->runs_capacity ) return;
+    while( cached->runs_capacity < count ) cached->runs_capacity = cached->runs_capacity ? 2 * cached->runs_capacity : 4;
+    cached->runs = realloc(cached->runs, cached->runs_capacity * sizeof(*cached->runs));
+    if( !cached->runs ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+}
 
-            int inumber = (i - INODE_TABLE_START_BLOCK) * INODES_PER_BLOCK + j;
-            if ( !bitmap_test(inode_table_bitmap, inumber) ) {
+// extend the decoded map by length blocks at logical (a compressed chunk if stored is not 0), merging with the
+// last run when they follow on
+void map_add_run(struct cached_inode *cached, int logical, int start, int length, int stored){
+    if( cached->nruns && !stored ){
+        struct map_run *last = &cached->runs[cached->nruns - 1];
+        if( !last->stored && last->logical + last->length == logical && map_continues(last->start, last->length, start) ){
+            last->length += length;
+            return;
+        }
+    }
+    map_reserve_runs(cached, cached->nruns + 1);
+    cached->runs[cached->nruns++] = (struct map_run){ .logical = logical, .start = start, .length = length, .stored = stored };
+}
 
-                /*  Add to defragged table */
-                int defrag_inode_offset = defrag_inumber % INODES_PER_BLOCK;
-                int inode_offset = inumber % INODES_PER_BLOCK; // = j
-                union fs_block *defrag_block = defrag_inode_table + defrag_inumber / INODES_PER_BLOCK;
+// index of the decoded run holding logical, -1 past the end
+int map_run_index(const struct cached_inode *cached, int logical){
+    int lo = 0, hi = cached->nruns - 1;
+    while( lo <= hi ){
+        int mid = (lo + hi) / 2;
+        const struct map_run *r = &cached->runs[mid];
+        if( logical < r->logical )                   hi = mid - 1;
+        else if( logical >= r->logical + r->length ) lo = mid + 1;
+        else                                         return mid;
+    }
+    return -1;
+}
 
-                defrag_block->inodes[defrag_inode_offset] = block_buffer.inodes[inode_offset];
-                defrag_inumber++; // Increment inumber to be next available one
+// point logical blocks [logical, logical+length) of the decoded map at start (0 for holes; a compressed chunk
+// if stored is not 0), splitting the runs at either end and merging the pieces with the runs either side where
+// they follow on. The range may run past the end of the map, which then grows. A compressed chunk cannot be
+// split, so is only ever replaced whole: compressed files are rewritten a chunk at a time
+void map_set_range(struct cached_inode *cached, int logical, int length, int start, int stored){
+    int i = map_run_index(cached, logical);
+    if( i < 0 ) return;
+    int end = logical + length, j = i;
+    while( j + 1 < cached->nruns && cached->runs[j + 1].logical < end ) j++;
+
+    // runs first..last are replaced by the pieces, at most five of them before merging
+    struct map_run head = cached->runs[i], tail = cached->runs[j], pieces[5];
+    int first = i > 0 ? i - 1 : i, last = j + 1 < cached->nruns ? j + 1 : j, n = 0;
+    if( first < i ) pieces[n++] = cached->runs[first];
+    if( logical > head.logical ) pieces[n++] = (struct map_run){ .logical = head.logical, .start = head.start, .length = logical - head.logical };
+    pieces[n++] = (struct map_run){ .logical = logical, .start = start, .length = length, .stored = stored };
+    if( end < tail.logical + tail.length )
+        pieces[n++] = (struct map_run){ .logical = end, .start = tail.start ? tail.start + end - tail.logical : 0,
+                                        .length = tail.logical + tail.length - end };
+    if( last > j ) pieces[n++] = cached->runs[last];
+    int m = 0;
+    for( int k = 0; k < n; k++ ){
+        struct map_run *prev = m ? &pieces[m - 1] : NULL;
+        if( prev && !prev->stored && !pieces[k].stored && map_continues(prev->start, prev->length, pieces[k].start) ) prev->length += pieces[k].length;
+        else pieces[m++] = pieces[k];
+    }
 
-                /*  Defrag  data pointers */
+    int replaced = last - first + 1;
+    map_reserve_runs(cached, cached->nruns - replaced + m);
+    memmove(&cached->runs[first + m], &cached->runs[last + 1], (cached->nruns - last - 1) * sizeof(*cached->runs));
+    memcpy(&cached->runs[first], pieces, m * sizeof(*cached->runs));
+    cached->nruns += m - replaced;
+}
 
-                // Loop through indirect block's pointers and direct pointers separately
-                int num_blocks = (block_buffer.inodes[inode_offset].size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
-                int direct_blocks = 0;
-                int indirect_blocks = 0;
-                if (num_blocks <= 5) {
-                    direct_blocks = num_blocks;
-                } else {
-                    direct_blocks = 5;
-                    indirect_blocks = num_blocks - 5;
-                }
+// cut the decoded map back to its first nblocks logical blocks
+void map_trim_runs(struct cached_inode *cached, int nblocks){
+    while( cached->nruns && cached->runs[cached->nruns - 1].logical >= nblocks ) cached->nruns--;
+    if( cached->nruns ){
+        struct map_run *last = &cached->runs[cached->nruns - 1];
+        if( last->logical + last->length > nblocks ) last->length = nblocks - last->logical;
+    }
+}
+
+// read the whole map once: extents straight from the inode and its chain, pointers a contiguous stretch at a time
+void map_decode(struct cached_inode *cached){
+    const struct fs_inode *inode = &cached->view.inode;
+    cached->nruns = 0;
+    if( superblock.version == FS_VERSION_EXTENTS ){
+        const struct fs_extent_inode *x = &cached->view.xinode;
+        int logical = 0, i = 0;
+        for( ; i < min(x->nextents, EXTENTS_PER_INODE); logical += extent_blocks(&x->extents[i++]) )
+            map_add_run(cached, logical, x->extents[i].start, extent_blocks(&x->extents[i]), extent_stored(&x->extents[i]));
+        for( int block_num = x->extentblock; block_num > 0 && i < x->nextents; ){
+            const union fs_block *chain_block = peek_block(block_num);
+            const struct fs_extent_block *chain = &chain_block->extents;
+            for( int j = 0; j < chain->count; logical += extent_blocks(&chain->extents[j++]), i++ )
+                map_add_run(cached, logical, chain->extents[j].start, extent_blocks(&chain->extents[j]), extent_stored(&chain->extents[j]));
+            block_num = chain->next;
+            unpeek_block(chain_block);
+        }
+    } else {
+        for( int logical = 0, run, stored; logical < file_blocks(inode); logical += run ){
+            int block_num = map_lookup(inode, logical, file_blocks(inode) - logical, &run, &stored);
+            map_add_run(cached, logical, block_num, run, 0);
+        }
+    }
+    __atomic_store_n(&cached->decoded, true, __ATOMIC_RELEASE);
+}
+
+// the decoded run holding logical, or null past the end; a binary search, with no block reads once the map
+// is decoded. Readers sharing an inode may all find it undecoded, so decoding is done once, under inode_cache_lock
+const struct map_run *map_find_run(struct cached_inode *cached, int logical){
+    if( !__atomic_load_n(&cached->decoded, __ATOMIC_ACQUIRE) ){
+        pthread_mutex_lock(&inode_cache_lock);
+        if( !cached->decoded ) map_decode(cached);
+        pthread_mutex_unlock(&inode_cache_lock);
+    }
+    int i = map_run_index(cached, logical);
+    return i < 0 ? NULL : &cached->runs[i];
+}
+
+// map_lookup through the decoded map
+int map_lookup_cached(struct cached_inode *cached, int logical, int want, int *run, int *stored){
+    const struct map_run *r = map_find_run(cached, logical);
+    *run = 1;
+    *stored = 0;
+    if( !r ) return 0;
+    *run = min(want, r->logical + r->length - logical);
+    *stored = r->stored;
+    return r->start && !r->stored ? r->start + logical - r->logical : r->start;
+}
+
+// the walk's position lives in *walk, so any number of walks can be under way at once
+int walk_inode_table(struct inode_table_walk *walk, int from_inumber, struct fs_inode *next_inode){
+    int ninodes = superblock.ninodes;
+
+    // handle arg
+    if( from_inumber >= ninodes ) return -1; // -1 indicates invalid input
+    else if( from_inumber >= 1 ) walk->inumber = from_inumber;
+    // check if we have finished traversal
+    if( walk->inumber >= ninodes ) return 0; // 0 indicates invalid inode
+
+    // the table is read in place each time, so the walk never sees stale inodes
+    load_inode(walk->inumber, next_inode);
+
+    return walk->inumber++;
+}
+
+int walk_inode_data(struct inode_data_walk *walk, int for_inumber, const struct fs_inode *for_inode, char *data){
+    // initialization
+    if( for_inumber >= 1 || for_inode ){
+        walk->block = 0;
+        walk->run = 0;
+        if( for_inumber > 0 )   load_inode(for_inumber, &walk->inode);
+        else                    walk->inode = *for_inode; // this implicitly copies, so we don't have to worry about for_inode being modified later
+    }
+    // one map lookup per contiguous stretch, in either inode format; holes have no blocks to visit, so are skipped
+    // whole, and a compressed chunk's are the blocks it is stored in
+    if( walk->run == 0 ){
+        do {
+            // short-circuit if no more data
+            if( walk->block >= file_blocks(&walk->inode) || walk->block >= max_file_blocks() ) return -1;
+            int stored;
+            walk->at = map_lookup(&walk->inode, walk->block, file_blocks(&walk->inode) - walk->block, &walk->run, &stored);
+            walk->block += walk->run;
+            if( stored ) walk->run = stored;
+        } while( !walk->at );
+    } else {
+        walk->at++;
+    }
+    walk->run--;
+    if( data ){ // allow data to be null
+        STATS_BLOCKS(STATS_DATA, 0, 1);
+        cache_read(walk->at, data);
+    }
+    return walk->at;
+}
+
+int fs_format() {
+    return format_disk(FS_VERSION_POINTERS, false);
+}
+
+int fs_format_version( int version ) {
+    return format_disk(version, false);
+}
+
+int fs_format_compressed() {
+    return format_disk(FS_VERSION_EXTENTS, true);
+}
+
+int format_disk(int version, bool compress) {
+    STATS_OP(STATS_FORMAT);
+    // don't format: already mounted, or asked for a format we don't know
+    if (version != FS_VERSION_POINTERS && version != FS_VERSION_EXTENTS) return 0;
+    lock_fs(true);
+    if (is_mounted){
+        unlock_fs();
+        return 0;
+    }
 
-                // Direct pointer blocks
-                for (int k = 0; k < direct_blocks; k++) {
-                    // Move to temp data region
-                    int block_num = block_buffer.inodes[inode_offset].direct[k];
-                    move_block(block_num, defrag_data_index, defrag_data);
+    union fs_block buffer_block;
+    memset(buffer_block.data, 0, DISK_BLOCK_SIZE);
+    struct fs_superblock *superblock_ptr = &buffer_block.super;
+
+    // set superblock values
+    superblock_ptr->magic = FS_MAGIC;
+    superblock_ptr->nblocks = disk_size();
+    // compute 10% of blocks for inodes
+    int ninodeblocks_temp = superblock_ptr->nblocks / 10;
+    superblock_ptr->ninodeblocks = ninodeblocks_temp;
+    superblock_ptr->ninodes = superblock_ptr->ninodeblocks * INODES_PER_BLOCK;
+    // free bitmaps follow the inode table; an empty disk's bitmaps are written below, so it starts out clean
+    superblock_ptr->bitmapstart = INODE_TABLE_START_BLOCK + ninodeblocks_temp;
+    superblock_ptr->nbitmapblocks = bitmap_blocks(superblock_ptr->ninodes) + bitmap_blocks(superblock_ptr->nblocks);
+    superblock_ptr->clean = 1;
+    superblock_ptr->version = version;
+    superblock_ptr->compress = compress;
+    superblock_ptr->blocksize = DISK_BLOCK_SIZE;
+    superblock_ptr->ndirect = DATA_POINTERS_PER_INODE;
+    // then the journal, a sixteenth of the disk within bounds; its empty header is written below
+    int njournalblocks = min(superblock_ptr->nblocks / 16, JOURNAL_MAX_BLOCKS);
+    if( njournalblocks >= JOURNAL_MIN_BLOCKS ){
+        superblock_ptr->journalstart = superblock_ptr->bitmapstart + superblock_ptr->nbitmapblocks;
+        superblock_ptr->njournalblocks = njournalblocks;
+        superblock_ptr->journaled = 1;
+    }
+    // only the start of the inode table is zeroed now, the rest as fs_create gets to it
+    superblock_ptr->inodeinit = min(ninodeblocks_temp, INODE_INIT_CHUNK);
+
+    // write superblock values
+    STATS_BLOCKS(STATS_SUPERBLOCK, 1, 1);
+    cache_write(0, buffer_block.data);
+    superblock = *superblock_ptr;
+
+    bitmap_t inodes_free = bitmap_create(superblock.ninodes);
+    bitmap_t blocks_free = bitmap_create(superblock.nblocks);
+    bitmap_set_range(inodes_free, 1, superblock.ninodes, 1);
+    bitmap_set_range(blocks_free, min(data_start_block(), superblock.nblocks), superblock.nblocks, 1);
+    bitmap_store(inodes_free, superblock.bitmapstart);
+    bitmap_store(blocks_free, superblock.bitmapstart + bitmap_blocks(superblock.ninodes));
+    bitmap_delete(inodes_free);
+    bitmap_delete(blocks_free);
+    if( superblock.journalstart ){
+        memset(buffer_block.data, 0, DISK_BLOCK_SIZE);
+        STATS_BLOCKS(STATS_JOURNAL, 1, 1);
+        cache_write(superblock.journalstart, buffer_block.data);
+    }
 
-                    // Update the inode direct pointers and defrag data index
-                    defrag_block->inodes[defrag_inode_offset].direct[k] = defrag_data_index + INODE_TABLE_START_BLOCK + ninodeblocks;
-                    defrag_data_index++;
+    if( superblock.inodeinit ){
+        char *zeros = calloc(superblock.inodeinit, DISK_BLOCK_SIZE);
+        if( !zeros ){
+            printf("ERROR Failed to allocate memory. Exiting...\n");
+            abort();
+        }
+        STATS_BLOCKS(STATS_INODE_TABLE, 1, superblock.inodeinit);
+        cache_write_range(INODE_TABLE_START_BLOCK, superblock.inodeinit, zeros);
+        free(zeros);
+    }
+
+    unlock_fs();
+    return 1;
+}
+
+// whether an image was formatted with this build's geometry; those from before it could change have the default
+bool geometry_matches(const struct fs_superblock *super){
+    return (super->blocksize ? super->blocksize : DEFAULT_BLOCK_SIZE) == DISK_BLOCK_SIZE &&
+        (super->ndirect ? super->ndirect : DEFAULT_DATA_POINTERS) == DATA_POINTERS_PER_INODE;
+}
+
+void fs_debug(){
+    union fs_block buffer_block;
+    lock_fs(true);
+
+    // superblock
+    STATS_BLOCKS(STATS_SUPERBLOCK, 0, 1);
+    cache_read(0, buffer_block.data);
+    struct fs_superblock on_disk = buffer_block.super;
+    printf("superblock:\n");
+    printf("    magic number %s valid\n", on_disk.magic == FS_MAGIC ? "is" : "is not");
+    printf("    %d blocks total on disk\n", on_disk.nblocks);
+    printf("    %d blocks dedicated to inode table on disk\n", on_disk.ninodeblocks);
+    printf("    %d total spots in inode table\n", on_disk.ninodes);
+    if( on_disk.bitmapstart ){
+        printf("    %d blocks dedicated to free bitmaps on disk\n", on_disk.nbitmapblocks);
+        printf("    file system was %s unmounted\n", on_disk.clean ? "cleanly" : "not cleanly");
+    }
+    if( on_disk.journalstart ) printf("    %d blocks dedicated to the metadata journal at block %d\n", on_disk.njournalblocks, on_disk.journalstart);
+    if( on_disk.defragcursor ) printf("    incremental defrag resumes at inode %d\n", on_disk.defragcursor);
+    if( on_disk.version == FS_VERSION_EXTENTS ) printf("    inodes map their data with extents\n");
+    if( on_disk.compress ) printf("    new files are compressed\n");
+    if( on_disk.inodeinit && on_disk.inodeinit < on_disk.ninodeblocks ) printf("    %d inode table blocks zeroed so far\n", on_disk.inodeinit);
+    // with another geometry the inode table cannot even be read
+    if( !geometry_matches(&on_disk) ){
+        printf("    made for %d byte blocks and %d direct pointers per inode, not this build's %d and %d\n",
+            on_disk.blocksize ? on_disk.blocksize : DEFAULT_BLOCK_SIZE, on_disk.ndirect ? on_disk.ndirect : DEFAULT_DATA_POINTERS,
+            DISK_BLOCK_SIZE, DATA_POINTERS_PER_INODE);
+        unlock_fs();
+        return;
+    }
+    // walk_inode_table relies on the cached superblock, which is only populated once mounted
+    if( !is_mounted ) superblock = on_disk;
+
+    // walk inode table
+    struct inode_table_walk table_walk;
+    struct fs_inode inode;
+    for( int inumber = walk_inode_table(&table_walk, 1, &inode); inumber > 0; inumber = walk_inode_table(&table_walk, -1, &inode) ){
+        if( !inode.isvalid || inumber == 0 ) continue;
+        printf("inode %d:\n", inumber);
+        printf("    size: %d bytes\n", inode.size);
+        int nholes = 0, npacked = 0, nstored = 0;
+        if( superblock.version == FS_VERSION_EXTENTS ){
+            // one start+length pair per extent (a hole's start is 0), a compressed chunk's followed by /the blocks
+            // it is stored in, then the chain holding those past the inline ones
+            printf("    extents:");
+            for( int logical = 0, run, stored; logical < file_blocks(&inode); logical += run ){
+                int start = map_lookup(&inode, logical, file_blocks(&inode) - logical, &run, &stored);
+                if( stored ) printf(" %d+%d/%d", start, run, stored);
+                else         printf(" %d+%d", start, run);
+                if( !start ) nholes += run;
+                npacked += stored ? run : 0;
+                nstored += stored;
+            }
+            if( map_first_meta(&inode) ){
+                printf("\n    extent blocks:");
+                for( int meta_block = map_first_meta(&inode); meta_block > 0; meta_block = map_next_meta(&inode, meta_block) )
+                    printf(" %d", meta_block);
+            }
+        } else {
+            // every pointer in file order, a hole's being 0
+            printf("    direct data blocks:");
+            for( int logical = 0, run, stored; logical < file_blocks(&inode); logical++ ){
+                if( logical == DATA_POINTERS_PER_INODE ){
+                    printf("\n    indirect block: %d", inode.indirect);
+                    printf("\n    indirect data blocks:");
                 }
+                int block_num = map_lookup(&inode, logical, 1, &run, &stored);
+                printf(" %d", block_num);
+                if( !block_num ) nholes++;
+            }
+        }
+        printf("\n");
+        if( nholes ) printf("    holes: %d blocks\n", nholes);
+        if( inode.isvalid & INODE_COMPRESSED ) printf("    compressed: %d blocks stored in %d\n", npacked, nstored);
+    }
+    unlock_fs();
+}
+
+/*
+Layout report, one key=value per line so scripts can read it: per file its blocks and extents (runs of
+physically consecutive blocks in file order), with the logical blocks compressed chunks hold and the blocks
+they are stored in, totals across files, a histogram of free runs bucketed by
+powers of two (free_runs.4 counts runs of 4 to 7 blocks), and what reading every file front to back
+would cost in range requests now and after a full defrag, reads of the maps' own blocks included. Only files
+with data count towards the extent figures; holes, which read as zeros without any request, count in none
+of them. Needs the bitmaps, so only while mounted.
+*/
+int fs_fragstats(){
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return 0;
+    }
 
-                // Indirect pointer blocks
-                if (indirect_blocks)
-                {
-                    // Read the indirect block and create new indirect block
-                    union fs_block defrag_indirect_block;
-                    disk_read(block_buffer.inodes[inode_offset].indirect, defrag_indirect_block.data);
-
-                    // Direct pointers inside indirect block
-                    for (int k = 0; k < indirect_blocks; k++) {
-                        int block_num = defrag_indirect_block.pointers[k];
-                        move_block(block_num, defrag_data_index, defrag_data);
-
-                        // Update the inode direct pointers and defrag data index
-                        defrag_indirect_block.pointers[k] = defrag_data_index + INODE_TABLE_START_BLOCK + ninodeblocks;
-                        defrag_data_index++;
-                    }
-
-                    // Move the indirect block itself into defrag data
-                    memcpy(defrag_data + defrag_data_index, defrag_indirect_block.data, sizeof(union fs_block));
-                    defrag_block->inodes[defrag_inode_offset].indirect = defrag_data_index + INODE_TABLE_START_BLOCK + ninodeblocks;
-                    defrag_data_index++;
+    int nfiles = 0, ncontiguous = 0, nblocks_used = 0, nextents = 0, nindirect = 0, nholes = 0, npacked = 0, nstored = 0;
+    struct inode_table_walk table_walk;
+    struct inode_data_walk data_walk;
+    struct fs_inode inode;
+    for( int inumber = walk_inode_table(&table_walk, 1, &inode); inumber > 0; inumber = walk_inode_table(&table_walk, -1, &inode) ){
+        if( !inode.isvalid ) continue;
+        int blocks = 0, extents = 0, prev = -1;
+        for( int block_num = walk_inode_data(&data_walk, 0, &inode, NULL); block_num > 0; block_num = walk_inode_data(&data_walk, 0, NULL, NULL) ){
+            if( block_num != prev + 1 ) extents++;
+            prev = block_num;
+            blocks++;
+        }
+        int holes = 0, packed = 0, stored_in = 0;
+        for( int logical = 0, run, stored; logical < file_blocks(&inode); logical += run ){
+            if( !map_lookup(&inode, logical, file_blocks(&inode) - logical, &run, &stored) ) holes += run;
+            packed += stored ? run : 0;
+            stored_in += stored;
+        }
+        nholes += holes;
+        npacked += packed;
+        nstored += stored_in;
+        if( !blocks ) continue;
+        printf("inode.%d.blocks=%d\n", inumber, blocks);
+        printf("inode.%d.extents=%d\n", inumber, extents);
+        if( holes ) printf("inode.%d.holes=%d\n", inumber, holes);
+        if( packed ){
+            printf("inode.%d.compressed_blocks=%d\n", inumber, packed);
+            printf("inode.%d.compressed_stored=%d\n", inumber, stored_in);
+        }
+        nfiles++;
+        ncontiguous += extents == 1;
+        nblocks_used += blocks;
+        nextents += extents;
+        for( int meta_block = map_first_meta(&inode); meta_block > 0; meta_block = map_next_meta(&inode, meta_block) ) nindirect++;
+    }
+    printf("files=%d\n", nfiles);
+    printf("data_blocks=%d\n", nblocks_used);
+    printf("hole_blocks=%d\n", nholes);
+    printf("compressed_blocks=%d\n", npacked);
+    printf("compressed_stored=%d\n", nstored);
+    printf("extents=%d\n", nextents);
+    printf("avg_extent_blocks=%.2f\n", nextents ? (double)nblocks_used / nextents : 0.0);
+    printf("contiguous_files=%d\n", ncontiguous);
+    printf("contiguous_fraction=%.3f\n", nfiles ? (double)ncontiguous / nfiles : 1.0);
+
+    // free space, a run at a time
+    int histogram[32] = {0};
+    int nfree = 0, nruns = 0, largest = 0;
+    int nblocks = superblock.nblocks;
+    for( int start = bitmap_find_set(disk_block_bitmap, data_start_block(), nblocks); start >= 0; ){
+        int stop = bitmap_find_clear(disk_block_bitmap, start, nblocks);
+        if( stop < 0 ) stop = nblocks;
+        int length = stop - start;
+        histogram[31 - __builtin_clz(length)]++;
+        nfree += length;
+        nruns++;
+        if( length > largest ) largest = length;
+        start = bitmap_find_set(disk_block_bitmap, stop, nblocks);
+    }
+    printf("free_blocks=%d\n", nfree);
+    printf("free_runs=%d\n", nruns);
+    printf("largest_free_run=%d\n", largest);
+    // queued deletes' blocks are not free yet, and not in any file either
+    if( reclaim_count ) printf("reclaim_pending_inodes=%d\n", reclaim_count);
+    for( int b = 0; b < 32; b++ )
+        if( histogram[b] ) printf("free_runs.%d=%d\n", 1 << b, histogram[b]);
+
+    printf("read_requests=%d\n", nextents + nindirect);
+    printf("read_requests_defragged=%d\n", nfiles + nindirect);
+    printf("read_requests_saved=%d\n", nextents - nfiles);
+    unlock_fs();
+    return 1;
+}
+
+int fs_mount(){
+    STATS_OP(STATS_MOUNT);
+    lock_fs(true);
+    union fs_block buffer_block;
+    if( !is_mounted ){
+        STATS_BLOCKS(STATS_SUPERBLOCK, 0, 1);
+        cache_read(0, buffer_block.data);
+    }
+    if( is_mounted || buffer_block.super.magic != FS_MAGIC || !geometry_matches(&buffer_block.super) ||
+        (buffer_block.super.version != FS_VERSION_POINTERS && buffer_block.super.version != FS_VERSION_EXTENTS) ){
+        unlock_fs();
+        return 0;
+    }
+    superblock = buffer_block.super;
+
+    inode_table_bitmap = bitmap_create(superblock.ninodes);
+    disk_block_bitmap = bitmap_create(superblock.nblocks);
+    memset(reservations, 0, sizeof(reservations));
+    inode_cache_clear();
+    chunk_forget_all();
+
+    // the journal replays its last transaction first, after which the bitmaps on disk are as good as after
+    // a clean unmount, unless the crash came while metadata was being written in place unlogged
+    bool journal = superblock.journalstart > 0;
+    if( journal ) journal_open(superblock.journalstart, superblock.njournalblocks);
+    free(committed_bitmaps);
+    committed_bitmaps = NULL;
+    bool trusted = superblock.bitmapstart && (superblock.clean || (journal && superblock.journaled));
+    if( trusted ){
+        // clean unmount: the bitmaps on disk are exactly what a scan would rebuild
+        bitmap_load(inode_table_bitmap, superblock.bitmapstart);
+        bitmap_load(disk_block_bitmap, superblock.bitmapstart + bitmap_blocks(superblock.ninodes));
+        if( journal ) committed_bitmaps = bitmap_image();
+    } else {
+        // initialize data_region_bitmap: mark superblock and inode table (and bitmap) blocks as allocated, rest as free
+        bitmap_set_range(disk_block_bitmap, data_start_block(), superblock.nblocks, 1);
+        scan_inode_table();
+    }
+
+    // until fs_unmount writes them back, the on-disk bitmaps go stale
+    if( superblock.bitmapstart ){
+        superblock.clean = 0;
+        write_superblock();
+    }
+
+    is_mounted = true;
+    // a rescan's bitmaps are logged whole before the journal is trusted with them again
+    if( journal && !trusted ){
+        commit_transaction();
+        mark_journaled(true);
+    }
+    unlock_fs();
+    return 1;
+}
+
+void *scan_inode_blocks(void *arg){
+    struct mount_scan *scan = arg;
+    union fs_block *blocks = malloc(MOUNT_SCAN_CHUNK * sizeof(union fs_block));
+    if( !blocks ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+
+    // the inode cache is empty while mounting, so the table itself is current
+    struct inode_data_walk data_walk;
+    for( int chunk = scan->first; chunk < scan->last; chunk += MOUNT_SCAN_CHUNK ){
+        int count = min(MOUNT_SCAN_CHUNK, scan->last - chunk);
+        STATS_BLOCKS(STATS_INODE_TABLE, 0, count);
+        cache_read_range_async(INODE_TABLE_START_BLOCK + chunk, count, blocks->data);
+        cache_wait();
+        for( int b = 0; b < count; b++ ){
+            for( int i = 0; i < INODES_PER_BLOCK; i++ ){
+                int inumber = (chunk + b) * INODES_PER_BLOCK + i;
+                const struct fs_inode *inode = &blocks[b].inodes[i];
+                if( inumber == 0 ) continue; // inode 0 is not available for use
+                bitmap_set(inode_table_bitmap, inumber, !inode->isvalid);
+                if( !inode->isvalid ) continue;
+                for( int data_block_num = walk_inode_data(&data_walk, 0, inode, NULL); data_block_num > 0; data_block_num = walk_inode_data(&data_walk, 0, NULL, NULL) ){
+                    bitmap_set(scan->used, data_block_num, 1);
+                }
+                for( int meta_block = map_first_meta(inode); meta_block > 0; meta_block = map_next_meta(inode, meta_block) ){
+                    bitmap_set(scan->used, meta_block, 1);
                 }
             }
         }
     }
+    free(blocks);
+    return NULL;
+}
+
+/*
+Rebuild both bitmaps from the inode table, for images without on-disk bitmaps or not cleanly unmounted.
+The table is split into ranges of blocks, each scanned by a worker thread (the last one by the caller)
+into a bitmap of the blocks its files use; those are OR-ed together a word at a time and cleared from
+disk_block_bitmap, which must already have the data region free.
+*/
+void scan_inode_table(){
+    // blocks past those a lazy format zeroed hold no inodes
+    int ntable = table_initialized();
+    int nworkers = min(MOUNT_SCAN_THREADS, ntable / MOUNT_SCAN_MIN_BLOCKS);
+    if( nworkers < 1 ) nworkers = 1;
+    struct mount_scan scans[MOUNT_SCAN_THREADS];
+    for( int w = 0; w < nworkers; w++ ){
+        scans[w].first = (long long)ntable * w / nworkers;
+        scans[w].last = (long long)ntable * (w + 1) / nworkers;
+        scans[w].used = bitmap_create(superblock.nblocks);
+    }
 
-    /* Modify the inode bitmap */
-    for (int i = 1; i < defrag_inumber; i++) {
-        bitmap_set(inode_table_bitmap, i, 0);
+    bitmap_set_range(inode_table_bitmap, ntable * INODES_PER_BLOCK, superblock.ninodes, 1);
+    bitmap_set(inode_table_bitmap, 0, 0);
+    int started = 0;
+    while( started < nworkers - 1 && !pthread_create(&scans[started].thread, NULL, scan_inode_blocks, &scans[started]) ) started++;
+    // whatever could not get a thread of its own is scanned here
+    for( int w = started; w < nworkers; w++ ) scan_inode_blocks(&scans[w]);
+    for( int w = 0; w < started; w++ ) pthread_join(scans[w].thread, NULL);
+
+    for( int w = 1; w < nworkers; w++ ){
+        bitmap_or(scans[0].used, scans[w].used);
+        bitmap_delete(scans[w].used);
     }
-    for (int i = defrag_inumber; i < ninodes; i++) {
-        bitmap_set(inode_table_bitmap, i, 1);
+    bitmap_clear_bits(disk_block_bitmap, scans[0].used);
+    bitmap_delete(scans[0].used);
+}
+
+int fs_unmount(){
+    STATS_OP(STATS_UNMOUNT);
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return 0;
     }
 
-    /* Write inode table to the disk */
-    for (int i = 0; i < ninodeblocks; i++) {
-        disk_write(i+INODE_TABLE_START_BLOCK , (defrag_inode_table + i)->data);
+    // push every dirty block to disk so the image is complete without us
+    reclaim_blocks(0);
+    release_all_reservations();
+    forget_streams();
+    chunk_forget_all();
+    commit_transaction();
+    journal_close();
+    inode_sync();
+    inode_cache_clear();
+    if( superblock.bitmapstart ){
+        bitmap_store(inode_table_bitmap, superblock.bitmapstart);
+        bitmap_store(disk_block_bitmap, superblock.bitmapstart + bitmap_blocks(superblock.ninodes));
+    }
+    cache_flush();
+    if( superblock.bitmapstart ){
+        // only once everything else is on disk may the bitmaps be trusted
+        superblock.clean = 1;
+        write_superblock();
     }
 
-    /* Modify the data bitmap */
-    for (int i = 0; i < defrag_data_index + INODE_TABLE_START_BLOCK + ninodeblocks; i++) {
-        bitmap_set(disk_block_bitmap, i, 0);
+    bitmap_delete(inode_table_bitmap);
+    bitmap_delete(disk_block_bitmap);
+    inode_table_bitmap = NULL;
+    disk_block_bitmap = NULL;
+    is_mounted = false;
+    unlock_fs();
+    return 1;
+}
+
+// make everything written so far durable without unmounting: inodes to their table blocks, then every dirty
+// block; with a journal, the running transaction is committed first
+int fs_sync(){
+    STATS_OP(STATS_SYNC);
+    lock_fs(true);
+    bool mounted = is_mounted;
+    if( mounted ){
+        commit_transaction();
+        inode_sync();
+        cache_flush();
     }
-    for (int i = defrag_data_index + INODE_TABLE_START_BLOCK + ninodeblocks; i < nblocks - ninodeblocks - 1; i++) {
-        bitmap_set(disk_block_bitmap, i, 1);
+    unlock_fs();
+    return mounted;
+}
+
+/*
+Journal: metadata writes (inode table and map blocks) collect in the running transaction, and entry points
+that changed something commit it once it fills half the log, so any number of small calls share one flush.
+A commit holds the file system exclusive, so no call is half in it. The bitmaps only ever change in memory
+until then: each commit adds those of their blocks that changed since the last one to the transaction.
+*/
+
+// the bitmap blocks as they should be on disk. What is only claimed in memory goes down free: reserved
+// ahead of a file, queued for reclaim, or awaiting a commit
+char *bitmap_image(){
+    int ninodemap = bitmap_blocks(superblock.ninodes);
+    char *image = calloc(superblock.nbitmapblocks, DISK_BLOCK_SIZE);
+    if( !image ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    memcpy(image, inode_table_bitmap->words, (superblock.ninodes + 7) / 8);
+    memcpy(image + ninodemap * DISK_BLOCK_SIZE, disk_block_bitmap->words, (superblock.nblocks + 7) / 8);
+    struct bitmap on_disk = { .words = (uint64_t *)(image + ninodemap * DISK_BLOCK_SIZE), .n_bits = superblock.nblocks };
+    bitmap_t blocks = &on_disk;
+
+    pthread_mutex_lock(&reservation_lock);
+    for( int i = 0; i < RESERVATION_SLOTS; i++ )
+        if( reservations[i].inumber ) bitmap_set_range(blocks, reservations[i].next, reservations[i].end, 1);
+    pthread_mutex_unlock(&reservation_lock);
+
+    pthread_mutex_lock(&reclaim_lock);
+    for( int i = 0; i < freed_blocks_count; i++ ) bitmap_set(blocks, freed_blocks[i], 1);
+    struct inode_data_walk data_walk;
+    for( int q = 0; q < reclaim_count; q++ ){
+        const struct fs_inode *dead = &reclaim_queue[q];
+        for( int b = walk_inode_data(&data_walk, 0, dead, NULL); b > 0; b = walk_inode_data(&data_walk, 0, NULL, NULL) )
+            bitmap_set(blocks, b, 1);
+        for( int meta_block = map_first_meta(dead); meta_block > 0; meta_block = map_next_meta(dead, meta_block) )
+            bitmap_set(blocks, meta_block, 1);
     }
+    pthread_mutex_unlock(&reclaim_lock);
+    return image;
+}
+
+// write the bitmap blocks that changed since the last commit, to the journal or in place as write_meta sends them
+void store_bitmaps(){
+    char *image = bitmap_image();
+    for( int b = 0; b < superblock.nbitmapblocks; b++ ){
+        const char *block = image + (size_t)b * DISK_BLOCK_SIZE;
+        if( committed_bitmaps && !memcmp(committed_bitmaps + (size_t)b * DISK_BLOCK_SIZE, block, DISK_BLOCK_SIZE) ) continue;
+        STATS_BLOCKS(STATS_BITMAP, 1, 1);
+        write_meta(superblock.bitmapstart + b, block);
+    }
+    free(committed_bitmaps);
+    committed_bitmaps = image;
+}
 
-    /* Write data table to the disk */
-    for (int i = 0; i < nblocks - ninodeblocks - 1; i++) {
-        disk_write(i + INODE_TABLE_START_BLOCK + ninodeblocks, (defrag_data + i)->data);
+// the superblock's word on whether the journal covers what is on disk, made durable at once
+void mark_journaled(bool journaled){
+    superblock.journaled = journaled;
+    write_superblock();
+    disk_sync();
+}
+
+// commit the running transaction, with the file system held exclusive. One too big for the log is written
+// in place instead, the superblock saying meanwhile that a crash needs a rescan. Either way, the blocks
+// release_block held back can be reused once it is down
+void commit_transaction(){
+    if( !journal_logging() ) return;
+    inode_sync();
+    store_bitmaps();
+    if( !journal_commit() ){
+        mark_journaled(false);
+        journal_suspend();
+        cache_flush();
+        disk_sync();
+        mark_journaled(true);
+        journal_resume();
     }
 
-    /* Free allocated structures */
-    free(defrag_inode_table);
-    free(defrag_data);
+    pthread_mutex_lock(&reclaim_lock);
+    for( int i = 0; i < freed_blocks_count; i++ ) bitmap_set(disk_block_bitmap, freed_blocks[i], 1);
+    freed_blocks_count = 0;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+// group commit: called by entry points that changed metadata, once they have let go of the file system
+void commit_if_due(){
+    if( !journal_logging() || 2 * journal_pending() < journal_capacity() ) return;
+    lock_fs(true);
+    if( is_mounted ) commit_transaction();
+    unlock_fs();
+}
+
+// for work that rewrites metadata wholesale, like fs_defrag: commit, then write in place unlogged until
+// unlogged_end, a crash meanwhile meaning a rescan
+void unlogged_begin(){
+    if( !journal_logging() ) return;
+    commit_transaction();
+    mark_journaled(false);
+    journal_suspend();
+}
+
+void unlogged_end(){
+    if( !superblock.journalstart || journal_logging() ) return;
+    inode_sync();
+    store_bitmaps();
+    cache_flush();
+    disk_sync();
+    mark_journaled(true);
+    journal_resume();
+}
 
+int fs_create(){
+    STATS_OP(STATS_CREATE);
+    lock_fs(false);
+    // Use bitmap to identify a free inode in the inode table block, claiming it before another thread does
+    int inumber = 0;
+    while (is_mounted) {
+        inumber = bitmap_first_set(inode_table_bitmap); // lowest free inumber; inode 0 is never marked free
+        if (inumber <= 0 || bitmap_set(inode_table_bitmap, inumber, 0)) break;
+    }
+    if (inumber <= 0) {
+        // No free inodes; return zero
+        unlock_fs();
+        return 0;
+    }
+    init_table_block(inumber / INODES_PER_BLOCK);
+    // Initialize the inode struct; zero the pointers so stale contents never reach the disk
+    struct fs_inode new_inode = {0};
+    new_inode.isvalid = superblock.compress ? 1 | INODE_COMPRESSED : 1;
+    new_inode.size = 0;
+
+    // The cached inode takes it; the table block is written when the cache syncs
+    lock_inode(inumber, true);
+    struct cached_inode *cached = inode_get(inumber);
+    cached->view.inode = new_inode;
+    inode_put(cached, true);
+    unlock_inode(inumber);
+
+    unlock_fs();
+    commit_if_due();
+    return inumber;
+}
+
+int fs_delete( int inumber ){
+    STATS_OP(STATS_DELETE);
+    lock_fs(false);
+    // Validate valid inumber
+    if (!is_mounted || (inumber < 1) || (inumber >= superblock.ninodes)){
+        unlock_fs();
+        return 0; // Invalid inumber
+    }
+
+    // Take the inode, update the isvalid bit; the cache writes it back
+    lock_inode(inumber, true);
+    struct cached_inode *cached = inode_get(inumber);
+    if (cached->view.inode.isvalid == 0) {
+        // Return 0 -- attempting to delete an inode that's not yet created
+        inode_put(cached, false);
+        unlock_inode(inumber);
+        unlock_fs();
+        return 0;
+    }
+    struct fs_inode dead = cached->view.inode;
+    cached->view.inode.isvalid = 0;
+    map_forget(cached);
+    inode_put(cached, true);
+    free_inode_blocks(inumber, &dead);
+
+    unlock_inode(inumber);
+    unlock_fs();
+    commit_if_due();
     return 1;
 }
+
+// everything a deleted inode held: its data blocks, the blocks of its map, its reservation and the inode
+// itself. With deferred deletes the blocks are only queued, so this takes the same time for any file
+void free_inode_blocks(int inumber, const struct fs_inode *dead){
+    if( deferred_delete ) reclaim_later(dead);
+    else                  free_map_blocks(dead);
+
+    // Return any blocks still set aside for the file, then the inode itself
+    release_file_reservation(inumber);
+    forget_stream(inumber);
+    chunk_forget(inumber);
+    bitmap_set(inode_table_bitmap, inumber, 1);
+}
+
+// free the data blocks a dead inode maps and the blocks of the map itself; returns how many
+int free_map_blocks(const struct fs_inode *dead){
+    int freed = 0;
+    // Walk the data blocks, free them, and update the bitmap
+    struct inode_data_walk data_walk;
+    for ( int i = walk_inode_data(&data_walk, 0, dead, NULL); i > 0; i = walk_inode_data(&data_walk, 0, NULL, NULL) ) {
+        bitmap_set(disk_block_bitmap, i, 1);
+        freed++;
+    }
+    // and the blocks holding the map itself
+    for ( int meta_block = map_first_meta(dead); meta_block > 0; meta_block = map_next_meta(dead, meta_block) ) {
+        release_block(meta_block);
+        freed++;
+    }
+    return freed;
+}
+
+// free a block the metadata on disk may still point at: with the journal logging, only once the change is
+// committed, as a data block reusing it would be overwritten in place. A deleted file's data blocks need no
+// such wait, since a crash then at worst leaves the undeleted file with new contents; its map blocks do
+void release_block(int block_num){
+    if( !journal_logging() ){
+        bitmap_set(disk_block_bitmap, block_num, 1);
+        return;
+    }
+    pthread_mutex_lock(&reclaim_lock);
+    if( freed_blocks_count == freed_blocks_capacity ){
+        freed_blocks_capacity = freed_blocks_capacity ? 2 * freed_blocks_capacity : 64;
+        freed_blocks = realloc(freed_blocks, freed_blocks_capacity * sizeof(*freed_blocks));
+        if( !freed_blocks ){
+            printf("ERROR Failed to allocate memory. Exiting...\n");
+            abort();
+        }
+    }
+    freed_blocks[freed_blocks_count++] = block_num;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+// queue a dead inode's blocks for reclaim_blocks; the copy keeps its map readable after the inode is reused
+void reclaim_later(const struct fs_inode *dead){
+    pthread_mutex_lock(&reclaim_lock);
+    if( reclaim_count == reclaim_capacity ){
+        reclaim_capacity = reclaim_capacity ? 2 * reclaim_capacity : 16;
+        reclaim_queue = realloc(reclaim_queue, reclaim_capacity * sizeof(*reclaim_queue));
+        if( !reclaim_queue ){
+            printf("ERROR Failed to allocate memory. Exiting...\n");
+            abort();
+        }
+    }
+    reclaim_queue[reclaim_count++] = *dead;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+// free queued inodes' blocks until at least budget blocks are free again, or all of them if budget <= 0;
+// returns how many. The queue is taken an inode at a time, so other threads can queue and reclaim meanwhile
+int reclaim_blocks(int budget){
+    int freed = 0;
+    while( budget <= 0 || freed < budget ){
+        pthread_mutex_lock(&reclaim_lock);
+        bool empty = reclaim_count == 0;
+        struct fs_inode dead;
+        if( !empty ) dead = reclaim_queue[--reclaim_count];
+        pthread_mutex_unlock(&reclaim_lock);
+        if( empty ) break;
+        freed += free_map_blocks(&dead);
+    }
+    return freed;
+}
+
+void fs_set_deferred_delete( int enabled ){
+    lock_fs(true);
+    deferred_delete = enabled;
+    unlock_fs();
+}
+
+int fs_reclaim( int budget ){
+    STATS_OP(STATS_RECLAIM);
+    lock_fs(false);
+    int freed = is_mounted ? reclaim_blocks(budget) : -1;
+    unlock_fs();
+    commit_if_due();
+    return freed;
+}
+
+int fs_getsize( int inumber ){
+    STATS_OP(STATS_GETSIZE);
+    lock_fs(false);
+    // use cached superblock to see if inumber is valid
+    if (!is_mounted || inumber <= 0 || inumber >= superblock.ninodes){
+        unlock_fs();
+        return -1; // Not 0, because 0 can still be a valid inode size
+    }
+
+    lock_inode(inumber, false);
+    struct cached_inode *cached = inode_get(inumber);
+    int size = cached->view.inode.isvalid ? cached->view.inode.size : -1; // if inode is not valid, then return -1
+    inode_put(cached, false);
+    unlock_inode(inumber);
+
+    unlock_fs();
+    return size;
+}
+
+/*
+Batch calls work through their inodes a table block at a time, each block read once and, if anything
+changed, written once, however many of the batch's inodes it holds. They hold the file system exclusive,
+so the cached copies of the inodes concerned can be folded into the block and brought back in line with it.
+*/
+void table_block_load(int table_block, union fs_block *block){
+    STATS_BLOCKS(STATS_INODE_TABLE, 0, 1);
+    read_meta(INODE_TABLE_START_BLOCK + table_block, block->data);
+    pthread_mutex_lock(&inode_cache_lock);
+    for( int i = 0; i < INODE_CACHE_SLOTS; i++ )
+        if( inode_cache[i].inumber && inode_cache[i].inumber / INODES_PER_BLOCK == table_block )
+            block->inodes[inode_cache[i].inumber % INODES_PER_BLOCK] = inode_cache[i].view.inode;
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+void table_block_store(int table_block, const union fs_block *block){
+    STATS_BLOCKS(STATS_INODE_TABLE, 1, 1);
+    write_meta(INODE_TABLE_START_BLOCK + table_block, block->data);
+    pthread_mutex_lock(&inode_cache_lock);
+    for( int i = 0; i < INODE_CACHE_SLOTS; i++ ){
+        struct cached_inode *cached = &inode_cache[i];
+        if( !cached->inumber || cached->inumber / INODES_PER_BLOCK != table_block ) continue;
+        const struct fs_inode *stored = &block->inodes[cached->inumber % INODES_PER_BLOCK];
+        if( memcmp(&cached->view.inode, stored, sizeof(*stored)) ) map_forget(cached);
+        cached->view.inode = *stored;
+        cached->dirty = false;
+    }
+    pthread_mutex_unlock(&inode_cache_lock);
+}
+
+int compare_batch_entries(const void *a, const void *b){
+    const struct batch_entry *x = a, *y = b;
+    return (x->inumber > y->inumber) - (x->inumber < y->inumber);
+}
+
+// a batch's inumbers in table order, each remembering its place in the caller's list
+struct batch_entry *sort_batch(const int *inumbers, int count){
+    struct batch_entry *entries = malloc((count > 0 ? count : 1) * sizeof(*entries));
+    if( !entries ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    for( int i = 0; i < count; i++ ) entries[i] = (struct batch_entry){ .inumber = inumbers[i], .index = i };
+    qsort(entries, count, sizeof(*entries), compare_batch_entries);
+    return entries;
+}
+
+// create up to count inodes, putting their numbers in inumbers; returns how many were created
+int fs_create_batch( int count, int *inumbers ){
+    STATS_OP(STATS_CREATE_BATCH);
+    lock_fs(true);
+    int created = 0;
+    if( is_mounted ){
+        // the lowest free inodes, which first-fit hands out in table order
+        while( created < count ){
+            int inumber = bitmap_first_set(inode_table_bitmap);
+            if( inumber <= 0 ) break;
+            bitmap_set(inode_table_bitmap, inumber, 0);
+            inumbers[created++] = inumber;
+        }
+        if( created ) init_table_block(inumbers[created - 1] / INODES_PER_BLOCK);
+
+        union fs_block block;
+        for( int i = 0; i < created; ){
+            int table_block = inumbers[i] / INODES_PER_BLOCK;
+            table_block_load(table_block, &block);
+            for( ; i < created && inumbers[i] / INODES_PER_BLOCK == table_block; i++ )
+                block.inodes[inumbers[i] % INODES_PER_BLOCK] = (struct fs_inode){ .isvalid = superblock.compress ? 1 | INODE_COMPRESSED : 1 };
+            table_block_store(table_block, &block);
+        }
+    }
+    unlock_fs();
+    commit_if_due();
+    return created;
+}
+
+// delete every valid inode in the list; returns how many were deleted
+int fs_delete_batch( const int *inumbers, int count ){
+    STATS_OP(STATS_DELETE_BATCH);
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return 0;
+    }
+    struct batch_entry *entries = sort_batch(inumbers, count);
+    int deleted = 0;
+    union fs_block block;
+    for( int i = 0; i < count; ){
+        int inumber = entries[i].inumber;
+        if( inumber < 1 || inumber >= superblock.ninodes ){
+            i++;
+            continue;
+        }
+        int table_block = inumber / INODES_PER_BLOCK;
+        table_block_load(table_block, &block);
+        bool changed = false;
+        for( ; i < count && entries[i].inumber / INODES_PER_BLOCK == table_block; i++ ){
+            inumber = entries[i].inumber;
+            struct fs_inode *inode = &block.inodes[inumber % INODES_PER_BLOCK];
+            if( !inode->isvalid ) continue; // a repeat finds it deleted already
+            struct fs_inode dead = *inode;
+            inode->isvalid = 0;
+            free_inode_blocks(inumber, &dead);
+            changed = true;
+            deleted++;
+        }
+        if( changed ) table_block_store(table_block, &block);
+    }
+    free(entries);
+    unlock_fs();
+    commit_if_due();
+    return deleted;
+}
+
+// sizes[i] becomes the size of inumbers[i], or -1 if it is not a valid inode; returns how many were valid
+int fs_getsize_batch( const int *inumbers, int count, int *sizes ){
+    STATS_OP(STATS_GETSIZE_BATCH);
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return -1;
+    }
+    struct batch_entry *entries = sort_batch(inumbers, count);
+    int valid = 0;
+    union fs_block block;
+    int loaded = -1;
+    for( int i = 0; i < count; i++ ){
+        int inumber = entries[i].inumber;
+        sizes[entries[i].index] = -1;
+        if( inumber < 1 || inumber >= superblock.ninodes ) continue;
+        if( inumber / INODES_PER_BLOCK != loaded ){
+            loaded = inumber / INODES_PER_BLOCK;
+            table_block_load(loaded, &block);
+        }
+        const struct fs_inode *inode = &block.inodes[inumber % INODES_PER_BLOCK];
+        if( !inode->isvalid ) continue;
+        sizes[entries[i].index] = inode->size;
+        valid++;
+    }
+    free(entries);
+    unlock_fs();
+    return valid;
+}
+
+int fs_read( int inumber, char *data, int length, int offset ) {
+    STATS_OP(STATS_READ);
+    union fs_block buffer_block;
+    int bytes_read = 0;
+
+    // check validity of inumber against cached superblock
+    lock_fs(false);
+    if ( !is_mounted || inumber <= 0 || inumber >= superblock.ninodes ){
+        unlock_fs();
+        return 0;
+    }
+
+    // hold the cached inode for its decoded map, and verify validity; readers of one file share its lock
+    lock_inode(inumber, false);
+    struct cached_inode *cached = inode_get(inumber);
+    const struct fs_inode *inode = &cached->view.inode;
+    if ( !inode->isvalid || offset < 0 || offset > inode->size ){
+        inode_put(cached, false);
+        unlock_inode(inumber);
+        unlock_fs();
+        return 0;
+    }
+
+    // read data a block at a time unless and until end, looking the map up once per contiguous stretch
+    int distance = min(length, inode->size - offset);
+    int last = (offset + distance - 1) / DISK_BLOCK_SIZE;
+    int mapped = 0, next_block = 0, stored = 0;
+    struct block_run run = {0};
+    while ( bytes_read < distance ) {
+        int logical = (offset + bytes_read) / DISK_BLOCK_SIZE;
+        int within  = (offset + bytes_read) % DISK_BLOCK_SIZE;
+        int chunk   = min(DISK_BLOCK_SIZE - within, distance - bytes_read);
+
+        if ( !mapped ) next_block = map_lookup_cached(cached, logical, last - logical + 1, &mapped, &stored);
+        int block_num = next_block;
+        if ( next_block && !stored ) next_block++;
+        mapped--;
+
+        // a hole reads as zeros without any I/O, and leaves a gap no run can bridge
+        if ( !block_num ) {
+            memset(data + bytes_read, 0, chunk);
+            bytes_read += chunk;
+            continue;
+        }
+
+        // what is wanted of a compressed chunk is copied out of its decoded copy at once
+        if ( stored ) {
+            const struct map_run *packed = map_find_run(cached, logical);
+            int from = (logical - packed->logical) * DISK_BLOCK_SIZE + within;
+            chunk = min(packed->length * DISK_BLOCK_SIZE - from, distance - bytes_read);
+            if ( !chunk_read(inumber, packed, from, chunk, data + bytes_read) ) {
+                printf("[ERROR] inode %d: compressed chunk at block %d is damaged, reading it as zeros\n", inumber, packed->start);
+                memset(data + bytes_read, 0, chunk);
+            }
+            bytes_read += chunk;
+            mapped = 0;
+            continue;
+        }
+        STATS_BLOCKS(STATS_DATA, 0, 1);
+
+        // whole blocks land straight in the caller's buffer, contiguous ones in a single request, with
+        // every run in flight at once; partial head/tail blocks take one memcpy
+        if ( chunk == DISK_BLOCK_SIZE ) {
+            if ( !run_extend(&run, block_num, bytes_read) ) {
+                if ( run.count ) cache_read_range_async(run.start, run.count, data + run.offset);
+                run = (struct block_run){ .start = block_num, .count = 1, .offset = bytes_read };
+            }
+        } else {
+            cache_read(block_num, buffer_block.data);
+            memcpy(data + bytes_read, buffer_block.data + within, chunk);
+        }
+        bytes_read += chunk;
+    }
+    if ( run.count ) cache_read_range_async(run.start, run.count, data + run.offset);
+    cache_wait();
+
+    readahead(inumber, cached, offset, bytes_read);
+    inode_put(cached, false);
+    unlock_inode(inumber);
+    unlock_fs();
+    return bytes_read;
+}
+
+struct readahead_stream *find_stream(int inumber){
+    for( int i = 0; i < READAHEAD_STREAMS; i++ )
+        if( streams[i].inumber == inumber ) return &streams[i];
+    return NULL;
+}
+
+void forget_stream(int inumber){
+    pthread_mutex_lock(&stream_lock);
+    struct readahead_stream *st = find_stream(inumber);
+    if( st ) st->inumber = 0;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// block numbers change under defrag and vanish with fs_delete, so streams must not outlive them
+void forget_streams(){
+    pthread_mutex_lock(&stream_lock);
+    memset(streams, 0, sizeof(streams));
+    pthread_mutex_unlock(&stream_lock);
+}
+
+// after a read of [offset, offset+length): if it carried on from the previous one, keep the next
+// window of blocks (and the indirect block they are listed in) on their way into the cache
+void readahead(int inumber, struct cached_inode *cached, int offset, int length){
+    const struct fs_inode *inode = &cached->view.inode;
+    pthread_mutex_lock(&stream_lock);
+    struct readahead_stream *st = find_stream(inumber);
+    if( !st ){
+        st = &streams[stream_victim];
+        stream_victim = (stream_victim + 1) % READAHEAD_STREAMS;
+        *st = (struct readahead_stream){ .inumber = inumber, .next_offset = -1 };
+    }
+
+    // a read from the start of a file is taken as the start of a stream
+    if( offset == st->next_offset ){
+        st->window = st->window ? min(2 * st->window, READAHEAD_MAX_BLOCKS) : READAHEAD_MIN_BLOCKS;
+    } else if( offset == 0 ){
+        st->window = READAHEAD_MIN_BLOCKS;
+        st->ahead = 0;
+    } else {
+        st->window = st->ahead = 0;
+    }
+    st->next_offset = offset + length;
+    int next = st->next_offset / DISK_BLOCK_SIZE;
+    int from = st->ahead > next ? st->ahead : next;
+    int to = min(next + st->window, file_blocks(inode));
+    if( !st->window || from >= to ){
+        pthread_mutex_unlock(&stream_lock);
+        return;
+    }
+
+    // the map's first block (the indirect block, or the head of the extent chain) is what every lookup reads.
+    // A compressed chunk is read whole, and the window's ends may each cut one
+    int blocks[READAHEAD_MAX_BLOCKS + 1 + 2 * COMPRESS_CHUNK_BLOCKS];
+    int n = 0;
+    int meta_block = map_first_meta(inode);
+    if( meta_block > 0 ) blocks[n++] = meta_block;
+    for( int logical = from, run, stored; logical < to; logical += run ){
+        int block_num = map_lookup_cached(cached, logical, to - logical, &run, &stored);
+        int count = stored ? stored : run;
+        for( int r = 0; block_num && r < count && n < (int)(sizeof(blocks) / sizeof(*blocks)); r++ ) blocks[n++] = block_num + r;
+    }
+    cache_prefetch(blocks, n);
+    st->ahead = to;
+    pthread_mutex_unlock(&stream_lock);
+}
+
+/*
+Compressed files. A chunk is COMPRESS_CHUNK_BLOCKS logical blocks from a multiple of that, the last one
+stopping at the end of the file, and is stored as an extent of its own: an int giving the length of the
+codec's output, then the output, in as few consecutive blocks as hold them. A chunk that would not save a
+block that way is stored plain instead, blocks of zeros left holes as in any file. Each chunk decodes on
+its own, so a random read costs at most one chunk's decoding, and none while the chunk's decoded copy is
+in chunk_cache.
+*/
+struct chunk_slot *find_chunk(int inumber, int logical){
+    for( int i = 0; i < CHUNK_CACHE_SLOTS; i++ )
+        if( chunk_cache[i].inumber == inumber && chunk_cache[i].logical == logical ) return &chunk_cache[i];
+    return NULL;
+}
+
+// keep a chunk's decoded contents, a whole chunk's worth from plain, or with plain null drop any copy of it
+void chunk_remember(int inumber, int logical, const char *plain){
+    pthread_mutex_lock(&chunk_lock);
+    struct chunk_slot *slot = find_chunk(inumber, logical);
+    if( plain ){
+        if( !slot ){
+            slot = &chunk_cache[chunk_victim];
+            chunk_victim = (chunk_victim + 1) % CHUNK_CACHE_SLOTS;
+        }
+        slot->inumber = inumber;
+        slot->logical = logical;
+        memcpy(slot->data, plain, sizeof(slot->data));
+    } else if( slot ){
+        slot->inumber = 0;
+    }
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+void chunk_forget(int inumber){
+    pthread_mutex_lock(&chunk_lock);
+    for( int i = 0; i < CHUNK_CACHE_SLOTS; i++ )
+        if( chunk_cache[i].inumber == inumber ) chunk_cache[i].inumber = 0;
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+void chunk_forget_all(){
+    pthread_mutex_lock(&chunk_lock);
+    for( int i = 0; i < CHUNK_CACHE_SLOTS; i++ ) chunk_cache[i].inumber = 0;
+    pthread_mutex_unlock(&chunk_lock);
+}
+
+// read a compressed chunk and decode it into plain, through packed, each a chunk's worth; false if it is damaged
+bool chunk_decode(const struct map_run *chunk, char *plain, char *packed){
+    if( chunk->length > COMPRESS_CHUNK_BLOCKS || chunk->stored > COMPRESS_CHUNK_BLOCKS ) return false;
+    STATS_BLOCKS(STATS_DATA, 0, chunk->stored);
+    cache_read_range(chunk->start, chunk->stored, packed);
+    int length;
+    memcpy(&length, packed, sizeof(length));
+    if( length <= 0 || length > chunk->stored * DISK_BLOCK_SIZE - (int)sizeof(length) ) return false;
+    int bytes = chunk->length * DISK_BLOCK_SIZE;
+    return decompress_block(packed + sizeof(length), length, plain, bytes) == bytes;
+}
+
+// length bytes from offset into a compressed chunk of inumber, copied out of its decoded copy, which is made
+// first if the cache has none; false if the chunk is damaged. Its file is held, so the copy stays current
+bool chunk_read(int inumber, const struct map_run *chunk, int offset, int length, char *data){
+    pthread_mutex_lock(&chunk_lock);
+    struct chunk_slot *slot = find_chunk(inumber, chunk->logical);
+    if( slot ) memcpy(data, slot->data + offset, length);
+    pthread_mutex_unlock(&chunk_lock);
+    if( slot ) return true;
+
+    size_t bytes = sizeof(chunk_cache[0].data);
+    char *plain = malloc(2 * bytes);
+    if( !plain ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    bool decoded = chunk_decode(chunk, plain, plain + bytes);
+    if( decoded ){
+        chunk_remember(inumber, chunk->logical, plain);
+        memcpy(data, plain + offset, length);
+    }
+    free(plain);
+    return decoded;
+}
+
+struct block_reservation *find_reservation(int inumber){
+    for( int i = 0; i < RESERVATION_SLOTS; i++ )
+        if( reservations[i].inumber == inumber ) return &reservations[i];
+    return NULL;
+}
+
+// hand the unused part of a reservation back to the bitmap; reservation_lock is held
+void release_reservation(struct block_reservation *res){
+    if( !res ) return;
+    if( res->next < res->end ) bitmap_set_range(disk_block_bitmap, res->next, res->end, 1);
+    res->inumber = 0;
+}
+
+void release_file_reservation(int inumber){
+    pthread_mutex_lock(&reservation_lock);
+    release_reservation(find_reservation(inumber));
+    pthread_mutex_unlock(&reservation_lock);
+}
+
+void release_all_reservations(){
+    pthread_mutex_lock(&reservation_lock);
+    for( int i = 0; i < RESERVATION_SLOTS; i++ )
+        if( reservations[i].inumber ) release_reservation(&reservations[i]);
+    pthread_mutex_unlock(&reservation_lock);
+}
+
+// claim up to want free blocks for inumber: ideally the ones right after goal, else the first run
+// long enough anywhere, else whatever does follow goal. Reservations live only in memory. Allocations
+// by other threads can take blocks of the chosen run while this looks, so it keeps what it claims first
+void reserve_blocks(int inumber, int goal, int want){
+    pthread_mutex_lock(&reservation_lock);
+    struct block_reservation *res = find_reservation(inumber);
+    if( !res || res->end - res->next < want ) reserve_locked(inumber, res, goal, want);
+    pthread_mutex_unlock(&reservation_lock);
+}
+
+void reserve_locked(int inumber, struct block_reservation *res, int goal, int want){
+    release_reservation(res);
+
+    if( !res ){
+        for( int i = 0; i < RESERVATION_SLOTS && !res; i++ )
+            if( !reservations[i].inumber ) res = &reservations[i];
+        if( !res ){
+            res = &reservations[reservation_victim];
+            reservation_victim = (reservation_victim + 1) % RESERVATION_SLOTS;
+            release_reservation(res);
+        }
+    }
+
+    int nblocks = superblock.nblocks;
+    if( goal < 0 || goal >= nblocks ) goal = __atomic_load_n(&disk_block_bitmap->cursor, __ATOMIC_RELAXED);
+    want = min(want, bitmap_count(disk_block_bitmap));
+    if( want <= 0 ) return;
+
+    int stop = bitmap_find_clear(disk_block_bitmap, goal, min(goal + want, nblocks));
+    int at_goal = (stop < 0 ? min(goal + want, nblocks) : stop) - goal;
+    int start = goal, length = at_goal;
+    if( at_goal < want ){
+        int found = bitmap_find_run(disk_block_bitmap, goal, nblocks, want);
+        if( found < 0 ) found = bitmap_find_run(disk_block_bitmap, 0, goal, want);
+        if( found >= 0 ){
+            start = found;
+            length = want;
+        }
+    }
+    int claimed = 0;
+    while( claimed < length && bitmap_set(disk_block_bitmap, start + claimed, 0) ) claimed++;
+    if( claimed > 0 ) *res = (struct block_reservation){ .inumber = inumber, .next = start, .end = start + claimed };
+}
+
+// allocate one block for inumber: from its reservation, else goal itself if free, else next-fit
+// inumber 0 allocates for no file in particular, bypassing the reservations
+bool alloc_block( int inumber, int goal, int *pointer ) {
+    if ( inumber > 0 ) {
+        pthread_mutex_lock(&reservation_lock);
+        struct block_reservation *res = find_reservation(inumber);
+        bool reserved = res && res->next < res->end;
+        if ( reserved ) *pointer = res->next++;
+        pthread_mutex_unlock(&reservation_lock);
+        if ( reserved ){
+            STATS_ALLOC(STATS_ALLOC_RESERVED, 0);
+            return true;
+        }
+    }
+
+    // a block found free may be claimed by another thread before us; then look again
+    for ( bool released = false; ; goal = -1 ) {
+        int k = -1;
+        if ( goal >= 0 && goal < superblock.nblocks && bitmap_test(disk_block_bitmap, goal) ) k = goal;
+        STATS_ONLY(bool scanned = k < 0; int scan_from = __atomic_load_n(&disk_block_bitmap->cursor, __ATOMIC_RELAXED);)
+        if ( k < 0 ) k = bitmap_next_set(disk_block_bitmap);
+        if ( k < 0 && !released ) {
+            // other files' reservations, or deleted files' blocks, may be all that is left
+            release_all_reservations();
+            reclaim_blocks(0);
+            released = true;
+            k = bitmap_next_set(disk_block_bitmap);
+        }
+
+        if ( k < 0 ){
+            STATS_ALLOC(STATS_ALLOC_FAILED, 0);
+            return false; // out of space cuh
+        }
+
+        if ( bitmap_set(disk_block_bitmap, k, 0) ) {
+            // the scan length is how far next-fit ran past its cursor, wrapping included
+            STATS_ALLOC(scanned ? STATS_ALLOC_SCAN : STATS_ALLOC_GOAL, (k - scan_from + superblock.nblocks) % superblock.nblocks);
+            *pointer = k;
+            return true;
+        }
+    }
+}
+
+// claim blocks [start, start+count) if every one of them is free; false, with none claimed, if not
+bool claim_blocks(int start, int count){
+    if( start < data_start_block() || start + count > superblock.nblocks ) return false;
+    for( int k = 0; k < count; k++ ){
+        if( !bitmap_set(disk_block_bitmap, start + k, 0) ){
+            bitmap_set_range(disk_block_bitmap, start, start + k, 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+// allocate count consecutive blocks, from goal if they are free there, else the first free run next-fit finds
+bool alloc_run(int goal, int count, int *start){
+    int nblocks = superblock.nblocks;
+    for( bool released = false; ; goal = -1 ){
+        int found = goal >= 0 && claim_blocks(goal, count) ? goal : -1;
+        if( found >= 0 ){
+            STATS_ALLOC(STATS_ALLOC_GOAL, 0);
+            *start = goal;
+            return true;
+        }
+        int cursor = __atomic_load_n(&disk_block_bitmap->cursor, __ATOMIC_RELAXED);
+        found = bitmap_find_run(disk_block_bitmap, cursor, nblocks, count);
+        if( found < 0 ) found = bitmap_find_run(disk_block_bitmap, 0, nblocks, count);
+        if( found < 0 && !released ){
+            // as for alloc_block
+            release_all_reservations();
+            reclaim_blocks(0);
+            released = true;
+            continue;
+        }
+        if( found < 0 ){
+            STATS_ALLOC(STATS_ALLOC_FAILED, 0);
+            return false;
+        }
+        // another thread may take part of the run first; then look again
+        if( claim_blocks(found, count) ){
+            STATS_ALLOC(STATS_ALLOC_SCAN, (found - cursor + nblocks) % nblocks);
+            __atomic_store_n(&disk_block_bitmap->cursor, found + count < nblocks ? found + count : 0, __ATOMIC_RELAXED);
+            *start = found;
+            return true;
+        }
+    }
+}
+
+int fs_write( int inumber, const char *data, int length, int offset ) { // option: make read/write one funtion
+    STATS_OP(STATS_WRITE);
+    union fs_block buffer_block;
+    int bytes_written = 0;
+
+    // check validity of inumber against cached superblock
+    lock_fs(false);
+    if ( !is_mounted || inumber <= 0 || inumber >= superblock.ninodes ){
+        unlock_fs();
+        return 0;
+    }
+
+    // hold the cached inode and verify validity; it is updated in place and written back when synced or evicted.
+    // A write may start past the end of the file, leaving a hole between
+    lock_inode(inumber, true);
+    struct cached_inode *cached = inode_get(inumber);
+    struct fs_inode *inode = &cached->view.inode;
+    int max_blocks = max_file_blocks();
+    if ( !inode->isvalid || offset < 0 || offset / DISK_BLOCK_SIZE >= max_blocks ){
+        inode_put(cached, false);
+        unlock_inode(inumber);
+        unlock_fs();
+        return 0;
+    }
+
+    // compute number of blocks already allocated
+    int num_pointers = file_blocks(inode);
+    int old_size = inode->size;
+    if ( length > INT_MAX - offset ) length = INT_MAX - offset; // sizes are ints
+
+    struct map_append map;
+    map_append_begin(&map, inumber, &cached->view);
+
+    // what the last block holds past the end of the file is part of the gap such a write leaves, so must read as zeros.
+    // A compressed chunk never holds anything there
+    int mapped = 0, next_block = 0, stored;
+    if ( offset > old_size && length > 0 && old_size % DISK_BLOCK_SIZE ) {
+        int tail_block = map_lookup_cached(cached, num_pointers - 1, 1, &mapped, &stored);
+        int within = old_size % DISK_BLOCK_SIZE;
+        mapped = 0;
+        if ( tail_block && !stored ) {
+            STATS_BLOCKS(STATS_DATA, 0, 1);
+            cache_read(tail_block, buffer_block.data);
+            if ( !is_zero(buffer_block.data + within, DISK_BLOCK_SIZE - within) ) {
+                memset(buffer_block.data + within, 0, DISK_BLOCK_SIZE - within);
+                STATS_BLOCKS(STATS_DATA, 1, 1);
+                cache_write(tail_block, buffer_block.data);
+            }
+        }
+    }
+
+    // a compressed file is written a chunk at a time instead, and only its size is settled below
+    bool compressed = inode->isvalid & INODE_COMPRESSED;
+    if ( compressed ) bytes_written = write_chunks(&map, cached, data, length, offset, old_size);
+
+    // new blocks should follow the file's current last block; reserve enough for the whole write up front,
+    // unless it is all zeros and so needs none
+    long long end = ((long long)offset + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int end_blocks = end < max_blocks ? (int)end : max_blocks;
+    int want = end_blocks - (num_pointers > offset / DISK_BLOCK_SIZE ? num_pointers : offset / DISK_BLOCK_SIZE);
+    if ( superblock.version == FS_VERSION_POINTERS && num_pointers <= DATA_POINTERS_PER_INODE && end_blocks > DATA_POINTERS_PER_INODE ) want++;
+    if ( !compressed && want > 0 && !is_zero(data, length) ) reserve_blocks(inumber, map.last < 0 ? -1 : map.last + 1, want < RESERVATION_MIN_BLOCKS ? RESERVATION_MIN_BLOCKS : want);
+
+    // write data a block at a time, allocating blocks (and whatever the map needs) as we run past the end
+    struct block_run run = {0};
+    while ( !compressed && bytes_written < length ) {
+        int logical = (offset + bytes_written) / DISK_BLOCK_SIZE;
+        int within  = (offset + bytes_written) % DISK_BLOCK_SIZE;
+        int chunk   = min(DISK_BLOCK_SIZE - within, length - bytes_written);
+        if ( logical >= max_blocks ) break; // file is as big as it can get
+
+        // existing blocks are looked up a contiguous stretch at a time; new ones are appended to the map, after
+        // holes for whatever gap the write leaves. A block that would hold only zeros is left a hole, never allocated
+        int block_num;
+        bool fresh = logical >= num_pointers;
+        if ( fresh ) {
+            bool zeros = is_zero(data + bytes_written, chunk);
+            map_fill_end(&map, cached);
+            int gap = logical - map.nblocks + zeros;
+            if ( gap > 0 ) {
+                if ( !map_append_hole(&map, gap) ) break;
+                if ( cached->decoded ) map_add_run(cached, map.nblocks - gap, 0, gap, 0);
+            }
+            if ( zeros ) {
+                bytes_written += chunk;
+                continue;
+            }
+            if ( !map_append_alloc(&map, &block_num) ) break;
+            if ( cached->decoded ) map_add_run(cached, logical, block_num, 1, 0);
+        } else {
+            if ( !mapped ) next_block = map_lookup_cached(cached, logical, num_pointers - logical, &mapped, &stored);
+            block_num = next_block;
+            if ( next_block ) next_block++;
+            mapped--;
+            if ( !block_num ) {
+                // a hole already reads as zeros; otherwise it gets a block, next to the one before it if it can
+                if ( is_zero(data + bytes_written, chunk) ) {
+                    bytes_written += chunk;
+                    continue;
+                }
+                int unused, before = logical > 0 ? map_lookup_cached(cached, logical - 1, 1, &unused, &stored) : 0;
+                if ( !map_fill_alloc(&map, cached, logical, before ? before + 1 : -1, &block_num) ) break;
+                fresh = true;
+            }
+        }
+
+        // a fully overwritten block needs no read (and joins a contiguous run if it can);
+        // a fresh one was never written, so its old contents are just zeros
+        STATS_BLOCKS(STATS_DATA, 1, 1);
+        if ( chunk == DISK_BLOCK_SIZE ) {
+            if ( !run_extend(&run, block_num, bytes_written) ) {
+                if ( run.count ) cache_write_range_async(run.start, run.count, data + run.offset);
+                run = (struct block_run){ .start = block_num, .count = 1, .offset = bytes_written };
+            }
+        } else {
+            if ( fresh ) memset(buffer_block.data, 0, DISK_BLOCK_SIZE);
+            else {
+                STATS_BLOCKS(STATS_DATA, 0, 1);
+                cache_read(block_num, buffer_block.data);
+            }
+            memcpy(buffer_block.data + within, data + bytes_written, chunk);
+            cache_write(block_num, buffer_block.data);
+        }
+        bytes_written += chunk;
+    }
+
+    // return sequence
+    if ( run.count ) cache_write_range_async(run.start, run.count, data + run.offset);
+    cache_wait();
+    map_fill_end(&map, cached);
+    map_append_end(&map);
+
+    // a write that stored nothing leaves the file as it was: holes it added past the end before running out of
+    // space are cut off again, an extent map rewritten from its trimmed runs like a fill, surplus chain blocks freed
+    bool trimmed = !bytes_written && map.nblocks > num_pointers;
+    if ( trimmed ) {
+        if ( superblock.version == FS_VERSION_EXTENTS ) {
+            map_find_run(cached, 0);
+            map_trim_runs(cached, num_pointers);
+            map.spares = NULL;
+            map.nspares = 0;
+            map.refill = true;
+            map_fill_end(&map, cached);
+        } else if ( cached->decoded ) {
+            map_trim_runs(cached, num_pointers);
+        }
+        map.nblocks = num_pointers;
+    }
+
+    // the file grows over what was written
+    long long reached = bytes_written ? (long long)offset + bytes_written : 0;
+    if ( reached > (long long)map.nblocks * DISK_BLOCK_SIZE ) reached = (long long)map.nblocks * DISK_BLOCK_SIZE;
+    if ( reached > old_size ) inode->size = (int)reached;
+    inode_put(cached, inode->size != old_size || map.nblocks != num_pointers || map.filled || trimmed);
+    unlock_inode(inumber);
+    unlock_fs();
+    commit_if_due();
+    return bytes_written;
+}
+
+// logical blocks [first, first+nblocks) of a compressed file as they stand into plain, holes as zeros. A
+// compressed chunk among them is aligned the same way, so is always one of them whole
+void read_chunk(int inumber, struct cached_inode *cached, int first, int nblocks, char *plain){
+    for( int logical = first; logical < first + nblocks; ){
+        const struct map_run *r = map_find_run(cached, logical);
+        int stop = r ? min(r->logical + r->length, first + nblocks) : first + nblocks;
+        char *at = plain + (size_t)(logical - first) * DISK_BLOCK_SIZE;
+        int bytes = (stop - logical) * DISK_BLOCK_SIZE;
+        if( !r || !r->start ){
+            memset(at, 0, bytes);
+        } else if( r->stored ){
+            if( !chunk_read(inumber, r, (logical - r->logical) * DISK_BLOCK_SIZE, bytes, at) ){
+                printf("[ERROR] inode %d: compressed chunk at block %d is damaged, reading it as zeros\n", inumber, r->start);
+                memset(at, 0, bytes);
+            }
+        } else {
+            STATS_BLOCKS(STATS_DATA, 0, stop - logical);
+            cache_read_range(r->start + logical - r->logical, stop - logical, at);
+        }
+        logical = stop;
+    }
+}
+
+// where a chunk's new blocks should go: right after the data before it, if there is any
+int chunk_goal(struct cached_inode *cached, int first){
+    for( int i = map_run_index(cached, first - 1); i >= 0; i-- ){
+        const struct map_run *r = &cached->runs[i];
+        if( r->start ) return r->stored ? r->start + r->stored : r->start + min(r->length, first - r->logical);
+    }
+    return -1;
+}
+
+// free the blocks holding logical blocks [first, first+nblocks), but for the nkeep in keep[], which are being
+// written again in place. They are data blocks, so need not wait for a commit (see release_block)
+void release_range(struct cached_inode *cached, int first, int nblocks, const int *keep, int nkeep){
+    for( int logical = first; logical < first + nblocks; ){
+        const struct map_run *r = map_find_run(cached, logical);
+        if( !r ) break;
+        int stop = min(r->logical + r->length, first + nblocks);
+        int from = r->stored ? r->start : r->start + logical - r->logical;
+        int count = r->start ? (r->stored ? r->stored : stop - logical) : 0;
+        for( int b = from; b < from + count; b++ ){
+            bool kept = false;
+            for( int k = 0; k < nkeep && !kept; k++ ) kept = keep[k] == b;
+            if( !kept ) bitmap_set(disk_block_bitmap, b, 1);
+        }
+        logical = stop;
+    }
+}
+
+/*
+Store chunk [first, first+nblocks) of a compressed file from its whole new contents in plain, packed being
+scratch for the codec. Compressed, it goes where it was if it was compressed before and what follows has
+room, as a growing file's last chunk keeps being rewritten; otherwise wherever enough consecutive blocks
+are free, after the data before it if possible. Plain, each block goes where it was, or near the one before
+it if it was a hole. The decoded map takes the change. False, with nothing changed, when there is no space.
+*/
+bool store_chunk(struct map_append *map, struct cached_inode *cached, int first, int nblocks, const char *plain, char *packed){
+    int bytes = nblocks * DISK_BLOCK_SIZE, length = 0, stored = 0, start = 0;
+    const struct map_run *old = map_find_run(cached, first);
+    int old_start = old->stored ? old->start : 0, old_stored = old->stored;
+    int goal = chunk_goal(cached, first);
+    int keep[COMPRESS_CHUNK_BLOCKS] = {0}, nkeep = 0;
+
+    if( nblocks > 1 && !is_zero(plain, bytes) ){
+        length = compress_block(plain, bytes, packed + sizeof(length), bytes - DISK_BLOCK_SIZE - (int)sizeof(length));
+        stored = length ? ((int)sizeof(length) + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE : 0;
+    }
+    if( stored ){
+        if( old_start && (stored <= old_stored || claim_blocks(old_start + old_stored, stored - old_stored)) ){
+            start = old_start;
+            for( ; nkeep < min(stored, old_stored); nkeep++ ) keep[nkeep] = old_start + nkeep;
+        } else if( !alloc_run(goal, stored, &start) ){
+            stored = 0; // no room for it all in one place, but perhaps plain
+        }
+    }
+
+    int blocks[COMPRESS_CHUNK_BLOCKS] = {0};
+    for( int b = 0; !stored && b < nblocks; b++ ){
+        if( is_zero(plain + b * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE) ) continue;
+        int run, in_chunk, block_num = map_lookup_cached(cached, first + b, 1, &run, &in_chunk);
+        if( block_num && !in_chunk ){
+            blocks[b] = keep[nkeep++] = block_num;
+        } else if( !alloc_block(0, goal, &blocks[b]) ){
+            for( int k = 0, kept = 0; k < b; k++ ){
+                if( !blocks[k] ) continue;
+                if( kept < nkeep && keep[kept] == blocks[k] ) kept++;
+                else bitmap_set(disk_block_bitmap, blocks[k], 1);
+            }
+            return false;
+        }
+        goal = blocks[b] + 1;
+    }
+
+    release_range(cached, first, nblocks, keep, nkeep);
+    if( stored ){
+        memcpy(packed, &length, sizeof(length));
+        memset(packed + sizeof(length) + length, 0, stored * DISK_BLOCK_SIZE - sizeof(length) - length);
+        STATS_BLOCKS(STATS_DATA, 1, stored);
+        cache_write_range(start, stored, packed);
+        map_set_range(cached, first, nblocks, start, stored);
+        chunk_remember(map->inumber, first, plain);
+        return true;
+    }
+
+    map_set_range(cached, first, nblocks, 0, 0);
+    struct block_run run = {0};
+    for( int b = 0; b < nblocks; b++ ){
+        if( !blocks[b] ) continue;
+        map_set_range(cached, first + b, 1, blocks[b], 0);
+        STATS_BLOCKS(STATS_DATA, 1, 1);
+        if( !run_extend(&run, blocks[b], b * DISK_BLOCK_SIZE) ){
+            if( run.count ) cache_write_range(run.start, run.count, plain + run.offset);
+            run = (struct block_run){ .start = blocks[b], .count = 1, .offset = b * DISK_BLOCK_SIZE };
+        }
+    }
+    if( run.count ) cache_write_range(run.start, run.count, plain + run.offset);
+    chunk_remember(map->inumber, first, NULL);
+    return true;
+}
+
+/*
+fs_write for a compressed file, a chunk at a time: a chunk the write covers only partly is read first, holes
+and all, then each is stored afresh (see store_chunk). The map is extended with holes up front to cover the
+whole write, gap included, and cut back to what was written if the disk fills; map_fill_end writes it out,
+from chain blocks taken ahead of each chunk. Returns the bytes written.
+*/
+int write_chunks(struct map_append *map, struct cached_inode *cached, const char *data, int length, int offset, int old_size){
+    int old_blocks = map->nblocks;
+    long long end = ((long long)offset + length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+    int end_blocks = end < max_file_blocks() ? (int)end : max_file_blocks();
+    if( (long long)offset + length > (long long)end_blocks * DISK_BLOCK_SIZE ) length = (int)((long long)end_blocks * DISK_BLOCK_SIZE - offset);
+    int new_blocks = end_blocks > old_blocks ? end_blocks : old_blocks;
+    map_find_run(cached, 0);
+    if( new_blocks > old_blocks ) map_add_run(cached, old_blocks, 0, new_blocks - old_blocks, 0);
+
+    size_t chunk_bytes = sizeof(chunk_cache[0].data);
+    char *plain = malloc(2 * chunk_bytes);
+    if( !plain ){
+        printf("ERROR Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    char *packed = plain + chunk_bytes;
+    int bytes_written = 0;
+    while( bytes_written < length ){
+        long long at = (long long)offset + bytes_written;
+        int first = (int)(at / DISK_BLOCK_SIZE) / COMPRESS_CHUNK_BLOCKS * COMPRESS_CHUNK_BLOCKS;
+        int nblocks = min(COMPRESS_CHUNK_BLOCKS, new_blocks - first);
+        long long chunk_start = (long long)first * DISK_BLOCK_SIZE;
+        int from = (int)(at - chunk_start);
+        int count = min(nblocks * DISK_BLOCK_SIZE - from, length - bytes_written);
+
+        // storing a chunk splits at most the runs at its ends, and adds at most a run per block
+        if( !map_fill_room(map, cached->nruns + nblocks + 2) ) break;
+        if( from > 0 || count < nblocks * DISK_BLOCK_SIZE ){
+            read_chunk(map->inumber, cached, first, nblocks, plain);
+            // nothing past the old end of the file is part of it, whatever the last block held there
+            long long valid = old_size - chunk_start > 0 ? old_size - chunk_start : 0;
+            if( valid < nblocks * DISK_BLOCK_SIZE ) memset(plain + valid, 0, nblocks * DISK_BLOCK_SIZE - valid);
+        }
+        memcpy(plain + from, data + bytes_written, count);
+        if( !store_chunk(map, cached, first, nblocks, plain, packed) ) break;
+        bytes_written += count;
+    }
+    free(plain);
+
+    long long reached = bytes_written ? ((long long)offset + bytes_written + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE : 0;
+    map->nblocks = reached > old_blocks ? (int)reached : old_blocks;
+    map_trim_runs(cached, map->nblocks);
+    map->filled = map->refill = bytes_written > 0 || map->nspares > 0;
+    return bytes_written;
+}
+
+// switch a file to compressed chunks or back. Back only while it has no compressed chunk, which fs_write
+// would not know what to do with otherwise; extent file systems only
+int fs_set_compressed( int inumber, int enabled ){
+    STATS_OP(STATS_SET_COMPRESSED);
+    lock_fs(false);
+    if( !is_mounted || superblock.version != FS_VERSION_EXTENTS || inumber <= 0 || inumber >= superblock.ninodes ){
+        unlock_fs();
+        return 0;
+    }
+    lock_inode(inumber, true);
+    struct cached_inode *cached = inode_get(inumber);
+    struct fs_inode *inode = &cached->view.inode;
+    bool done = inode->isvalid;
+    if( done && !enabled ){
+        map_find_run(cached, 0);
+        for( int i = 0; i < cached->nruns && done; i++ ) done = !cached->runs[i].stored;
+    }
+    int was = inode->isvalid;
+    if( done ) inode->isvalid = enabled ? inode->isvalid | INODE_COMPRESSED : inode->isvalid & ~INODE_COMPRESSED;
+    inode_put(cached, inode->isvalid != was);
+    unlock_inode(inumber);
+    unlock_fs();
+    commit_if_due();
+    return done;
+}
+
+// current location of a file's logical block index, or of its indirect block for index -1
+int get_pointer(int inumber, int index){
+    struct fs_inode inode;
+    load_inode(inumber, &inode);
+    if( index < 0 ) return inode.indirect;
+    if( index < DATA_POINTERS_PER_INODE ) return inode.direct[index];
+    int block_num;
+    load_pointers(inode.indirect, index - DATA_POINTERS_PER_INODE, 1, &block_num);
+    return block_num;
+}
+
+// repoint a file's logical block index (or its indirect block, for -1) at block_num
+void set_pointer(int inumber, int index, int block_num){
+    union fs_block buffer_block;
+    if( index >= DATA_POINTERS_PER_INODE ){
+        int indirect = get_pointer(inumber, -1);
+        STATS_BLOCKS(STATS_INDIRECT, 0, 1);
+        read_meta(indirect, buffer_block.data);
+        buffer_block.pointers[index - DATA_POINTERS_PER_INODE] = block_num;
+        STATS_BLOCKS(STATS_INDIRECT, 1, 1);
+        write_meta(indirect, buffer_block.data);
+        pthread_mutex_lock(&inode_cache_lock);
+        int i = inode_lookup(inumber);
+        if( i >= 0 ) map_forget(&inode_cache[i]);
+        pthread_mutex_unlock(&inode_cache_lock);
+        return;
+    }
+    struct cached_inode *cached = inode_get(inumber);
+    if( index < 0 ) cached->view.inode.indirect = block_num;
+    else            cached->view.inode.direct[index] = block_num;
+    map_forget(cached);
+    inode_put(cached, true);
+}
+
+// the reverse map fs_defrag works from: who owns each data block. Null if two pointers share a block or one
+// points outside the data region, since moving either would corrupt the other file
+struct block_owner *build_owners(int data_start, int *nused){
+    int ndata = superblock.nblocks - data_start;
+    struct block_owner *owners = calloc(ndata > 0 ? ndata : 1, sizeof(*owners));
+    if( !owners ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+
+    int *pointers = malloc((max_file_blocks() + 1) * sizeof(int));
+    int *indexes = malloc((max_file_blocks() + 1) * sizeof(int));
+    if( !pointers || !indexes ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    *nused = 0;
+    for( int inumber = 1; inumber < superblock.ninodes && owners; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ) continue;
+        struct fs_inode inode;
+        load_inode(inumber, &inode);
+        int nblocks = layout_pointers(inumber, &inode, pointers, indexes);
+        for( int k = 0; k < nblocks; k++ ){
+            int block_num = pointers[k];
+            if( block_num < data_start || block_num >= superblock.nblocks || owners[block_num - data_start].inumber ){
+                printf("[ERROR] inode %d block %d is shared or out of range, not defragging\n", inumber, block_num);
+                free(owners);
+                owners = NULL;
+                break;
+            }
+            owners[block_num - data_start] = (struct block_owner){ .inumber = inumber, .index = indexes[k] };
+        }
+        *nused += nblocks;
+    }
+    free(pointers);
+    free(indexes);
+    return owners;
+}
+
+// issue a batch: every source is staged before any target is written, since a target may be another entry's source
+void defrag_flush(struct defrag_batch *batch){
+    if( !batch->count ) return;
+
+    struct block_run run = {0};
+    for( int i = 0; i < batch->count; i++ ){
+        if( !run_extend(&run, batch->sources[i], i * DISK_BLOCK_SIZE) ){
+            if( run.count ) cache_read_range_async(run.start, run.count, batch->staging[0].data + run.offset);
+            run = (struct block_run){ .start = batch->sources[i], .count = 1, .offset = i * DISK_BLOCK_SIZE };
+        }
+    }
+    if( run.count ) cache_read_range_async(run.start, run.count, batch->staging[0].data + run.offset);
+    cache_wait();
+    // a moved indirect block may have changes still only in the running transaction
+    for( int i = 0; i < batch->count; i++ ) journal_read(batch->sources[i], batch->staging[i].data);
+    cache_write_range(batch->target, batch->count, batch->staging[0].data);
+    STATS_BLOCKS(STATS_DATA, 0, batch->count); // a moved indirect block is counted as data too
+    STATS_BLOCKS(STATS_DATA, 1, batch->count);
+
+    for( int i = 0; i < batch->count; i++ ) release_block(batch->sources[i]);
+    bitmap_set_range(disk_block_bitmap, batch->target, batch->target + batch->count, 0);
+
+    // indirect blocks first, so the entries updated inside them are updated where they now sit
+    for( int pass = 0; pass < 2 && batch->repoint; pass++ )
+        for( int i = 0; i < batch->count; i++ )
+            if( (batch->owners[i].index < 0) == (pass == 0) )
+                set_pointer(batch->owners[i].inumber, batch->owners[i].index, batch->target + i);
+    batch->count = 0;
+}
+
+// move the block at from, owned by *owner, to the free block to
+void defrag_relocate(int from, int to, struct block_owner *owners, int data_start, union fs_block *staging){
+    STATS_BLOCKS(STATS_DATA, 0, 1);
+    STATS_BLOCKS(STATS_DATA, 1, 1);
+    cache_read_range(from, 1, staging->data);
+    cache_write_range(to, 1, staging->data);
+    set_pointer(owners[from - data_start].inumber, owners[from - data_start].index, to);
+    owners[to - data_start] = owners[from - data_start];
+    owners[from - data_start].inumber = 0;
+    bitmap_set(disk_block_bitmap, to, 0);
+    bitmap_set(disk_block_bitmap, from, 1);
+}
+
+// exchange two owned blocks, for when the disk is too full to move one aside
+void defrag_swap(int a, int b, struct block_owner *owners, int data_start, union fs_block *staging){
+    STATS_BLOCKS(STATS_DATA, 0, 2);
+    STATS_BLOCKS(STATS_DATA, 1, 2);
+    cache_read_range(a, 1, staging[0].data);
+    cache_read_range(b, 1, staging[1].data);
+    cache_write_range(a, 1, staging[1].data);
+    cache_write_range(b, 1, staging[0].data);
+
+    struct block_owner owner_a = owners[a - data_start], owner_b = owners[b - data_start];
+    owners[a - data_start] = owner_b;
+    owners[b - data_start] = owner_a;
+    // an indirect block first, in case the other block is listed in it
+    if( owner_a.index < 0 ){
+        set_pointer(owner_a.inumber, owner_a.index, b);
+        set_pointer(owner_b.inumber, owner_b.index, a);
+    } else {
+        set_pointer(owner_b.inumber, owner_b.index, a);
+        set_pointer(owner_a.inumber, owner_a.index, b);
+    }
+}
+
+// renumber the valid inodes 1, 2, 3, ... in their current order, writing only inode blocks that change.
+// An inode never moves to a higher number, so each output block is written after its inputs have been read
+void compact_inodes(){
+    union fs_block in, out;
+    memset(out.data, 0, DISK_BLOCK_SIZE);
+    int next = 1, last_used = -1;
+
+    for( int b = 0; b < table_initialized(); b++ ){
+        STATS_BLOCKS(STATS_INODE_TABLE, 0, 1);
+        read_meta(INODE_TABLE_START_BLOCK + b, in.data);
+        for( int j = 0; j < INODES_PER_BLOCK; j++ ){
+            int inumber = b * INODES_PER_BLOCK + j;
+            if( inumber == 0 || bitmap_test(inode_table_bitmap, inumber) ) continue;
+            last_used = b;
+            out.inodes[next % INODES_PER_BLOCK] = in.inodes[j];
+            if( ++next % INODES_PER_BLOCK == 0 ){
+                write_if_changed(INODE_TABLE_START_BLOCK + next / INODES_PER_BLOCK - 1, &out);
+                memset(out.data, 0, DISK_BLOCK_SIZE);
+            }
+        }
+    }
+    // the partly filled block, then the ones emptied behind it
+    for( int b = next / INODES_PER_BLOCK; b <= last_used; b++ ){
+        write_if_changed(INODE_TABLE_START_BLOCK + b, &out);
+        memset(out.data, 0, DISK_BLOCK_SIZE);
+    }
+
+    bitmap_set_range(inode_table_bitmap, 1, next, 0);
+    bitmap_set_range(inode_table_bitmap, next, superblock.ninodes, 1);
+}
+
+void write_if_changed(int block_num, const union fs_block *block){
+    const union fs_block *old = peek_block(block_num);
+    bool changed = memcmp(old->data, block->data, DISK_BLOCK_SIZE);
+    unpeek_block(old);
+    if( !changed ) return;
+    STATS_BLOCKS(meta_kind(block_num), 1, 1);
+    write_meta(block_num, block->data);
+}
+
+// fs_defrag for pointer maps: every move repoints the block's pointer as it goes
+int defrag_pointer_files(struct defrag_batch *batch){
+    int data_start = data_start_block();
+    int nblocks = superblock.nblocks;
+    int nused;
+    struct block_owner *owners = build_owners(data_start, &nused);
+    if( !owners ) return -1;
+
+    int *pointers = malloc((max_file_blocks() + 1) * sizeof(int));
+    int *indexes = malloc((max_file_blocks() + 1) * sizeof(int));
+    if( !pointers || !indexes ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+
+    // the layout gives which pointers to follow; where they point is read afresh, as earlier moves change it
+    int moved = 0;
+    int slot = data_start;
+    for( int inumber = 1; inumber < superblock.ninodes; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ) continue;
+        struct fs_inode inode;
+        load_inode(inumber, &inode);
+        int nlayout = layout_pointers(inumber, &inode, pointers, indexes);
+
+        for( int k = 0; k < nlayout; k++, slot++ ){
+            int index = indexes[k];
+            int block_num = get_pointer(inumber, index);
+            if( block_num == slot ){
+                defrag_flush(batch);
+                continue;
+            }
+
+            if( owners[slot - data_start].inumber ){
+                // prefer somewhere past the final layout, where the stranger will not be in the way again
+                defrag_flush(batch);
+                int spare = bitmap_find_set(disk_block_bitmap, data_start + nused, nblocks);
+                if( spare < 0 ) spare = bitmap_find_set(disk_block_bitmap, slot + 1, nblocks);
+                if( spare < 0 ){
+                    defrag_swap(block_num, slot, owners, data_start, batch->staging);
+                    moved += 2;
+                    continue;
+                }
+                defrag_relocate(slot, spare, owners, data_start, batch->staging);
+                moved++;
+            }
+
+            if( !batch->count ) batch->target = slot;
+            batch->sources[batch->count] = block_num;
+            batch->owners[batch->count] = (struct block_owner){ .inumber = inumber, .index = index };
+            batch->count++;
+            owners[slot - data_start] = owners[block_num - data_start];
+            owners[block_num - data_start].inumber = 0;
+            moved++;
+            if( batch->count == DEFRAG_STAGING_BLOCKS ) defrag_flush(batch);
+        }
+    }
+    defrag_flush(batch);
+
+    free(pointers);
+    free(indexes);
+    free(owners);
+    return moved;
+}
+
+/*
+fs_defrag for extent maps. Blocks are tracked by the slot they belong in rather than by pointer: where[]
+gives the current home of each slot's block and slot_of[] the slot each block belongs in, both built from
+the maps up front along with a list of every file's holes, after which the chain blocks are no longer
+needed and count as free. The same order of slots is filled the same way as for pointer maps; every file
+then gets a single extent, or if it has holes one per stretch of data or holes, and one per compressed chunk,
+with new chain blocks.
+*/
+int defrag_extent_files(struct defrag_batch *batch){
+    int data_start = data_start_block();
+    int nblocks = superblock.nblocks;
+    int ndata = nblocks - data_start > 0 ? nblocks - data_start : 1;
+    int *where = malloc(ndata * sizeof(int));
+    int *slot_of = malloc(ndata * sizeof(int));
+    if( !where || !slot_of ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    for( int i = 0; i < ndata; i++ ) slot_of[i] = -1;
+
+    // shapes.runs holds every file's runs in turn, start 1 for data and 0 for a hole, and run_count[] says how
+    // many each file has: a compressed chunk keeps its stored blocks together, so must stay a run of its own
+    int nused = 0;
+    struct fs_inode inode;
+    struct cached_inode shapes = {0};
+    int *run_count = calloc(superblock.ninodes, sizeof(int));
+    if( !run_count ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    for( int inumber = 1; inumber < superblock.ninodes; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ) continue;
+        load_inode(inumber, &inode);
+        for( int logical = 0, run, stored; logical < file_blocks(&inode); logical += run ){
+            int block_num = map_lookup(&inode, logical, file_blocks(&inode) - logical, &run, &stored);
+            map_reserve_runs(&shapes, shapes.nruns + 1);
+            shapes.runs[shapes.nruns++] = (struct map_run){ .logical = logical, .start = block_num != 0, .length = run, .stored = stored };
+            run_count[inumber]++;
+            for( int r = 0; block_num && r < (stored ? stored : run); r++ ){
+                int b = block_num + r;
+                if( b < data_start || b >= nblocks || slot_of[b - data_start] >= 0 ){
+                    printf("[ERROR] inode %d block %d is shared or out of range, not defragging\n", inumber, b);
+                    free(where);
+                    free(slot_of);
+                    free(shapes.runs);
+                    free(run_count);
+                    return -1;
+                }
+                where[nused] = b;
+                slot_of[b - data_start] = data_start + nused;
+                nused++;
+            }
+        }
+    }
+    for( int inumber = 1; inumber < superblock.ninodes; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ) continue;
+        load_inode(inumber, &inode);
+        for( int meta_block = map_first_meta(&inode); meta_block > 0; meta_block = map_next_meta(&inode, meta_block) )
+            bitmap_set(disk_block_bitmap, meta_block, 1);
+    }
+
+    int moved = 0;
+    for( int slot = data_start; slot < data_start + nused; slot++ ){
+        int block_num = where[slot - data_start];
+        if( block_num == slot ){
+            defrag_flush(batch);
+            continue;
+        }
+
+        int stranger = slot_of[slot - data_start];
+        if( stranger >= 0 ){
+            defrag_flush(batch);
+            int spare = bitmap_find_set(disk_block_bitmap, data_start + nused, nblocks);
+            if( spare < 0 ) spare = bitmap_find_set(disk_block_bitmap, slot + 1, nblocks);
+            if( spare < 0 ){
+                // exchange the two through the staging area
+                STATS_BLOCKS(STATS_DATA, 0, 2);
+                STATS_BLOCKS(STATS_DATA, 1, 2);
+                cache_read_range(block_num, 1, batch->staging[0].data);
+                cache_read_range(slot, 1, batch->staging[1].data);
+                cache_write_range(slot, 1, batch->staging[0].data);
+                cache_write_range(block_num, 1, batch->staging[1].data);
+                where[stranger - data_start] = block_num;
+                slot_of[block_num - data_start] = stranger;
+                where[slot - data_start] = slot;
+                slot_of[slot - data_start] = slot;
+                moved += 2;
+                continue;
+            }
+            STATS_BLOCKS(STATS_DATA, 0, 1);
+            STATS_BLOCKS(STATS_DATA, 1, 1);
+            cache_read_range(slot, 1, batch->staging[0].data);
+            cache_write_range(spare, 1, batch->staging[0].data);
+            where[stranger - data_start] = spare;
+            slot_of[spare - data_start] = stranger;
+            slot_of[slot - data_start] = -1;
+            bitmap_set(disk_block_bitmap, spare, 0);
+            bitmap_set(disk_block_bitmap, slot, 1);
+            moved++;
+        }
+
+        if( !batch->count ) batch->target = slot;
+        batch->sources[batch->count++] = block_num;
+        where[slot - data_start] = slot;
+        slot_of[slot - data_start] = slot;
+        slot_of[block_num - data_start] = -1;
+        moved++;
+        if( batch->count == DEFRAG_STAGING_BLOCKS ) defrag_flush(batch);
+    }
+    defrag_flush(batch);
+
+    // the chain blocks were released above, so only the inode itself changes, written straight to its table block,
+    // along with new chain blocks for a file whose holes or compressed chunks need them. The released ones are at least as many
+    inode_sync();
+    inode_cache_clear();
+    int base = data_start, next_run = 0;
+    struct cached_inode layout = {0};
+    for( int inumber = 1; inumber < superblock.ninodes; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ) continue;
+        load_inode(inumber, &inode);
+        layout.nruns = 0;
+        for( int k = 0; k < run_count[inumber]; k++, next_run++ ){
+            const struct map_run *shape = &shapes.runs[next_run];
+            map_add_run(&layout, shape->logical, shape->start ? base : 0, shape->length, shape->stored);
+            if( shape->start ) base += shape->stored ? shape->stored : shape->length;
+        }
+
+        int chain[map_chain_blocks(layout.nruns) + 1];
+        for( int c = 0; c < map_chain_blocks(layout.nruns); c++ ) alloc_block(0, -1, &chain[c]);
+        union fs_block buffer_block;
+        int inode_block = INODE_TABLE_START_BLOCK + inumber / INODES_PER_BLOCK;
+        STATS_BLOCKS(STATS_INODE_TABLE, 0, 1);
+        read_meta(inode_block, buffer_block.data);
+        map_store_extents(&buffer_block.xinodes[inumber % INODES_PER_BLOCK], layout.runs, layout.nruns, chain);
+        write_if_changed(inode_block, &buffer_block);
+    }
+
+    free(layout.runs);
+    free(shapes.runs);
+    free(run_count);
+    free(where);
+    free(slot_of);
+    return moved;
+}
+
+/*
+In place: files are laid out one after another from the start of the data region, each file's blocks in
+order followed by its indirect block, and the inodes are renumbered to close the gaps. Slots are filled in
+that order; a block already in its slot is left alone, a slot's stranger is moved to a free block first
+(or swapped, on a full disk), and moves into free slots are staged and issued a batch at a time. Pointers
+are updated with each move, so an interrupted defrag leaves a consistent file system and running it again
+picks up where it stopped. Memory is the fixed staging area plus a reverse map of two ints per data block.
+Returns the number of blocks moved, or -1. Extent maps cannot be repointed a block at a time without
+splitting extents, so on an extent file system defrag_extent_files keeps every file's map in memory
+instead and writes each file back as a single extent at the end, or one per stretch if it has holes, and
+one per compressed chunk. Holes stay holes either way: they take no slots.
+*/
+int fs_defrag(){
+    STATS_OP(STATS_DEFRAG);
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return -1;
+    }
+    unlogged_begin();           // first, so that the blocks reclaimed here are free at once
+    reclaim_blocks(0);          // its reverse map needs every allocated block to have an owner
+    release_all_reservations(); // blocks are about to move under them
+    forget_streams();
+    chunk_forget_all();         // and inodes are renumbered
+
+    struct defrag_batch *batch = malloc(sizeof(*batch));
+    if( !batch ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    batch->count = 0;
+    batch->repoint = superblock.version == FS_VERSION_POINTERS;
+
+    int moved = superblock.version == FS_VERSION_EXTENTS ? defrag_extent_files(batch) : defrag_pointer_files(batch);
+    free(batch);
+    if( moved >= 0 ){
+        inode_sync();
+        inode_cache_clear();
+        compact_inodes();
+        superblock.defragcursor = 0; // inode numbers have changed under it
+    }
+    unlogged_end();
+    unlock_fs();
+    return moved < 0 ? -1 : moved;
+}
+
+// every allocated block of a file in layout order (data blocks, then the indirect block), with the logical block
+// each holds in indexes[] (-1 for the indirect block); returns how many. Holes take no room in the layout. An
+// extent file's layout is its data alone: placed contiguously it needs no more chain blocks than its holes and
+// compressed chunks do. A compressed chunk's stored blocks all carry its first logical block
+int layout_pointers(int inumber, const struct fs_inode *inode, int *pointers, int *indexes){
+    int nlayout = 0;
+    for( int logical = 0, run, stored; logical < file_blocks(inode); logical += run ){
+        int block_num = map_lookup(inode, logical, file_blocks(inode) - logical, &run, &stored);
+        for( int r = 0; block_num && r < (stored ? stored : run); r++, nlayout++ ){
+            pointers[nlayout] = block_num + r;
+            indexes[nlayout] = stored ? logical : logical + r;
+        }
+    }
+    if( superblock.version != FS_VERSION_EXTENTS && map_first_meta(inode) ){
+        pointers[nlayout] = inode->indirect;
+        indexes[nlayout++] = -1;
+    }
+    return nlayout;
+}
+
+/*
+One slice of online defrag: starting at the inode the last step stopped at, each file that is fragmented,
+or would fit into free space lower on the disk, is copied into the lowest free run that holds it (and an
+extent file's map becomes that single run, its holes kept where they were). Files are
+not renumbered and nothing else moves, so between steps the file system is as consistent as after any
+fs_write. budget bounds the work: every inode loaded costs one, empty or not, every block moved one more,
+and every DEFRAG_SKIP_WORDS bitmap words of free slots passed over another. A file is
+only started if it fits in what is left, unless it is the step's first, so every step makes progress. The
+cursor is written to the superblock after each step; it returns to 0 once a pass over the table completes.
+Returns the number of blocks moved, or -1.
+*/
+int fs_defrag_step(int budget){
+    STATS_OP(STATS_DEFRAG_STEP);
+    if( budget <= 0 ) return -1;
+    lock_fs(true);
+    if( !is_mounted ){
+        unlock_fs();
+        return -1;
+    }
+
+    struct defrag_batch *batch = malloc(sizeof(*batch));
+    if( !batch ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    batch->count = 0;
+    batch->repoint = superblock.version == FS_VERSION_POINTERS;
+
+    int data_start = data_start_block();
+    int *pointers = malloc((max_file_blocks() + 1) * sizeof(int));
+    int *indexes = malloc((max_file_blocks() + 1) * sizeof(int));
+    if( !pointers || !indexes ){
+        printf("[ERROR] Failed to allocate memory. Exiting...\n");
+        abort();
+    }
+    int moved = 0, spent = 0, skipped = 0;
+    int inumber = superblock.defragcursor > 0 && superblock.defragcursor < superblock.ninodes ? superblock.defragcursor : 1;
+    for( ; inumber < superblock.ninodes && spent < budget; inumber++ ){
+        if( bitmap_test(inode_table_bitmap, inumber) ){
+            // jump over the free slots a word at a time, but no further than the budget left pays for
+            long long reach = inumber + (long long)(budget - spent) * DEFRAG_SKIP_WORDS * BITMAP_WORD_BITS;
+            int next = bitmap_find_clear(inode_table_bitmap, inumber, reach < superblock.ninodes ? (int)reach : superblock.ninodes);
+            if( next < 0 ) next = reach < superblock.ninodes ? (int)reach : superblock.ninodes;
+            skipped += (next - 1) / BITMAP_WORD_BITS - inumber / BITMAP_WORD_BITS + 1;
+            spent += skipped / DEFRAG_SKIP_WORDS;
+            skipped %= DEFRAG_SKIP_WORDS;
+            inumber = next - 1;
+            continue;
+        }
+        struct fs_inode inode;
+        load_inode(inumber, &inode);
+        spent++;
+        int nlayout = layout_pointers(inumber, &inode, pointers, indexes);
+        if( nlayout == 0 ) continue;
+
+        bool contiguous = true;
+        for( int k = 1; k < nlayout && contiguous; k++ ) contiguous = pointers[k] == pointers[0] + k;
+        int target = bitmap_find_run(disk_block_bitmap, data_start, contiguous ? pointers[0] : superblock.nblocks, nlayout);
+        if( target < 0 ) continue;
+        if( moved && spent + nlayout > budget ) break;
+
+        // the file's reservation and read-ahead refer to where it is now
+        release_file_reservation(inumber);
+        forget_stream(inumber);
+
+        for( int k = 0; k < nlayout; k++ ){
+            if( !batch->count ) batch->target = target + k;
+            batch->sources[batch->count] = pointers[k];
+            batch->owners[batch->count] = (struct block_owner){ .inumber = inumber, .index = indexes[k] };
+            if( ++batch->count == DEFRAG_STAGING_BLOCKS ) defrag_flush(batch);
+        }
+        defrag_flush(batch);
+        if( !batch->repoint ) map_set_layout(inumber, target);
+        moved += nlayout;
+        spent += nlayout;
+    }
+
+    superblock.defragcursor = inumber < superblock.ninodes ? inumber : 0;
+    write_superblock();
+
+    free(pointers);
+    free(indexes);
+    free(batch);
+    unlock_fs();
+    commit_if_due();
+    return moved;
+}
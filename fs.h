@@ -1,16 +1,44 @@
 #ifndef FS_H
 #define FS_H
 
+// inode formats fs_format_version can lay down
+#define FS_VERSION_POINTERS 0	// direct pointers (five unless built otherwise) and one indirect block per inode: files of up to
+				// 1029 blocks with the default geometry
+#define FS_VERSION_EXTENTS  1	// (start, length) extents, two in the inode and the rest in a chain of extent blocks
+
+// every entry point may be called from any number of threads at once
 void fs_debug();
+int  fs_fragstats();
 int  fs_format();
+int  fs_format_version( int version );
+int  fs_format_compressed();	// extents, with every file created afterwards compressed
 int  fs_mount();
+int  fs_unmount();
+int  fs_sync();
 
 int  fs_create();
 int  fs_delete( int inumber );
 int  fs_getsize( int inumber );
 
+// many inodes at once, each inode table block read and written once per call
+int  fs_create_batch( int count, int *inumbers );
+int  fs_delete_batch( const int *inumbers, int count );
+int  fs_getsize_batch( const int *inumbers, int count, int *sizes );
+
+// with deferred deletes on, deletes return at once and their blocks are freed later: by fs_reclaim,
+// when an allocation finds no free block, or at the latest by fs_unmount or fs_defrag
+void fs_set_deferred_delete( int enabled );
+int  fs_reclaim( int budget );
+
+// a write may start past the end of the file; the gap becomes a hole, which takes no blocks and reads as
+// zeros, and so does any block a write would fill with nothing but zeros
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
 int  fs_defrag();
+int  fs_defrag_step( int budget );
+
+// a compressed file is stored in chunks of 8 blocks, each compressed on its own; extent file systems only.
+// Compression can be turned on for a file at any time, but off only while nothing it holds is compressed
+int  fs_set_compressed( int inumber, int enabled );
 
 #endif
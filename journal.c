@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "journal.h"
+#include "cache.h"
+#include "disk.h"
+#include "stats.h"
+
+/*
+Write-ahead log for metadata blocks.  Writes between commits collect in the
+running transaction, an in-memory copy of each block changed, and nothing
+of it reaches the block's home until the transaction is committed: fs.c
+sends its metadata reads here first so it sees its own writes meanwhile.
+
+The log holds at most one transaction, laid out from its first block:
+
+	header (sequence, count, block numbers) | count block images | commit
+
+and the commit block carries a checksum over the header and the images, so
+a transaction only counts once every block of it is on disk, and a torn
+or half-overwritten one does not count at all.  A commit first flushes the
+cache and syncs the disk, so that the data blocks the new metadata points
+at, and everything the previous transaction wrote in place, are down
+before the log is overwritten; it then writes the log, syncs, and only
+then hands the images to the cache to be written home whenever.  Replay
+is just writing the committed images home again, so replaying twice, or
+replaying a transaction already home, does no harm.
+*/
+
+#define JOURNAL_MAGIC        0x6a726e6c
+#define JOURNAL_COMMIT_MAGIC 0x636f6d74
+#define JOURNAL_MAX_RECORDS  ((DISK_BLOCK_SIZE-12)/4)	// block numbers the header has room for, 1021 with 4 KB blocks
+#define JOURNAL_BUCKETS      256	// hash chains over the running transaction, a power of two
+
+struct journal_header {
+	uint32_t magic;
+	uint32_t sequence;
+	int count;
+	int blocknums[JOURNAL_MAX_RECORDS];
+};
+
+struct journal_commit_block {
+	uint32_t magic;
+	uint32_t sequence;
+	int count;
+	int unused;
+	uint64_t checksum;	// over the header block and the images
+};
+
+typedef char journal_header_fits_block[sizeof(struct journal_header)<=DISK_BLOCK_SIZE ? 1 : -1];
+
+// one block of the running transaction
+struct journal_entry {
+	int blocknum;
+	int next;		// next entry in the same hash chain, -1 ends the chain
+	char *data;
+};
+
+static int log_start=0;
+static int log_blocks=0;
+static int logging=0;
+static uint32_t sequence=0;
+static struct journal_entry *entries=0;
+static int nentries=0;
+static int entries_capacity=0;
+static int buckets[JOURNAL_BUCKETS];
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hash( int blocknum )
+{
+	return (int)(((unsigned)blocknum * 2654435761u) & (JOURNAL_BUCKETS-1));
+}
+
+// FNV-1a
+static uint64_t checksum( const char *data, size_t length )
+{
+	uint64_t sum = 14695981039346656037ull;
+	for(size_t i=0;i<length;i++) {
+		sum ^= (unsigned char)data[i];
+		sum *= 1099511628211ull;
+	}
+	return sum;
+}
+
+static char *alloc_blocks( int count )
+{
+	char *data = malloc((size_t)count*DISK_BLOCK_SIZE);
+	if(!data) {
+		printf("ERROR: couldn't allocate journal!\n");
+		abort();
+	}
+	return data;
+}
+
+static int lookup( int blocknum )
+{
+	for(int e=buckets[hash(blocknum)]; e>=0; e=entries[e].next) {
+		if(entries[e].blocknum==blocknum) return e;
+	}
+	return -1;
+}
+
+static void forget_all()
+{
+	for(int e=0;e<nentries;e++) free(entries[e].data);
+	__atomic_store_n(&nentries,0,__ATOMIC_RELAXED);
+	for(int i=0;i<JOURNAL_BUCKETS;i++) buckets[i] = -1;
+}
+
+// overwrite the log's header, so nothing in it replays
+static void empty_log()
+{
+	char *zero = alloc_blocks(1);
+	memset(zero,0,DISK_BLOCK_SIZE);
+	cache_write_range(log_start,1,zero);
+	disk_sync();
+	free(zero);
+}
+
+// a committed transaction in the log, as header, images and commit block, or null
+static char *read_committed()
+{
+	char *header_block = alloc_blocks(1);
+	cache_read_range(log_start,1,header_block);
+	struct journal_header *header = (struct journal_header *)header_block;
+
+	if(header->magic==JOURNAL_MAGIC) sequence = header->sequence;
+	int count = header->count;
+	if(header->magic!=JOURNAL_MAGIC || count<=0 || count>journal_capacity()) {
+		free(header_block);
+		return 0;
+	}
+	free(header_block);
+
+	char *log = alloc_blocks(count+2);
+	cache_read_range(log_start,count+2,log);
+	header = (struct journal_header *)log;
+	struct journal_commit_block *commit = (struct journal_commit_block *)(log+(size_t)(count+1)*DISK_BLOCK_SIZE);
+	if(header->count!=count || commit->magic!=JOURNAL_COMMIT_MAGIC || commit->sequence!=header->sequence ||
+		commit->count!=count || commit->checksum!=checksum(log,(size_t)(count+1)*DISK_BLOCK_SIZE)) {
+		free(log);
+		return 0;
+	}
+	return log;
+}
+
+int journal_open( int start, int nblocks )
+{
+	journal_close();
+	log_start = start;
+	log_blocks = nblocks>=3 ? nblocks : 0;
+	sequence = 0;
+	if(!log_blocks) return 0;
+
+	int replayed = 0;
+	char *log = read_committed();
+	if(log) {
+		const struct journal_header *header = (const struct journal_header *)log;
+		for(int i=0;i<header->count;i++) {
+			cache_write_range(header->blocknums[i],1,log+(size_t)(i+1)*DISK_BLOCK_SIZE);
+		}
+		replayed = header->count;
+		disk_sync();
+		free(log);
+		empty_log();
+	}
+
+	__atomic_store_n(&logging,1,__ATOMIC_RELEASE);
+	return replayed;
+}
+
+// the log is emptied once everything is home, so that the next journal_open, after a clean unmount, has nothing to do
+void journal_close()
+{
+	pthread_mutex_lock(&journal_lock);
+	if(logging && log_blocks) {
+		cache_flush();
+		disk_sync();
+		empty_log();
+	}
+	__atomic_store_n(&logging,0,__ATOMIC_RELEASE);
+	forget_all();
+	free(entries);
+	entries = 0;
+	entries_capacity = 0;
+	pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_write( int blocknum, const char *data )
+{
+	if(!journal_logging()) return 0;
+
+	pthread_mutex_lock(&journal_lock);
+	int e = lookup(blocknum);
+	if(e<0) {
+		if(nentries==entries_capacity) {
+			entries_capacity = entries_capacity ? 2*entries_capacity : 64;
+			entries = realloc(entries,entries_capacity*sizeof(*entries));
+			if(!entries) {
+				printf("ERROR: couldn't allocate journal!\n");
+				abort();
+			}
+		}
+		e = nentries;
+		entries[e].blocknum = blocknum;
+		entries[e].data = alloc_blocks(1);
+		entries[e].next = buckets[hash(blocknum)];
+		buckets[hash(blocknum)] = e;
+		__atomic_store_n(&nentries,nentries+1,__ATOMIC_RELAXED);
+	}
+	memcpy(entries[e].data,data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_lock);
+	return 1;
+}
+
+int journal_read( int blocknum, char *data )
+{
+	if(!journal_pending()) return 0;
+
+	pthread_mutex_lock(&journal_lock);
+	int e = lookup(blocknum);
+	if(e>=0) memcpy(data,entries[e].data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&journal_lock);
+	return e>=0;
+}
+
+// entries only go away at a commit, which no reader overlaps, so the image can be handed out as it is
+const char *journal_peek( int blocknum )
+{
+	if(!journal_pending()) return 0;
+
+	pthread_mutex_lock(&journal_lock);
+	int e = lookup(blocknum);
+	const char *data = e>=0 ? entries[e].data : 0;
+	pthread_mutex_unlock(&journal_lock);
+	return data;
+}
+
+int journal_logging()
+{
+	return __atomic_load_n(&logging,__ATOMIC_ACQUIRE);
+}
+
+int journal_pending()
+{
+	return __atomic_load_n(&nentries,__ATOMIC_RELAXED);
+}
+
+int journal_capacity()
+{
+	int capacity = log_blocks-2;
+	return capacity<JOURNAL_MAX_RECORDS ? capacity : JOURNAL_MAX_RECORDS;
+}
+
+// send the running transaction's images to their homes through the cache, and start a new one
+static void checkpoint()
+{
+	for(int e=0;e<nentries;e++) cache_write(entries[e].blocknum,entries[e].data);
+	forget_all();
+}
+
+int journal_commit()
+{
+	pthread_mutex_lock(&journal_lock);
+	int count = nentries;
+	if(count>journal_capacity()) {
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+	if(count==0) {
+		pthread_mutex_unlock(&journal_lock);
+		return 1;
+	}
+
+	// ordered: what the new metadata points at, and the last transaction, are home before the log is reused
+	cache_flush();
+	disk_sync();
+
+	char *log = alloc_blocks(count+2);
+	memset(log,0,DISK_BLOCK_SIZE);
+	struct journal_header *header = (struct journal_header *)log;
+	header->magic = JOURNAL_MAGIC;
+	header->sequence = sequence+1;
+	header->count = count;
+	for(int e=0;e<count;e++) {
+		header->blocknums[e] = entries[e].blocknum;
+		memcpy(log+(size_t)(e+1)*DISK_BLOCK_SIZE,entries[e].data,DISK_BLOCK_SIZE);
+	}
+
+	char *commit_block = log+(size_t)(count+1)*DISK_BLOCK_SIZE;
+	memset(commit_block,0,DISK_BLOCK_SIZE);
+	struct journal_commit_block *commit = (struct journal_commit_block *)commit_block;
+	commit->magic = JOURNAL_COMMIT_MAGIC;
+	commit->sequence = header->sequence;
+	commit->count = count;
+	commit->checksum = checksum(log,(size_t)(count+1)*DISK_BLOCK_SIZE);
+
+	STATS_BLOCKS(STATS_JOURNAL,1,count+2);
+	cache_write_range(log_start,count+2,log);
+	disk_sync();
+	sequence++;
+	free(log);
+
+	checkpoint();
+	pthread_mutex_unlock(&journal_lock);
+	return 1;
+}
+
+// the log is emptied first: once the cache may write the images home, an older transaction must not replay over them
+void journal_suspend()
+{
+	pthread_mutex_lock(&journal_lock);
+	if(log_blocks) empty_log();
+	checkpoint();
+	__atomic_store_n(&logging,0,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&journal_lock);
+}
+
+void journal_resume()
+{
+	__atomic_store_n(&logging,log_blocks>0,__ATOMIC_RELEASE);
+}
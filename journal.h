@@ -0,0 +1,22 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+// a log of metadata block images, one committed transaction at a time, in a region fs.c sets aside
+
+int  journal_open( int start, int nblocks );	// replays whatever was committed and empties the log; returns blocks replayed
+void journal_close();				// commit the running transaction first; this flushes the cache and empties the log
+
+// the running transaction: metadata writes land here, and reads must look here first
+int  journal_write( int blocknum, const char *data );	// 0 when no journal is taking writes, so the caller writes in place
+int  journal_read( int blocknum, char *data );		// 0 unless the running transaction holds blocknum
+const char *journal_peek( int blocknum );		// the same in place, or null; stays valid until the next commit
+int  journal_logging();
+int  journal_pending();
+int  journal_capacity();
+
+// the caller keeps every other writer out while these run
+int  journal_commit();		// log the running transaction, then hand it to the cache; 0 if it is too big to log
+void journal_suspend();		// write the running transaction in place unlogged, empty the log and stop taking writes
+void journal_resume();
+
+#endif
@@ -1,14 +1,18 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 
 static int do_copyin( const char *filename, int inumber );
 static int do_copyout( int inumber, const char *filename );
+static int *inumber_range( int first, int last );
 
 int main( int argc, char *argv[] )
 {
@@ -16,28 +20,61 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	int inumber, result, args, count;
+	int *inumbers, *sizes;
+	int diskflags = 0;
+	int stripe = DISK_STRIPE_DEFAULT_BLOCKS;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	// in batch mode the commands come from a manifest, or stdin, and are run without a prompt;
+	// the exit status is then 1 if any of them failed
+	FILE *input = stdin;
+	int batch = 0;
+	int failures = 0;
+
+	int usage = argc<3;
+	for(int i=3;i<argc;i++) {
+		if(!strcmp(argv[i],"mmap")) diskflags |= DISK_FLAG_MMAP;
+		else if(!strcmp(argv[i],"checksum")) diskflags |= DISK_FLAG_CHECKSUMS;
+		else if(sscanf(argv[i],"stripe=%d",&stripe)==1 && stripe>0) continue;
+		else if(!strcmp(argv[i],"batch")) batch = 1;
+		else if(!strncmp(argv[i],"batch=",6) && input==stdin) {
+			batch = 1;
+			input = fopen(argv[i]+6,"r");
+			if(!input) {
+				printf("couldn't open %s: %s\n",argv[i]+6,strerror(errno));
+				return 1;
+			}
+		}
+		else usage = 1;
+	}
+	if(usage) {
+		printf("use: %s <diskfile>[,<diskfile>...] <nblocks> [mmap] [checksum] [stripe=<blocks>] [batch[=<manifest>]]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(!disk_init_striped(argv[1],atoi(argv[2]),stripe,diskflags)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
+	// a mapped image is already cached by the kernel, and fs.c reads its metadata in place
+	if(!cache_init((diskflags&DISK_FLAG_MMAP) ? 0 : CACHE_DEFAULT_NFRAMES)) {
+		printf("couldn't initialize block cache\n");
+		return 1;
+	}
+
 	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
 
 	while(1) {
-		printf(" simplefs> ");
-		fflush(stdout);
+		if(!batch) {
+			printf(" simplefs> ");
+			fflush(stdout);
+		}
 
-		if(!fgets(line,sizeof(line),stdin)) break;
+		if(!fgets(line,sizeof(line),input)) break;
 
 		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+		line[strcspn(line,"\n")] = 0;	// a manifest's last line may have no newline
 
 		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
 		if(args==0) continue;
@@ -48,9 +85,25 @@ int main( int argc, char *argv[] )
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
+					failures++;
+				}
+			} else if(args==2 && !strcmp(arg1,"extents")) {
+				if(fs_format_version(FS_VERSION_EXTENTS)) {
+					printf("disk formatted with extents.\n");
+				} else {
+					printf("format failed!\n");
+					failures++;
+				}
+			} else if(args==3 && !strcmp(arg1,"extents") && !strcmp(arg2,"compress")) {
+				if(fs_format_compressed()) {
+					printf("disk formatted with extents, new files compressed.\n");
+				} else {
+					printf("format failed!\n");
+					failures++;
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [extents [compress]]\n");
+				failures++;
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -58,15 +111,62 @@ int main( int argc, char *argv[] )
 					printf("disk mounted.\n");
 				} else {
 					printf("mount failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: mount\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"unmount")) {
+			if(args==1) {
+				if(fs_unmount()) {
+					printf("disk unmounted.\n");
+				} else {
+					printf("unmount failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: unmount\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: sync\n");
+				failures++;
 			}
 		} else if(!strcmp(cmd,"debug")) {
 			if(args==1) {
 				fs_debug();
 			} else {
 				printf("use: debug\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"fragstats")) {
+			if(args==1) {
+				if(!fs_fragstats()) {
+					printf("fragstats failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: fragstats\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1) {
+				stats_print();
+			} else if(args==2 && !strcmp(arg1,"reset")) {
+				stats_reset();
+				printf("statistics reset.\n");
+			} else {
+				printf("use: stats [reset]\n");
+				failures++;
 			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
@@ -76,9 +176,11 @@ int main( int argc, char *argv[] )
 					printf("inode %d has size %d\n",inumber,result);
 				} else {
 					printf("getsize failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: getsize <inumber>\n");
+				failures++;
 			}
 			
 		} else if(!strcmp(cmd,"create")) {
@@ -88,9 +190,11 @@ int main( int argc, char *argv[] )
 					printf("created inode %d\n",inumber);
 				} else {
 					printf("create failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: create\n");
+				failures++;
 			}
 		} else if(!strcmp(cmd,"delete")) {
 			if(args==2) {
@@ -99,18 +203,118 @@ int main( int argc, char *argv[] )
 					printf("inode %d deleted.\n",inumber);
 				} else {
 					printf("delete failed!\n");	
+					failures++;
 				}
 			} else {
 				printf("use: delete <inumber>\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"createbatch")) {
+			if(args==2 && (count=atoi(arg1))>0) {
+				inumbers = malloc(count*sizeof(int));
+				result = inumbers ? fs_create_batch(count,inumbers) : 0;
+				if(result>0) {
+					printf("created %d inodes:",result);
+					for(int i=0;i<result;i++) printf(" %d",inumbers[i]);
+					printf("\n");
+				} else {
+					printf("create failed!\n");
+					failures++;
+				}
+				free(inumbers);
+			} else {
+				printf("use: createbatch <count>\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"deletebatch")) {
+			if(args==3 && atoi(arg1)<=atoi(arg2)) {
+				count = atoi(arg2)-atoi(arg1)+1;
+				inumbers = inumber_range(atoi(arg1),atoi(arg2));
+				result = fs_delete_batch(inumbers,count);
+				printf("%d inodes deleted.\n",result);
+				if(result<count) failures++;
+				free(inumbers);
+			} else {
+				printf("use: deletebatch <first> <last>\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"getsizebatch")) {
+			if(args==3 && atoi(arg1)<=atoi(arg2)) {
+				count = atoi(arg2)-atoi(arg1)+1;
+				inumbers = inumber_range(atoi(arg1),atoi(arg2));
+				sizes = malloc(count*sizeof(int));
+				result = sizes ? fs_getsize_batch(inumbers,count,sizes) : -1;
+				if(result>=0) {
+					for(int i=0;i<count;i++) {
+						if(sizes[i]>=0) printf("inode %d has size %d\n",inumbers[i],sizes[i]);
+					}
+				} else {
+					printf("getsize failed!\n");
+					failures++;
+				}
+				free(inumbers);
+				free(sizes);
+			} else {
+				printf("use: getsizebatch <first> <last>\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"deferdelete")) {
+			if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+				fs_set_deferred_delete(!strcmp(arg1,"on"));
+				printf("deferred delete %s.\n",arg1);
+			} else {
+				printf("use: deferdelete on|off\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"compress")) {
+			if(args==3 && (!strcmp(arg2,"on") || !strcmp(arg2,"off"))) {
+				inumber = atoi(arg1);
+				if(fs_set_compressed(inumber,!strcmp(arg2,"on"))) {
+					printf("inode %d compression %s.\n",inumber,arg2);
+				} else {
+					printf("compress failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: compress <inumber> on|off\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"reclaim")) {
+			if(args==1 || args==2) {
+				result = fs_reclaim(args==2 ? atoi(arg1) : 0);
+				if(result>=0) {
+					printf("reclaimed %d blocks.\n",result);
+				} else {
+					printf("reclaim failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: reclaim [blocks]\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"scrub")) {
+			if(args==1) {
+				result = disk_verify(0,disk_size());
+				if(result>=0) {
+					printf("scrubbed %d blocks, %d failed their checksums.\n",disk_size(),result);
+				} else {
+					printf("scrub failed: the disk was opened without checksums!\n");
+					failures++;
+				}
+			} else {
+				printf("use: scrub\n");
+				failures++;
 			}
 		} else if(!strcmp(cmd,"cat")) {
 			if(args==2) {
 				inumber = atoi(arg1);
 				if(!do_copyout(inumber,"/dev/stdout")) {
 					printf("cat failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: cat <inumber>\n");
+				failures++;
 			}
 
 		} else if(!strcmp(cmd,"copyin")) {
@@ -120,9 +324,11 @@ int main( int argc, char *argv[] )
 					printf("copied file %s to inode %d\n",arg1,inumber);
 				} else {
 					printf("copy failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: copyin <filename> <inumber>\n");
+				failures++;
 			}
 
 		} else if(!strcmp(cmd,"copyout")) {
@@ -132,21 +338,36 @@ int main( int argc, char *argv[] )
 					printf("copied inode %d to file %s\n",inumber,arg2);
 				} else {
 					printf("copy failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: copyout <inumber> <filename>\n");
+				failures++;
 			}
 
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [extents [compress]]\n");
 			printf("    mount\n");
+			printf("    unmount\n");
+			printf("    sync\n");
 			printf("    debug\n");
+			printf("    fragstats\n");
+			printf("    stats   [reset]\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
+			printf("    createbatch <count>\n");
+			printf("    deletebatch <first> <last>\n");
+			printf("    getsizebatch <first> <last>\n");
+			printf("    deferdelete on|off\n");
+			printf("    compress <inode> on|off\n");
+			printf("    reclaim [blocks]\n");
+			printf("    scrub\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    defrag\n");
+			printf("    defragstep <budget>\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -156,32 +377,190 @@ int main( int argc, char *argv[] )
 			break;
 		} else if(!strcmp(cmd,"defrag")) {
 			if(args==1) {
-				if(fs_defrag()) {
-					printf("disk defragged.\n");
+				result = fs_defrag();
+				if(result>=0) {
+					printf("disk defragged, %d blocks moved.\n",result);
 				} else {
 					printf("defrag failed!\n");
+					failures++;
 				}
 			} else {
 				printf("use: defrag\n");
+				failures++;
+			}
+		} else if(!strcmp(cmd,"defragstep")) {
+			if(args==2) {
+				result = fs_defrag_step(atoi(arg1));
+				if(result>=0) {
+					printf("defrag step moved %d blocks.\n",result);
+				} else {
+					printf("defrag step failed!\n");
+					failures++;
+				}
+			} else {
+				printf("use: defragstep <budget>\n");
+				failures++;
 			}
 		} else {
 			printf("unknown command: %s\n",cmd);
+			failures++;
 			printf("type 'help' for a list of commands.\n");
 			result = 1;
 		}
 	}
 
+	if(input!=stdin) fclose(input);
+
 	printf("closing emulated disk.\n");
+	fs_unmount();
+	cache_close();
 	disk_close();
 
+	return batch && failures ? 1 : 0;
+}
+
+// the inumbers first to last, for the batch commands
+static int *inumber_range( int first, int last )
+{
+	int *inumbers = malloc((last-first+1)*sizeof(int));
+	if(!inumbers) {
+		printf("ERROR: out of memory!\n");
+		exit(1);
+	}
+	for(int i=first;i<=last;i++) inumbers[i-first] = i;
+	return inumbers;
+}
+
+/*
+copyin and copyout move a file through a pair of buffers in turn: while
+the shell hands one to fs_write (or fills it with fs_read), a host thread
+fills the other from the host file (or empties it there), so host I/O and
+file system I/O overlap.  A buffer holds as much of the file as it can, up
+to COPY_CHUNK_MAX, so a file that fits is written in one call and the
+allocator reserves it a single run; such a file needs no thread either.
+*/
+
+#define COPY_CHUNK_MAX (4*1024*1024)
+
+struct copy_pipe {
+	FILE *file;
+	int chunk;		// bytes each buffer holds
+	char *buffer[2];
+	int length[2];		// bytes in each
+	int last[2];		// set on the buffer that ends the file
+	int full[2];
+	int stopped;		// either side gave up early
+	int error;		// errno from the host file, if it failed
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+// the chunk for a file of length bytes, or of unknown length if negative
+static int copy_chunk( long length )
+{
+	if(length<0 || length>=COPY_CHUNK_MAX) return COPY_CHUNK_MAX;
+	return length ? (length+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE*DISK_BLOCK_SIZE : DISK_BLOCK_SIZE;
+}
+
+static int pipe_open( struct copy_pipe *p, FILE *file, int chunk, int threaded )
+{
+	memset(p,0,sizeof(*p));
+	p->file = file;
+	p->chunk = chunk;
+	p->buffer[0] = malloc(chunk);
+	p->buffer[1] = threaded ? malloc(chunk) : 0;
+	if(!p->buffer[0] || (threaded && !p->buffer[1])) {
+		free(p->buffer[0]);
+		free(p->buffer[1]);
+		printf("couldn't allocate %d bytes of copy buffers\n",threaded ? 2*chunk : chunk);
+		return 0;
+	}
+	pthread_mutex_init(&p->lock,0);
+	pthread_cond_init(&p->changed,0);
+	return 1;
+}
+
+static void pipe_close( struct copy_pipe *p )
+{
+	pthread_cond_destroy(&p->changed);
+	pthread_mutex_destroy(&p->lock);
+	free(p->buffer[0]);
+	free(p->buffer[1]);
+}
+
+// wait until buffer k is full, or empty; 0 if it never will be because the other side stopped
+static int pipe_wait( struct copy_pipe *p, int k, int full )
+{
+	pthread_mutex_lock(&p->lock);
+	while(p->full[k]!=full && !p->stopped) pthread_cond_wait(&p->changed,&p->lock);
+	int ready = p->full[k]==full;
+	pthread_mutex_unlock(&p->lock);
+	return ready;
+}
+
+static void pipe_set( struct copy_pipe *p, int k, int full )
+{
+	pthread_mutex_lock(&p->lock);
+	p->full[k] = full;
+	pthread_cond_broadcast(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void pipe_stop( struct copy_pipe *p )
+{
+	pthread_mutex_lock(&p->lock);
+	p->stopped = 1;
+	pthread_cond_broadcast(&p->changed);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// the host side of one buffer: fill it from the file, or empty it there
+static void host_read( struct copy_pipe *p, int k )
+{
+	p->length[k] = fread(p->buffer[k],1,p->chunk,p->file);
+	p->last[k] = p->length[k]<p->chunk;
+	if(p->last[k] && ferror(p->file)) p->error = errno ? errno : EIO;
+}
+
+static void host_write( struct copy_pipe *p, int k )
+{
+	if(fwrite(p->buffer[k],1,p->length[k],p->file)!=(size_t)p->length[k]) p->error = errno ? errno : EIO;
+}
+
+static void *host_reader( void *arg )
+{
+	struct copy_pipe *p = arg;
+	for(int k=0;pipe_wait(p,k,0);k^=1) {
+		host_read(p,k);
+		pipe_set(p,k,1);
+		if(p->last[k]) break;
+	}
+	return 0;
+}
+
+static void *host_writer( void *arg )
+{
+	struct copy_pipe *p = arg;
+	for(int k=0;pipe_wait(p,k,1);k^=1) {
+		int last = p->last[k];
+		host_write(p,k);
+		if(p->error) {
+			pipe_stop(p);
+			break;
+		}
+		pipe_set(p,k,0);
+		if(last) break;
+	}
 	return 0;
 }
 
 static int do_copyin( const char *filename, int inumber )
 {
 	FILE *file;
+	struct copy_pipe pipe;
+	pthread_t thread;
 	int offset=0, result, actual;
-	char buffer[16384];
+	int complete = 1;	// cleared when fs_write takes less than it was given
 
 	file = fopen(filename,"r");
 	if(!file) {
@@ -189,34 +568,72 @@ static int do_copyin( const char *filename, int inumber )
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
+	// a pipe or a device has no length to go by
+	long length = -1;
+	if(fseek(file,0,SEEK_END)==0) {
+		length = ftell(file);
+		if(fseek(file,0,SEEK_SET)!=0) length = -1;
+	}
+	errno = 0;
+	clearerr(file);
+
+	int chunk = copy_chunk(length);
+	int threaded = length<0 || length>chunk;
+	if(!pipe_open(&pipe,file,chunk,threaded)) {
+		fclose(file);
+		return 0;
+	}
+	if(threaded && pthread_create(&thread,0,host_reader,&pipe)!=0) threaded = 0;
+
+	for(int k=0;;k^=threaded) {
+		if(!threaded) host_read(&pipe,k);
+		else if(!pipe_wait(&pipe,k,1)) break;
+		result = pipe.length[k];
+		int last = pipe.last[k];
 		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
+			actual = fs_write(inumber,pipe.buffer[k],result,offset);
 			if(actual<0) {
 				printf("ERROR: fs_write return invalid result %d\n",actual);
+				complete = 0;
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
 				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				complete = 0;
 				break;
 			}
 		}
+		if(threaded) pipe_set(&pipe,k,0);
+		if(last) break;
 	}
 
+	if(threaded) {
+		pipe_stop(&pipe);
+		pthread_join(thread,0);
+	}
+	if(pipe.error) printf("couldn't read %s: %s\n",filename,strerror(pipe.error));
 	printf("%d bytes copied\n",offset);
 
+	result = complete && !pipe.error;
+	pipe_close(&pipe);
 	fclose(file);
-	return 1;
+	return result;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
 	FILE *file;
+	struct copy_pipe pipe;
+	pthread_t thread;
 	int offset=0, result;
-	char buffer[16384];
+
+	// checked before the host file is opened, so a bad inumber leaves it untouched
+	int length = fs_getsize(inumber);
+	if(length<0) {
+		printf("couldn't read inode %d: it is not a valid inode\n",inumber);
+		return 0;
+	}
 
 	file = fopen(filename,"w");
 	if(!file) {
@@ -224,16 +641,35 @@ static int do_copyout( int inumber, const char *filename )
 		return 0;
 	}
 
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+	int chunk = copy_chunk(length);
+	int threaded = length>chunk;
+	if(!pipe_open(&pipe,file,chunk,threaded)) {
+		fclose(file);
+		return 0;
+	}
+	if(threaded && pthread_create(&thread,0,host_writer,&pipe)!=0) threaded = 0;
+
+	for(int k=0;;k^=threaded) {
+		if(threaded && !pipe_wait(&pipe,k,0)) break;
+		result = fs_read(inumber,pipe.buffer[k],chunk,offset);
+		pipe.length[k] = result>0 ? result : 0;
+		offset += pipe.length[k];
+		pipe.last[k] = result<=0 || offset>=length;
+		int last = pipe.last[k];
+		if(threaded) pipe_set(&pipe,k,1);
+		else host_write(&pipe,k);
+		if(last || (!threaded && pipe.error)) break;
 	}
 
+	if(threaded) pthread_join(thread,0);
+	if(pipe.error) printf("couldn't write %s: %s\n",filename,strerror(pipe.error));
 	printf("%d bytes copied\n",offset);
 
-	fclose(file);
-	return 1;
+	result = !pipe.error;
+	pipe_close(&pipe);
+	if(fclose(file)!=0 && result) {
+		printf("couldn't write %s: %s\n",filename,strerror(errno));
+		result = 0;
+	}
+	return result;
 }
-
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#ifdef FS_STATS
+
+/*
+Every counter is bumped with a relaxed atomic add from whatever thread
+gets there, so nothing here takes a lock.  Latencies and allocator scan
+lengths go into power-of-two histograms; percentiles are read off those,
+so they are upper bounds good to a factor of two, while the maxima and
+means are exact.
+*/
+
+struct stats_histogram {
+	long long count;
+	long long total;
+	long long max;
+	long long buckets[STATS_BUCKETS];
+};
+
+static struct stats_histogram op_latency[STATS_NOPS];	// nanoseconds
+static long long block_requests[STATS_NKINDS][2];	// [kind][writing]
+static long long cache_lookups[2];	// [hit]
+static long long disk_blocks[2];	// [writing]
+static long long allocs[STATS_NALLOCS];
+static struct stats_histogram alloc_scan;	// blocks a next-fit search passed over
+
+static const char *op_names[STATS_NOPS] = {
+	"format", "mount", "unmount", "sync", "create", "delete", "getsize",
+	"create_batch", "delete_batch", "getsize_batch", "reclaim",
+	"read", "write", "defrag", "defrag_step", "set_compressed",
+};
+
+static const char *kind_names[STATS_NKINDS] = {
+	"superblock", "inode_table", "bitmap", "indirect", "data", "journal",
+};
+
+static void add( long long *counter, long long n )
+{
+	__atomic_add_fetch(counter,n,__ATOMIC_RELAXED);
+}
+
+static long long get( const long long *counter )
+{
+	return __atomic_load_n(counter,__ATOMIC_RELAXED);
+}
+
+static void record( struct stats_histogram *h, long long value )
+{
+	int b = value>0 ? 64-__builtin_clzll(value) : 0;
+	if(b>=STATS_BUCKETS) b = STATS_BUCKETS-1;
+
+	add(&h->count,1);
+	add(&h->total,value);
+	add(&h->buckets[b],1);
+
+	long long max = get(&h->max);
+	while(value>max && !__atomic_compare_exchange_n(&h->max,&max,value,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+// upper bound of the bucket the p'th percentile falls in, or the maximum if that is lower
+static long long percentile( const struct stats_histogram *h, int p )
+{
+	long long count = get(&h->count);
+	long long want = (count*p+99)/100;
+	long long seen = 0, max = get(&h->max);
+	for(int b=0;b<STATS_BUCKETS;b++) {
+		seen += get(&h->buckets[b]);
+		if(seen>=want && seen>0) {
+			long long bound = b ? 1LL<<b : 0;
+			return bound<max ? bound : max;
+		}
+	}
+	return max;
+}
+
+long long stats_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+void stats_op_done( struct stats_timer *timer )
+{
+	record(&op_latency[timer->op],stats_clock()-timer->started);
+}
+
+void stats_blocks( enum stats_kind kind, int writing, int count )
+{
+	add(&block_requests[kind][writing!=0],count);
+}
+
+void stats_cache( int hit, int count )
+{
+	add(&cache_lookups[hit!=0],count);
+}
+
+void stats_disk( int writing, int count )
+{
+	add(&disk_blocks[writing!=0],count);
+}
+
+void stats_alloc( enum stats_alloc how, int scanned )
+{
+	add(&allocs[how],1);
+	if(how==STATS_ALLOC_SCAN) record(&alloc_scan,scanned);
+}
+
+void stats_print()
+{
+	for(int op=0;op<STATS_NOPS;op++) {
+		const struct stats_histogram *h = &op_latency[op];
+		long long calls = get(&h->count);
+		if(!calls) continue;
+		printf("stats op=%s calls=%lld total_us=%.1f mean_us=%.2f p50_us=%.2f p90_us=%.2f p99_us=%.2f max_us=%.2f\n",
+			op_names[op],calls,get(&h->total)/1e3,get(&h->total)/1e3/calls,
+			percentile(h,50)/1e3,percentile(h,90)/1e3,percentile(h,99)/1e3,get(&h->max)/1e3);
+	}
+
+	for(int kind=0;kind<STATS_NKINDS;kind++) {
+		printf("stats blocks=%s reads=%lld writes=%lld\n",kind_names[kind],
+			get(&block_requests[kind][0]),get(&block_requests[kind][1]));
+	}
+
+	long long hits = get(&cache_lookups[1]), misses = get(&cache_lookups[0]);
+	printf("stats cache hits=%lld misses=%lld hit_rate=%.3f\n",hits,misses,
+		hits+misses ? (double)hits/(hits+misses) : 0);
+	printf("stats disk reads=%lld writes=%lld\n",get(&disk_blocks[0]),get(&disk_blocks[1]));
+
+	long long scans = get(&alloc_scan.count);
+	printf("stats alloc reserved=%lld goal=%lld scan=%lld failed=%lld scan_mean=%.1f scan_p99=%lld scan_max=%lld\n",
+		get(&allocs[STATS_ALLOC_RESERVED]),get(&allocs[STATS_ALLOC_GOAL]),
+		get(&allocs[STATS_ALLOC_SCAN]),get(&allocs[STATS_ALLOC_FAILED]),
+		scans ? (double)get(&alloc_scan.total)/scans : 0,percentile(&alloc_scan,99),get(&alloc_scan.max));
+}
+
+// not atomic as a whole: calls still under way may land on either side of the reset
+void stats_reset()
+{
+	memset(op_latency,0,sizeof(op_latency));
+	memset(block_requests,0,sizeof(block_requests));
+	memset(cache_lookups,0,sizeof(cache_lookups));
+	memset(disk_blocks,0,sizeof(disk_blocks));
+	memset(allocs,0,sizeof(allocs));
+	memset(&alloc_scan,0,sizeof(alloc_scan));
+}
+
+#else
+
+void stats_print()
+{
+	printf("statistics were compiled out: build with -DFS_STATS to collect them\n");
+}
+
+void stats_reset()
+{
+}
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+Counters fs.c, cache.c and disk.c bump on their hot paths.  They only exist
+with -DFS_STATS: without it each STATS_ macro below expands to nothing, and
+stats_print just says the counters were compiled out.
+*/
+
+// fs_* entry points timed by STATS_OP
+enum stats_op {
+	STATS_FORMAT,
+	STATS_MOUNT,
+	STATS_UNMOUNT,
+	STATS_SYNC,
+	STATS_CREATE,
+	STATS_DELETE,
+	STATS_GETSIZE,
+	STATS_CREATE_BATCH,
+	STATS_DELETE_BATCH,
+	STATS_GETSIZE_BATCH,
+	STATS_RECLAIM,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_DEFRAG,
+	STATS_DEFRAG_STEP,
+	STATS_SET_COMPRESSED,
+	STATS_NOPS
+};
+
+// what a block fs.c asks the cache for holds
+enum stats_kind {
+	STATS_SUPERBLOCK,
+	STATS_INODE_TABLE,
+	STATS_BITMAP,
+	STATS_INDIRECT,		// indirect pointer blocks and extent chain blocks
+	STATS_DATA,
+	STATS_JOURNAL,		// log blocks written at a commit
+	STATS_NKINDS
+};
+
+// where alloc_block found its block
+enum stats_alloc {
+	STATS_ALLOC_RESERVED,
+	STATS_ALLOC_GOAL,
+	STATS_ALLOC_SCAN,
+	STATS_ALLOC_FAILED,
+	STATS_NALLOCS
+};
+
+#define STATS_BUCKETS 40	// histogram bucket b counts values in [2^(b-1), 2^b), bucket 0 counts zeros
+
+void stats_print();
+void stats_reset();
+
+#ifdef FS_STATS
+
+struct stats_timer {
+	enum stats_op op;
+	long long started;
+};
+
+long long stats_clock();
+void stats_op_done( struct stats_timer *timer );
+void stats_blocks( enum stats_kind kind, int writing, int count );
+void stats_cache( int hit, int count );
+void stats_disk( int writing, int count );
+void stats_alloc( enum stats_alloc how, int scanned );
+
+// times the rest of the enclosing function, whichever way it returns
+#define STATS_OP(op) struct stats_timer stats_timer_ __attribute__((cleanup(stats_op_done))) = { op, stats_clock() }
+#define STATS_BLOCKS(kind,writing,count) stats_blocks(kind,writing,count)
+#define STATS_CACHE(hit,count) stats_cache(hit,count)
+#define STATS_DISK(writing,count) stats_disk(writing,count)
+#define STATS_ALLOC(how,scanned) stats_alloc(how,scanned)
+#define STATS_ONLY(...) __VA_ARGS__
+
+#else
+
+#define STATS_OP(op)
+#define STATS_BLOCKS(kind,writing,count) ((void)0)
+#define STATS_CACHE(hit,count) ((void)0)
+#define STATS_DISK(writing,count) ((void)0)
+#define STATS_ALLOC(how,scanned) ((void)0)
+#define STATS_ONLY(...)
+
+#endif
+
+#endif